@@ -4,7 +4,13 @@
 #include <vector>
 #include <string>
 #include <stdexcept>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <functional>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <string>
 #include <iostream>
@@ -23,11 +29,101 @@ enum class ValueType {
 	STRING
 };
 
+// Whether a value may be stored in an int variable. The range is checked
+// first: converting NaN, infinities or out-of-range values to int is undefined.
+inline bool isIntValue(double value) {
+	return value >= INT_MIN && value <= INT_MAX && value == std::trunc(value);
+}
+
 class Environment;
+struct FunctionNode;
 // Base class for all AST nodes
 struct ASTNode {
+	size_t sourceOffset = 0;  // Where a statement starts in the source; 0 for expressions
+	// When set, sourceOffset is relative to it: the start of the top-level
+	// statement, which an incremental edit moves without touching the tree
+	const size_t* sourceOrigin = nullptr;
+
 	virtual ~ASTNode() = default;
 	virtual double evaluate(Environment& env) const = 0;
+
+	size_t getSourceOffset() const {
+		return sourceOrigin ? *sourceOrigin + sourceOffset : sourceOffset;
+	}
+};
+
+// Takes over loops that run hot in the tree walker (on-stack replacement).
+// A loop counts its iterations and, once it reaches `threshold`, offers the
+// rest of its run here, with its condition just found true.
+class LoopTierUp {
+public:
+	size_t threshold = 1000;
+
+	virtual ~LoopTierUp() = default;
+
+	// Runs `loop` on from its body and sets `value` to the loop value, or
+	// returns false to leave the loop to the tree walker
+	virtual bool resume(const ASTNode* loop, Environment& env, double& value) = 0;
+};
+
+// Host callbacks for tracing, coverage and debugging. The tree walker and the
+// VirtualMachine both report to the hooks set on the Environment; without
+// hooks they pay a null check per statement and call, and the VM runs an
+// uninstrumented build of its dispatch loop. Compiled code reports statements
+// only when compiled with CompilerOptions::statementMarkers.
+class ExecutionHooks {
+public:
+	virtual ~ExecutionHooks() = default;
+
+	// A statement is about to run; `offset` is its ASTNode::sourceOffset.
+	// Blocks are not reported, their statements are.
+	virtual void onStatement(size_t /*offset*/) {}
+
+	// The if or loop statement at `offset` takes a branch. Arm 0 is the then
+	// branch, or a run of the loop body; arm 1 is the else branch (taken also
+	// without one), or leaving the loop.
+	virtual void onBranch(size_t /*offset*/, unsigned /*arm*/) {}
+
+	// A script function body starts and ends; a memoized result found in the
+	// cache runs no body. `result` is 0 when the body threw.
+	virtual void onFunctionEnter(const std::string& /*name*/, const std::vector<double>& /*args*/) {}
+	virtual void onFunctionExit(const std::string& /*name*/, double /*result*/, bool /*threw*/) {}
+
+	// A native function is called and returns, or throws
+	virtual void onNativeEnter(const std::string& /*name*/, const std::vector<double>& /*args*/) {}
+	virtual void onNativeExit(const std::string& /*name*/, double /*result*/, bool /*threw*/) {}
+
+	// Run `call`, reporting it as a call of script function `name`
+	template<typename Call>
+	double traceFunction(const std::string& name, const std::vector<double>& args, Call call) {
+		onFunctionEnter(name, args);
+		double result;
+		try {
+			result = call();
+		}
+		catch (...) {
+			onFunctionExit(name, 0, true);
+			throw;
+		}
+		onFunctionExit(name, result, false);
+		return result;
+	}
+
+	// Run `call`, reporting it as a call of native function `name`
+	template<typename Call>
+	double traceNative(const std::string& name, const std::vector<double>& args, Call call) {
+		onNativeEnter(name, args);
+		double result;
+		try {
+			result = call();
+		}
+		catch (...) {
+			onNativeExit(name, 0, true);
+			throw;
+		}
+		onNativeExit(name, result, false);
+		return result;
+	}
 };
 
 // The Environment class to manage functions and variables
@@ -35,86 +131,254 @@ class Environment {
 public:
 	Environment() {}
 
-	// Register a built-in C++ function by name
-	void registerFunction(const std::string& name, ScriptFunction func) {
+	// Register a built-in C++ function by name. A pure function has no side
+	// effects and never throws, so optimizers may drop calls whose result is unused.
+	void registerFunction(const std::string& name, ScriptFunction func, bool pure = false) {
 		if (functionRegistry.find(name) != functionRegistry.end()) {
 			throw std::runtime_error("Function already registered: " + name);
 		}
 		functionRegistry[name] = func;
+		if (pure) {
+			pureFunctions.insert(name);
+		}
+		++registryVersion;
+	}
+
+	// True for natives registered as pure
+	bool isPureFunction(const std::string& name) const {
+		return pureFunctions.count(name) != 0;
 	}
 
 	// Register a user-defined function (AST-based)
-	void registerUserFunction(const std::string& name, ASTNode* functionNode) {
+	void registerUserFunction(const std::string& name, FunctionNode* functionNode) {
 		if (userFunctionRegistry.find(name) != userFunctionRegistry.end()) {
 			throw std::runtime_error("User-defined function already registered: " + name);
 		}
 		userFunctionRegistry[name] = functionNode;
+		memoTables.erase(name);
+		++registryVersion;
+	}
+
+	// Drop a user-defined function, e.g. before its definition is re-parsed
+	void unregisterUserFunction(const std::string& name) {
+		userFunctionRegistry.erase(name);
+		memoTables.erase(name);
+		++registryVersion;
+	}
+
+	// Changes whenever a function is registered or dropped; lookups made at
+	// one version stay valid as long as it does not change
+	uint64_t getRegistryVersion() const {
+		return registryVersion;
+	}
+
+	// The native or user function called by a name, or nullptr
+	const ScriptFunction* findNativeFunction(const std::string& name) const {
+		auto native = functionRegistry.find(name);
+		return native != functionRegistry.end() ? &native->second : nullptr;
+	}
+
+	const FunctionNode* findUserFunction(const std::string& name) const {
+		auto user = userFunctionRegistry.find(name);
+		return user != userFunctionRegistry.end() ? user->second : nullptr;
+	}
+
+	// Where hot loops tier up, or nullptr to keep them in the tree walker
+	void setLoopTierUp(LoopTierUp* tierUp) {
+		loopTierUp = tierUp;
+	}
+
+	LoopTierUp* getLoopTierUp() const {
+		return loopTierUp;
+	}
+
+	// Where execution is reported, or nullptr for no reporting
+	void setHooks(ExecutionHooks* hooks) {
+		this->hooks = hooks;
+	}
+
+	ExecutionHooks* getHooks() const {
+		return hooks;
 	}
 
 	// Evaluate a function by name with given arguments
-	double evaluateFunction(const std::string& name, const std::vector<double>& args) const {
-		// Check if the function is a C++ native function
-		if (functionRegistry.find(name) != functionRegistry.end()) {
-			return functionRegistry.at(name)(args);
+	double evaluateFunction(const std::string& name, const std::vector<double>& args) const;
+
+	// Cached results of memoized user functions, bounded per function
+	struct MemoStats {
+		size_t hits = 0;
+		size_t misses = 0;
+		size_t evictions = 0;  // Results dropped to make room
+	};
+
+	static constexpr size_t MEMO_CAPACITY = 4096;  // Results kept per function
+
+	// Find the result of an earlier call with the same arguments; counts a hit or a miss
+	bool findMemoized(const std::string& name, const std::vector<double>& args, double& result) {
+		auto table = memoTables.find(name);
+		if (table != memoTables.end()) {
+			auto entry = table->second.find(memoKey(args));
+			if (entry != table->second.end()) {
+				++memoStats.hits;
+				result = entry->second;
+				return true;
+			}
 		}
+		++memoStats.misses;
+		return false;
+	}
 
-		// Check if the function is a user-defined function
-		if (userFunctionRegistry.find(name) != userFunctionRegistry.end()) {
-			// Assuming ASTNode supports a context to manage arguments for user functions
-			ASTNode* functionNode = userFunctionRegistry.at(name);
-			return functionNode->evaluate(*const_cast<Environment*>(this));
+	// Keep a result; a full table is emptied first
+	void memoize(const std::string& name, const std::vector<double>& args, double result) {
+		MemoTable& table = memoTables[name];
+		if (table.size() >= MEMO_CAPACITY) {
+			memoStats.evictions += table.size();
+			table.clear();
 		}
+		table[memoKey(args)] = result;
+	}
+
+	const MemoStats& getMemoStats() const {
+		return memoStats;
+	}
+
+	// Enter and leave the variable scope of a user function call
+	void pushFrame() {
+		callFrames.emplace_back();
+	}
 
-		throw std::runtime_error("Undefined function: " + name);
+	void popFrame() {
+		callFrames.pop_back();
 	}
 
 	// Declare a variable by name and type
 	void declareVariable(const std::string& name, ValueType type) {
-		if (variableTable.find(name) != variableTable.end()) {
+		VariableTable& table = callFrames.empty() ? variableTable : callFrames.back();
+		if (table.find(name) != table.end()) {
 			throw std::runtime_error("Variable already declared: " + name);
 		}
-		variableTable[name] = { 0, type };  // Initialize with default value 0
+		table[name] = { 0, type };  // Initialize with default value 0
 	}
 
 	// Set a variable's value
 	void setVariable(const std::string& name, double value) {
-		if (variableTable.find(name) == variableTable.end()) {
+		assign(findVariable(name), name, value);
+	}
+
+	bool hasVariable(const std::string& name) const {
+		return const_cast<Environment*>(this)->findVariable(name) != nullptr;
+	}
+
+	// Get a variable's value
+	double getVariable(const std::string& name) const {
+		return read(const_cast<Environment*>(this)->findVariable(name), name);
+	}
+
+	// Set or get a global, skipping the locals of active calls
+	void setGlobalVariable(const std::string& name, double value) {
+		auto global = variableTable.find(name);
+		assign(global != variableTable.end() ? &global->second : nullptr, name, value);
+	}
+
+	double getGlobalVariable(const std::string& name) const {
+		auto global = variableTable.find(name);
+		return read(global != variableTable.end() ? &global->second : nullptr, name);
+	}
+
+private:
+	using VariableTable = std::unordered_map<std::string, std::pair<double, ValueType>>;
+
+	void assign(std::pair<double, ValueType>* variable, const std::string& name, double value) {
+		if (!variable) {
 			throw std::runtime_error("Undefined variable: " + name);
 		}
 
-		ValueType type = variableTable[name].second;
+		ValueType type = variable->second;
 
 		// Perform type checks to ensure correctness
 		if (type == ValueType::INT) {
-			if (value != static_cast<int>(value)) {
+			if (!isIntValue(value)) {
 				throw std::runtime_error("Type error: Expected int value for variable " + name);
 			}
 		}
 
 		// Assign the value to the variable
-		variableTable[name].first = value;
+		variable->first = value;
 	}
 
-	// Get a variable's value
-	double getVariable(const std::string& name) const {
-		if (variableTable.find(name) == variableTable.end()) {
+	static double read(const std::pair<double, ValueType>* variable, const std::string& name) {
+		if (!variable) {
 			throw std::runtime_error("Undefined variable: " + name);
 		}
-		return variableTable.at(name).first;
+		return variable->first;
 	}
 
-private:
 	// Registry for native C++ functions
 	std::unordered_map<std::string, ScriptFunction> functionRegistry;
+	std::unordered_set<std::string> pureFunctions;
 
 	// Registry for user-defined functions
-	std::unordered_map<std::string, ASTNode*> userFunctionRegistry;
+	std::unordered_map<std::string, FunctionNode*> userFunctionRegistry;
+
+	uint64_t registryVersion = 1;
+	LoopTierUp* loopTierUp = nullptr;
+	ExecutionHooks* hooks = nullptr;
+
+	// Arguments by bit pattern, so that 0 and -0 stay apart
+	using MemoKey = std::vector<uint64_t>;
+
+	struct MemoKeyHash {
+		size_t operator()(const MemoKey& key) const {
+			size_t hash = key.size();
+			for (uint64_t bits : key) {
+				hash = hash * 1000003 ^ std::hash<uint64_t>()(bits);
+			}
+			return hash;
+		}
+	};
+
+	using MemoTable = std::unordered_map<MemoKey, double, MemoKeyHash>;
+	std::unordered_map<std::string, MemoTable> memoTables;
+	MemoStats memoStats;
+
+	static MemoKey memoKey(const std::vector<double>& args) {
+		MemoKey key(args.size());
+		if (!args.empty()) {
+			std::memcpy(key.data(), args.data(), args.size() * sizeof(double));
+		}
+		return key;
+	}
 
 	// Table for managing variables (name -> (value, type))
-	std::unordered_map<std::string, std::pair<double, ValueType>> variableTable;
+	VariableTable variableTable;
+
+	// Locals of the active user function calls, innermost last
+	std::vector<VariableTable> callFrames;
+
+	// Look a variable up in the current call frame, then in the globals
+	std::pair<double, ValueType>* findVariable(const std::string& name) {
+		if (!callFrames.empty()) {
+			auto local = callFrames.back().find(name);
+			if (local != callFrames.back().end()) {
+				return &local->second;
+			}
+		}
+		auto global = variableTable.find(name);
+		return global != variableTable.end() ? &global->second : nullptr;
+	}
 };
 
 
+// Evaluate a statement of a program, block, branch, loop or function body,
+// reporting it to the execution hooks first
+inline double evaluateStatement(Environment& env, const ASTNode* node);
+
+// Tell the execution hooks which arm an if or loop statement takes
+inline void reportBranch(Environment& env, const ASTNode* node, unsigned arm) {
+	if (ExecutionHooks* hooks = env.getHooks()) {
+		hooks->onBranch(node->getSourceOffset(), arm);
+	}
+}
 
 // Program Node: Represents a collection of statements
 struct ProgramNode : public ASTNode {
@@ -124,7 +388,7 @@ struct ProgramNode : public ASTNode {
 
 	double evaluate(Environment& env) const override {
 		for (ASTNode* statement : statements) {
-			statement->evaluate(env);
+			evaluateStatement(env, statement);
 		}
 		return 0; // Program as a whole doesnt return a specific value
 	}
@@ -153,12 +417,19 @@ struct ForNode : public ASTNode {
 
 		// Loop while the condition is true
 		double result = 0;
+		LoopTierUp* tierUp = env.getLoopTierUp();
+		size_t iterations = 0;
 		while (condition->evaluate(env) != 0) {
-			result = body->evaluate(env);
+			if (tierUp && ++iterations == tierUp->threshold && tierUp->resume(this, env, result)) {
+				return result;
+			}
+			reportBranch(env, this, 0);
+			result = evaluateStatement(env, body);
 			if (update) {
 				update->evaluate(env);
 			}
 		}
+		reportBranch(env, this, 1);
 		return result;
 	}
 
@@ -179,9 +450,19 @@ struct DoWhileNode : public ASTNode {
 
 	double evaluate(Environment& env) const override {
 		double result = 0;
-		do {
-			result = body->evaluate(env);
-		} while (condition->evaluate(env) != 0);
+		LoopTierUp* tierUp = env.getLoopTierUp();
+		size_t iterations = 0;
+		for (;;) {
+			reportBranch(env, this, 0);
+			result = evaluateStatement(env, body);
+			if (condition->evaluate(env) == 0) {
+				break;
+			}
+			if (tierUp && ++iterations == tierUp->threshold && tierUp->resume(this, env, result)) {
+				return result;
+			}
+		}
+		reportBranch(env, this, 1);
 		return result;
 	}
 
@@ -200,7 +481,7 @@ struct BlockNode : public ASTNode {
 
 	double evaluate(Environment& env) const override {
 		for (ASTNode* statement : statements) {
-			statement->evaluate(env);
+			evaluateStatement(env, statement);
 		}
 		return 0; // A block doesnt return a value directly
 	}
@@ -212,6 +493,14 @@ struct BlockNode : public ASTNode {
 	}
 };
 
+inline double evaluateStatement(Environment& env, const ASTNode* node) {
+	ExecutionHooks* hooks = env.getHooks();
+	if (hooks && !dynamic_cast<const BlockNode*>(node)) {
+		hooks->onStatement(node->getSourceOffset());
+	}
+	return node->evaluate(env);
+}
+
 // Declaration Node: Represents a variable declaration, possibly with an initializer
 struct DeclarationNode : public ASTNode {
 	std::string variableName;
@@ -281,22 +570,104 @@ struct FunctionNode : public ASTNode {
 	std::string name;
 	ValueType returnType;
 	std::vector<std::pair<std::string, ValueType>> parameters;
-	ASTNode* body;
+	mutable ASTNode* body;
+	mutable std::string deferredBody;  // Body source not parsed yet (lazy parsing)
+	bool memoized = false;  // Declared memo or pure: results are cached by arguments
+	size_t deferredOffset = 0;  // Offset of the deferred body from the start of the definition
+	// Parses the deferred body; set by the parser that deferred it
+	ASTNode* (*parseDeferred)(const FunctionNode& definition, Environment& env) = nullptr;
 
 	FunctionNode(const std::string& name, ValueType returnType,
 		const std::vector<std::pair<std::string, ValueType>>& parameters, ASTNode* body)
 		: name(name), returnType(returnType), parameters(parameters), body(body) {}
 
+	FunctionNode(const std::string& name, ValueType returnType,
+		const std::vector<std::pair<std::string, ValueType>>& parameters, const std::string& deferredBody)
+		: name(name), returnType(returnType), parameters(parameters), body(nullptr), deferredBody(deferredBody) {}
+
 	double evaluate(Environment& env) const override {
-		// FunctionNode itself is not "evaluated"; it's stored in the environment
-		throw std::runtime_error("FunctionNode cannot be directly evaluated.");
+		// The definition was registered in the environment while parsing
+		return 0;
+	}
+
+	// Bind the arguments in a fresh call frame and evaluate the body
+	double call(Environment& env, const std::vector<double>& args) const {
+		if (args.size() != parameters.size()) {
+			throw std::runtime_error("Function " + name + " expects " + std::to_string(parameters.size()) + " arguments");
+		}
+
+		ASTNode* code = resolveBody(env);
+		double result;
+		if (memoized && env.findMemoized(name, args, result)) {
+			return result;
+		}
+		ExecutionHooks* hooks = env.getHooks();
+		result = hooks ? hooks->traceFunction(name, args, [&] { return run(env, code, args); }) : run(env, code, args);
+		if (memoized) {
+			env.memoize(name, args, result);
+		}
+		return result;
+	}
+
+	size_t getDeferredOffset() const {
+		return getSourceOffset() + deferredOffset;
+	}
+
+	// The parsed body, parsing a deferred body on first use
+	ASTNode* resolveBody(Environment& env) const {
+		if (!body) {
+			if (!parseDeferred) {
+				throw std::runtime_error("Function body not parsed: " + name);
+			}
+			body = parseDeferred(*this, env);
+			deferredBody.clear();
+			deferredBody.shrink_to_fit();
+		}
+		return body;
 	}
 
 	~FunctionNode() {
 		delete body;
 	}
+
+private:
+	double run(Environment& env, const ASTNode* code, const std::vector<double>& args) const {
+		env.pushFrame();
+		try {
+			for (size_t i = 0; i < parameters.size(); ++i) {
+				env.declareVariable(parameters[i].first, parameters[i].second);
+				env.setVariable(parameters[i].first, args[i]);
+			}
+			double result = evaluateStatement(env, code);
+			env.popFrame();
+			return result;
+		}
+		catch (...) {
+			env.popFrame();
+			throw;
+		}
+	}
 };
 
+inline double Environment::evaluateFunction(const std::string& name, const std::vector<double>& args) const {
+	// Check if the function is a C++ native function
+	auto native = functionRegistry.find(name);
+	if (native != functionRegistry.end()) {
+		if (hooks) {
+			return hooks->traceNative(name, args, [&] { return native->second(args); });
+		}
+		return native->second(args);
+	}
+
+	// Check if the function is a user-defined function
+	auto user = userFunctionRegistry.find(name);
+	if (user != userFunctionRegistry.end()) {
+		return user->second->call(*const_cast<Environment*>(this), args);
+	}
+
+	throw std::runtime_error("Undefined function: " + name);
+}
+
 // Function Call Node: Represents calling a function with arguments
 struct FunctionCallNode : public ASTNode {
 	std::string name;
@@ -346,11 +717,12 @@ struct IfNode : public ASTNode {
 
 	double evaluate(Environment& env) const override {
 		double conditionValue = condition->evaluate(env);
+		reportBranch(env, this, conditionValue != 0 ? 0 : 1);
 		if (conditionValue != 0) {
-			return thenBranch->evaluate(env);
+			return evaluateStatement(env, thenBranch);
 		}
 		else if (elseBranch) {
-			return elseBranch->evaluate(env);
+			return evaluateStatement(env, elseBranch);
 		}
 		return 0;
 	}
@@ -371,9 +743,16 @@ struct WhileNode : public ASTNode {
 
 	double evaluate(Environment& env) const override {
 		double result = 0;
+		LoopTierUp* tierUp = env.getLoopTierUp();
+		size_t iterations = 0;
 		while (condition->evaluate(env) != 0) {
-			result = body->evaluate(env);
+			if (tierUp && ++iterations == tierUp->threshold && tierUp->resume(this, env, result)) {
+				return result;
+			}
+			reportBranch(env, this, 0);
+			result = evaluateStatement(env, body);
 		}
+		reportBranch(env, this, 1);
 		return result;
 	}
 
@@ -395,7 +774,10 @@ struct BinaryOpNode : public ASTNode {
 	double evaluate(Environment& env) const override {
 		double leftValue = left->evaluate(env);
 		double rightValue = right->evaluate(env);
+		return apply(op, leftValue, rightValue);
+	}
 
+	static double apply(TokenType op, double leftValue, double rightValue) {
 		switch (op) {
 		case TokenType::PLUS: return leftValue + rightValue;
 		case TokenType::MINUS: return leftValue - rightValue;
@@ -431,7 +813,10 @@ struct UnaryOpNode : public ASTNode {
 	UnaryOpNode(TokenType op, ASTNode* operand) : op(op), operand(operand) {}
 
 	double evaluate(Environment& env) const override {
-		double value = operand->evaluate(env);
+		return apply(op, operand->evaluate(env));
+	}
+
+	static double apply(TokenType op, double value) {
 		switch (op) {
 		case TokenType::MINUS: return -value;
 		case TokenType::NOT: return (value == 0) ? 1 : 0;
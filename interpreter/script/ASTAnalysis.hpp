@@ -0,0 +1,273 @@
+#pragma once
+
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "AST.hpp"
+
+// Visit the direct children of a node; nested function definitions are not entered
+template <typename Visitor>
+void forEachChild(const ASTNode* node, Visitor visit) {
+	if (auto program = dynamic_cast<const ProgramNode*>(node)) {
+		for (const ASTNode* child : program->statements) visit(child);
+	}
+	else if (auto block = dynamic_cast<const BlockNode*>(node)) {
+		for (const ASTNode* child : block->statements) visit(child);
+	}
+	else if (auto declaration = dynamic_cast<const DeclarationNode*>(node)) {
+		visit(declaration->initializer);
+	}
+	else if (auto assignment = dynamic_cast<const AssignmentNode*>(node)) {
+		visit(assignment->expression);
+	}
+	else if (auto conditional = dynamic_cast<const IfNode*>(node)) {
+		visit(conditional->condition);
+		visit(conditional->thenBranch);
+		visit(conditional->elseBranch);
+	}
+	else if (auto loop = dynamic_cast<const WhileNode*>(node)) {
+		visit(loop->condition);
+		visit(loop->body);
+	}
+	else if (auto loop = dynamic_cast<const ForNode*>(node)) {
+		visit(loop->initializer);
+		visit(loop->condition);
+		visit(loop->body);
+		visit(loop->update);
+	}
+	else if (auto loop = dynamic_cast<const DoWhileNode*>(node)) {
+		visit(loop->body);
+		visit(loop->condition);
+	}
+	else if (auto ret = dynamic_cast<const ReturnNode*>(node)) {
+		visit(ret->returnValue);
+	}
+	else if (auto binary = dynamic_cast<const BinaryOpNode*>(node)) {
+		visit(binary->left);
+		visit(binary->right);
+	}
+	else if (auto unary = dynamic_cast<const UnaryOpNode*>(node)) {
+		visit(unary->operand);
+	}
+	else if (auto call = dynamic_cast<const FunctionCallNode*>(node)) {
+		for (const ASTNode* argument : call->arguments) visit(argument);
+	}
+}
+
+// Make the statement offsets of a freshly parsed tree relative to `*origin`,
+// so that moving the tree in the source only has to move the origin.
+// Expressions keep 0.
+inline void anchorSourceOffsets(const ASTNode* root, const size_t* origin) {
+	auto anchor = [&](auto& self, const ASTNode* node) -> void {
+		if (!node) {
+			return;
+		}
+		ASTNode* statement = const_cast<ASTNode*>(node);
+		if (statement->sourceOffset != 0 || node == root) {
+			statement->sourceOffset -= *origin;
+			statement->sourceOrigin = origin;
+		}
+		if (auto definition = dynamic_cast<const FunctionNode*>(node)) {
+			self(self, definition->body);
+		}
+		forEachChild(node, [&](const ASTNode* child) { self(self, child); });
+	};
+	anchor(anchor, root);
+}
+
+// The parameters and declared locals of a function, and whether they are
+// static: no declaration may run twice in a call, shadow a parameter, or be
+// read on a path where it has not run (the tree walker would fall back to a global)
+class LocalAnalysis {
+public:
+	explicit LocalAnalysis(const FunctionNode* definition) {
+		staticLocals = analyze(definition);
+	}
+
+	bool isStatic() const {
+		return staticLocals;
+	}
+
+	const std::unordered_map<std::string, ValueType>& getLocals() const {
+		return locals;
+	}
+
+private:
+	std::unordered_map<std::string, ValueType> locals;
+	bool staticLocals = false;
+
+	bool analyze(const FunctionNode* definition) {
+		for (const auto& [name, type] : definition->parameters) {
+			if (!locals.emplace(name, type).second) {
+				return false;
+			}
+		}
+		collectDeclarations(definition->body);
+
+		std::unordered_set<std::string> definite;
+		for (const auto& parameter : definition->parameters) {
+			definite.insert(parameter.first);
+		}
+		std::unordered_set<std::string> possible = definite;
+		return dominatesUses(definition->body, definite, possible, false);
+	}
+
+	void collectDeclarations(const ASTNode* node) {
+		if (!node || dynamic_cast<const FunctionNode*>(node)) {
+			return;
+		}
+		if (auto declaration = dynamic_cast<const DeclarationNode*>(node)) {
+			locals.emplace(declaration->variableName, declaration->type);
+		}
+		forEachChild(node, [&](const ASTNode* child) { collectDeclarations(child); });
+	}
+
+	// `definite`: locals declared on every path so far; `possible`: on some path
+	bool dominatesUses(const ASTNode* node, std::unordered_set<std::string>& definite,
+		std::unordered_set<std::string>& possible, bool inLoop) {
+		if (!node || dynamic_cast<const FunctionNode*>(node)) {
+			return true;
+		}
+		auto usable = [&](const std::string& name) {
+			return !locals.count(name) || definite.count(name);
+		};
+
+		if (auto declaration = dynamic_cast<const DeclarationNode*>(node)) {
+			if (inLoop || possible.count(declaration->variableName)) {
+				return false;
+			}
+			definite.insert(declaration->variableName);
+			possible.insert(declaration->variableName);
+			return dominatesUses(declaration->initializer, definite, possible, inLoop);
+		}
+		if (auto variable = dynamic_cast<const VariableNode*>(node)) {
+			return usable(variable->name);
+		}
+		if (auto assignment = dynamic_cast<const AssignmentNode*>(node)) {
+			return dominatesUses(assignment->expression, definite, possible, inLoop) && usable(assignment->variableName);
+		}
+		if (auto conditional = dynamic_cast<const IfNode*>(node)) {
+			if (!dominatesUses(conditional->condition, definite, possible, inLoop)) {
+				return false;
+			}
+			std::unordered_set<std::string> thenDefinite = definite, elseDefinite = definite;
+			if (!dominatesUses(conditional->thenBranch, thenDefinite, possible, inLoop)
+				|| !dominatesUses(conditional->elseBranch, elseDefinite, possible, inLoop)) {
+				return false;
+			}
+			for (const std::string& name : thenDefinite) {
+				if (elseDefinite.count(name)) {
+					definite.insert(name);
+				}
+			}
+			return true;
+		}
+		if (auto loop = dynamic_cast<const WhileNode*>(node)) {
+			return dominatesUses(loop->condition, definite, possible, inLoop)
+				&& dominatesUses(loop->body, definite, possible, true);
+		}
+		if (auto loop = dynamic_cast<const ForNode*>(node)) {
+			return dominatesUses(loop->initializer, definite, possible, inLoop)
+				&& dominatesUses(loop->condition, definite, possible, inLoop)
+				&& dominatesUses(loop->body, definite, possible, true)
+				&& dominatesUses(loop->update, definite, possible, true);
+		}
+		if (auto loop = dynamic_cast<const DoWhileNode*>(node)) {
+			return dominatesUses(loop->body, definite, possible, true)
+				&& dominatesUses(loop->condition, definite, possible, inLoop);
+		}
+
+		bool valid = true;
+		forEachChild(node, [&](const ASTNode* child) {
+			valid = valid && dominatesUses(child, definite, possible, inLoop);
+		});
+		return valid;
+	}
+};
+
+// Why the results of a function declared memo could depend on more than its
+// arguments, or an empty string. It may only use its own locals and call pure
+// natives and memoized functions, itself included.
+inline std::string memoizationError(const FunctionNode* definition, const Environment& env) {
+	LocalAnalysis analysis(definition);
+	if (!analysis.isStatic()) {
+		return "its locals may resolve to globals";
+	}
+	const std::unordered_map<std::string, ValueType>& locals = analysis.getLocals();
+
+	std::string error;
+	auto check = [&](auto& self, const ASTNode* node) -> void {
+		if (!node || !error.empty()) {
+			return;
+		}
+		if (auto nested = dynamic_cast<const FunctionNode*>(node)) {
+			error = "it defines function " + nested->name;
+			return;
+		}
+		if (auto variable = dynamic_cast<const VariableNode*>(node)) {
+			if (!locals.count(variable->name)) {
+				error = "it reads global " + variable->name;
+			}
+		}
+		else if (auto assignment = dynamic_cast<const AssignmentNode*>(node)) {
+			if (!locals.count(assignment->variableName)) {
+				error = "it assigns global " + assignment->variableName;
+			}
+		}
+		else if (auto call = dynamic_cast<const FunctionCallNode*>(node)) {
+			const FunctionNode* callee = env.findUserFunction(call->name);
+			if (env.findNativeFunction(call->name)) {
+				if (!env.isPureFunction(call->name)) {
+					error = "it calls impure native " + call->name;
+				}
+			}
+			else if (call->name != definition->name && !(callee && callee->memoized)) {
+				error = "it calls " + call->name + ", which is not memo";
+			}
+		}
+		forEachChild(node, [&](const ASTNode* child) { self(self, child); });
+	};
+	check(check, definition->body);
+	return error;
+}
+
+// Collects the variables a loop reads or assigns from its body on, and returns
+// whether nothing but the loop can touch them while it runs: it declares no
+// variable, defines no function and calls only pure natives. The initializer
+// of a for loop is not part of the loop here.
+inline bool collectLoopVariables(const ASTNode* loop, const Environment& env, std::set<std::string>& names) {
+	bool closed = true;
+	auto collect = [&](auto& self, const ASTNode* node) -> void {
+		if (!node || !closed) {
+			return;
+		}
+		if (dynamic_cast<const DeclarationNode*>(node) || dynamic_cast<const FunctionNode*>(node)) {
+			closed = false;
+			return;
+		}
+		if (auto variable = dynamic_cast<const VariableNode*>(node)) {
+			names.insert(variable->name);
+		}
+		else if (auto assignment = dynamic_cast<const AssignmentNode*>(node)) {
+			names.insert(assignment->variableName);
+		}
+		else if (auto call = dynamic_cast<const FunctionCallNode*>(node)) {
+			if (!env.findNativeFunction(call->name) || !env.isPureFunction(call->name)) {
+				closed = false;
+				return;
+			}
+		}
+		forEachChild(node, [&](const ASTNode* child) { self(self, child); });
+	};
+	if (auto node = dynamic_cast<const ForNode*>(loop)) {
+		collect(collect, node->condition);
+		collect(collect, node->body);
+		collect(collect, node->update);
+	}
+	else {
+		collect(collect, loop);
+	}
+	return closed;
+}
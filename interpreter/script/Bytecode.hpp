@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "AST.hpp"
+
+// Register-based instruction set of the VirtualMachine. Operands a, b and c
+// are register numbers unless noted otherwise.
+enum class OpCode : uint8_t {
+	LOAD_CONSTANT,   // a = constants[b]
+	MOVE,            // a = b
+	ADD, SUBTRACT, MULTIPLY, DIVIDE,
+	EQUALS, NOT_EQUALS, LESS, LESS_EQUALS, GREATER, GREATER_EQUALS,
+	AND, OR,         // a = b op c
+	NEGATE, NOT,     // a = op b
+	CHECK_INT,       // Type error unless a is integral; b: name
+	DECLARE_VAR,     // a: name, b: ValueType
+	LOAD_VAR,        // a = variable b (name), resolved like Environment::getVariable
+	STORE_VAR,       // variable a (name) = b
+	LOAD_GLOBAL,     // a = global b (name)
+	STORE_GLOBAL,    // global a (name) = b
+	CALL,            // a = functions[b](argument list at c), unless a native shadows it
+	CALL_NATIVE,     // a = Environment::evaluateFunction(names[b], argument list at c)
+	JUMP,            // pc = a
+	JUMP_IF_FALSE,   // if a == 0: pc = b
+	JUMP_IF_TRUE,    // if a != 0: pc = b
+	// Counted loop latch: a += register a+1; if a op register a+2: pc = b.
+	// c: 1 + name of the int variable to type-check after the step, or 0
+	LOOP_LESS, LOOP_LESS_EQUALS, LOOP_GREATER, LOOP_GREATER_EQUALS,
+	// Quickened forms of ADD, SUBTRACT and MULTIPLY, only written by the
+	// VirtualMachine. The int forms expect an int result, skip the CHECK_INT of
+	// it that follows when feedback is 1 and fall back to the generic
+	// instruction on other values; the float forms stop collecting feedback.
+	ADD_INT, SUBTRACT_INT, MULTIPLY_INT,
+	ADD_FLOAT, SUBTRACT_FLOAT, MULTIPLY_FLOAT,
+	STATEMENT,       // Report the statement at source offset a to the ExecutionHooks, as
+	                 // a branch taking arm b - 1 when b != 0
+	COVER,           // Mark coverage slot a
+	RETURN           // return a
+};
+
+struct Instruction {
+	OpCode op;
+	uint8_t feedback = 0;  // Operand types seen by a quickening VirtualMachine
+	uint8_t deopts = 0;
+	uint32_t a = 0;
+	uint32_t b = 0;
+	uint32_t c = 0;
+};
+
+struct BytecodeFunction {
+	std::string name;
+	std::vector<std::pair<std::string, ValueType>> parameters;  // Passed in registers 0..n-1
+	bool usesFrame = false;  // Runs in its own Environment call frame
+	bool memoized = false;   // Results are cached by the Environment
+	size_t sourceOffset = 0;  // Of the definition, for profilers
+	uint32_t registerCount = 0;
+	std::vector<Instruction> code;
+	std::vector<double> constants;
+	std::vector<uint32_t> argumentLists;  // Call arguments: count, registers, then the call site
+	uint32_t callSites = 0;               // Inline cache slots, one per call instruction
+};
+
+// Output of the Compiler, run by the VirtualMachine
+struct CompiledProgram {
+	uint64_t id = 0;  // Unique per compilation, so a VirtualMachine can keep state for it; 0: none
+	uint64_t coverageId = 0;  // ProgramCoverage::getId of the layout COVER marks; 0: none
+	std::vector<std::string> names;
+	std::vector<BytecodeFunction> functions;  // functions[0] is the top-level code
+
+	std::string disassemble() const {
+		static const char* const opNames[] = {
+			"loadk", "move", "add", "sub", "mul", "div", "eq", "ne", "lt", "le", "gt", "ge", "and", "or",
+			"neg", "not", "checkint", "declare", "load", "store", "loadglobal", "storeglobal",
+			"call", "callnative", "jump", "jumpiffalse", "jumpiftrue",
+				"looplt", "loople", "loopgt", "loopge",
+			"addi", "subi", "muli", "addf", "subf", "mulf", "stmt", "cover", "return"
+		};
+
+		std::ostringstream out;
+		for (const BytecodeFunction& function : functions) {
+			out << "function " << function.name << " (" << function.registerCount << " registers"
+				<< (function.usesFrame ? ", frame" : "") << ")\n";
+			for (size_t pc = 0; pc < function.code.size(); ++pc) {
+				const Instruction& instruction = function.code[pc];
+				out << "  " << pc << ": " << opNames[static_cast<size_t>(instruction.op)]
+					<< " " << instruction.a << ", " << instruction.b << ", " << instruction.c << "\n";
+			}
+		}
+		return out.str();
+	}
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <istream>
+#include <stdexcept>
+#include <string>
+
+// Source of script text that is delivered in chunks, see Lexer(ChunkReader&)
+class ChunkReader {
+public:
+    virtual ~ChunkReader() = default;
+
+    // Copy up to `capacity` bytes into `buffer`; returns 0 once the input is exhausted
+    virtual size_t read(char* buffer, size_t capacity) = 0;
+};
+
+// Reads from any std::istream (files, pipes, string streams)
+class StreamChunkReader : public ChunkReader {
+public:
+    explicit StreamChunkReader(std::istream& stream) : stream(stream) {}
+
+    size_t read(char* buffer, size_t capacity) override {
+        stream.read(buffer, static_cast<std::streamsize>(capacity));
+        return static_cast<size_t>(stream.gcount());
+    }
+
+private:
+    std::istream& stream;
+};
+
+// Reads from a C file handle; opening by path makes the reader own the handle
+class FileChunkReader : public ChunkReader {
+public:
+    explicit FileChunkReader(FILE* file) : file(file), ownsFile(false) {}
+
+    explicit FileChunkReader(const std::string& path) : file(std::fopen(path.c_str(), "rb")), ownsFile(true) {
+        if (!file) {
+            throw std::runtime_error("Cannot open script file: " + path);
+        }
+    }
+
+    FileChunkReader(const FileChunkReader&) = delete;
+    FileChunkReader& operator=(const FileChunkReader&) = delete;
+
+    ~FileChunkReader() {
+        if (ownsFile) {
+            std::fclose(file);
+        }
+    }
+
+    size_t read(char* buffer, size_t capacity) override {
+        return std::fread(buffer, 1, capacity, file);
+    }
+
+private:
+    FILE* file;
+    bool ownsFile;
+};
+
+// Reads from a block of memory owned by the caller, e.g. a mapped file
+class MemoryChunkReader : public ChunkReader {
+public:
+    MemoryChunkReader(const char* data, size_t size) : data(data), size(size), offset(0) {}
+
+    size_t read(char* buffer, size_t capacity) override {
+        size_t count = std::min(capacity, size - offset);
+        std::memcpy(buffer, data + offset, count);
+        offset += count;
+        return count;
+    }
+
+private:
+    const char* data;
+    size_t size;
+    size_t offset;
+};
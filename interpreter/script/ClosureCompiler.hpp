@@ -0,0 +1,366 @@
+#pragma once
+
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "AST.hpp"
+
+// A pre-bound callable for one AST node. `function` is chosen once for the
+// node's operator and operand shapes (e.g. variable-plus-constant), and reads
+// its children and constants straight from this struct, so evaluation does no
+// virtual dispatch and no TokenType switch.
+struct Closure {
+	using Function = double (*)(const Closure&, Environment&);
+
+	Function function = nullptr;
+	const Closure* first = nullptr;
+	const Closure* second = nullptr;
+	const Closure* third = nullptr;
+	const Closure* fourth = nullptr;
+	double constant = 0;
+	std::string name;
+	std::string otherName;
+	ValueType type = ValueType::FLOAT;
+	std::vector<const Closure*> list;
+
+	double operator()(Environment& env) const {
+		return function(*this, env);
+	}
+};
+
+// Converts an AST into closures once; evaluating the result walks the same
+// tree shape as ASTNode::evaluate with identical semantics. Function bodies
+// are still run by the tree walker through Environment::evaluateFunction.
+class ClosureProgram {
+public:
+	explicit ClosureProgram(const ASTNode* root) : entry(compile(root)) {}
+
+	ClosureProgram(const ClosureProgram&) = delete;
+	ClosureProgram& operator=(const ClosureProgram&) = delete;
+
+	double evaluate(Environment& env) const {
+		return (*entry)(env);
+	}
+
+	size_t getClosureCount() const {
+		return closures.size();
+	}
+
+private:
+	std::deque<Closure> closures;  // Stable addresses, allocated in blocks
+	const Closure* entry;
+
+	Closure& newClosure(Closure::Function function) {
+		closures.emplace_back();
+		closures.back().function = function;
+		return closures.back();
+	}
+
+	// Binary operators, one instantiation of each closure shape per operator
+	struct Add { static double apply(double l, double r) { return l + r; } };
+	struct Subtract { static double apply(double l, double r) { return l - r; } };
+	struct Multiply { static double apply(double l, double r) { return l * r; } };
+	struct Divide {
+		static double apply(double l, double r) {
+			if (r == 0) {
+				throw std::runtime_error("Division by zero");
+			}
+			return l / r;
+		}
+	};
+	struct And { static double apply(double l, double r) { return (l != 0 && r != 0) ? 1 : 0; } };
+	struct Or { static double apply(double l, double r) { return (l != 0 || r != 0) ? 1 : 0; } };
+	struct Equals { static double apply(double l, double r) { return (l == r) ? 1 : 0; } };
+	struct NotEquals { static double apply(double l, double r) { return (l != r) ? 1 : 0; } };
+	struct Less { static double apply(double l, double r) { return (l < r) ? 1 : 0; } };
+	struct LessEquals { static double apply(double l, double r) { return (l <= r) ? 1 : 0; } };
+	struct Greater { static double apply(double l, double r) { return (l > r) ? 1 : 0; } };
+	struct GreaterEquals { static double apply(double l, double r) { return (l >= r) ? 1 : 0; } };
+
+	template <typename Op>
+	static double binary(const Closure& self, Environment& env) {
+		double left = (*self.first)(env);
+		return Op::apply(left, (*self.second)(env));
+	}
+
+	template <typename Op>
+	static double binaryConstant(const Closure& self, Environment& env) {
+		return Op::apply((*self.first)(env), self.constant);
+	}
+
+	template <typename Op>
+	static double variableConstant(const Closure& self, Environment& env) {
+		return Op::apply(env.getVariable(self.name), self.constant);
+	}
+
+	template <typename Op>
+	static double variableVariable(const Closure& self, Environment& env) {
+		double left = env.getVariable(self.name);
+		return Op::apply(left, env.getVariable(self.otherName));
+	}
+
+	static double negate(const Closure& self, Environment& env) {
+		return -(*self.first)(env);
+	}
+
+	static double logicalNot(const Closure& self, Environment& env) {
+		return ((*self.first)(env) == 0) ? 1 : 0;
+	}
+
+	static double constantValue(const Closure& self, Environment&) {
+		return self.constant;
+	}
+
+	static double variable(const Closure& self, Environment& env) {
+		return env.getVariable(self.name);
+	}
+
+	static double assignment(const Closure& self, Environment& env) {
+		double value = (*self.first)(env);
+		env.setVariable(self.name, value);
+		return value;
+	}
+
+	static double declaration(const Closure& self, Environment& env) {
+		env.declareVariable(self.name, self.type);
+		return 0;
+	}
+
+	static double initializedDeclaration(const Closure& self, Environment& env) {
+		env.declareVariable(self.name, self.type);
+		env.setVariable(self.name, (*self.first)(env));
+		return 0;
+	}
+
+	static double sequence(const Closure& self, Environment& env) {
+		for (const Closure* statement : self.list) {
+			(*statement)(env);
+		}
+		return 0;
+	}
+
+	static double call(const Closure& self, Environment& env) {
+		std::vector<double> argValues;
+		argValues.reserve(self.list.size());
+		for (const Closure* argument : self.list) {
+			argValues.push_back((*argument)(env));
+		}
+		return env.evaluateFunction(self.name, argValues);
+	}
+
+	static double forward(const Closure& self, Environment& env) {
+		return (*self.first)(env);
+	}
+
+	static double ifThen(const Closure& self, Environment& env) {
+		return (*self.first)(env) != 0 ? (*self.second)(env) : 0;
+	}
+
+	static double ifThenElse(const Closure& self, Environment& env) {
+		return (*self.first)(env) != 0 ? (*self.second)(env) : (*self.third)(env);
+	}
+
+	static double whileLoop(const Closure& self, Environment& env) {
+		double result = 0;
+		while ((*self.first)(env) != 0) {
+			result = (*self.second)(env);
+		}
+		return result;
+	}
+
+	static double doWhileLoop(const Closure& self, Environment& env) {
+		double result = 0;
+		do {
+			result = (*self.first)(env);
+		} while ((*self.second)(env) != 0);
+		return result;
+	}
+
+	// first: initializer, second: condition, third: update, fourth: body
+	static double forLoop(const Closure& self, Environment& env) {
+		if (self.first) {
+			(*self.first)(env);
+		}
+		double result = 0;
+		while ((*self.second)(env) != 0) {
+			result = (*self.fourth)(env);
+			if (self.third) {
+				(*self.third)(env);
+			}
+		}
+		return result;
+	}
+
+	const Closure* compileOptional(const ASTNode* node) {
+		return node ? compile(node) : nullptr;
+	}
+
+	template <typename Op>
+	const Closure* compileBinary(const BinaryOpNode* node) {
+		auto leftVariable = dynamic_cast<const VariableNode*>(node->left);
+		auto rightVariable = dynamic_cast<const VariableNode*>(node->right);
+		auto rightNumber = dynamic_cast<const NumberNode*>(node->right);
+
+		if (leftVariable && rightNumber) {
+			Closure& closure = newClosure(&variableConstant<Op>);
+			closure.name = leftVariable->name;
+			closure.constant = rightNumber->value;
+			return &closure;
+		}
+		if (leftVariable && rightVariable) {
+			Closure& closure = newClosure(&variableVariable<Op>);
+			closure.name = leftVariable->name;
+			closure.otherName = rightVariable->name;
+			return &closure;
+		}
+		if (rightNumber) {
+			const Closure* left = compile(node->left);
+			Closure& closure = newClosure(&binaryConstant<Op>);
+			closure.first = left;
+			closure.constant = rightNumber->value;
+			return &closure;
+		}
+
+		const Closure* left = compile(node->left);
+		const Closure* right = compile(node->right);
+		Closure& closure = newClosure(&binary<Op>);
+		closure.first = left;
+		closure.second = right;
+		return &closure;
+	}
+
+	const Closure* compileBinary(const BinaryOpNode* node) {
+		switch (node->op) {
+		case TokenType::PLUS: return compileBinary<Add>(node);
+		case TokenType::MINUS: return compileBinary<Subtract>(node);
+		case TokenType::MULTIPLY: return compileBinary<Multiply>(node);
+		case TokenType::DIVIDE: return compileBinary<Divide>(node);
+		case TokenType::AND: return compileBinary<And>(node);
+		case TokenType::OR: return compileBinary<Or>(node);
+		case TokenType::EQUALS: return compileBinary<Equals>(node);
+		case TokenType::NOT_EQUALS: return compileBinary<NotEquals>(node);
+		case TokenType::LESS: return compileBinary<Less>(node);
+		case TokenType::LESS_EQUALS: return compileBinary<LessEquals>(node);
+		case TokenType::GREATER: return compileBinary<Greater>(node);
+		case TokenType::GREATER_EQUALS: return compileBinary<GreaterEquals>(node);
+		default: throw std::runtime_error("Unknown binary operator");
+		}
+	}
+
+	const Closure* compile(const ASTNode* node) {
+		if (auto number = dynamic_cast<const NumberNode*>(node)) {
+			Closure& closure = newClosure(&constantValue);
+			closure.constant = number->value;
+			return &closure;
+		}
+		if (auto variableNode = dynamic_cast<const VariableNode*>(node)) {
+			Closure& closure = newClosure(&variable);
+			closure.name = variableNode->name;
+			return &closure;
+		}
+		if (auto binaryNode = dynamic_cast<const BinaryOpNode*>(node)) {
+			return compileBinary(binaryNode);
+		}
+		if (auto unary = dynamic_cast<const UnaryOpNode*>(node)) {
+			if (unary->op != TokenType::MINUS && unary->op != TokenType::NOT) {
+				throw std::runtime_error("Unknown unary operator");
+			}
+			const Closure* operand = compile(unary->operand);
+			Closure& closure = newClosure(unary->op == TokenType::MINUS ? &negate : &logicalNot);
+			closure.first = operand;
+			return &closure;
+		}
+		if (auto assignmentNode = dynamic_cast<const AssignmentNode*>(node)) {
+			const Closure* value = compile(assignmentNode->expression);
+			Closure& closure = newClosure(&assignment);
+			closure.name = assignmentNode->variableName;
+			closure.first = value;
+			return &closure;
+		}
+		if (auto declarationNode = dynamic_cast<const DeclarationNode*>(node)) {
+			const Closure* initializer = compileOptional(declarationNode->initializer);
+			Closure& closure = newClosure(initializer ? &initializedDeclaration : &declaration);
+			closure.name = declarationNode->variableName;
+			closure.type = declarationNode->type;
+			closure.first = initializer;
+			return &closure;
+		}
+		if (auto program = dynamic_cast<const ProgramNode*>(node)) {
+			return compileSequence(program->statements);
+		}
+		if (auto block = dynamic_cast<const BlockNode*>(node)) {
+			return compileSequence(block->statements);
+		}
+		if (auto callNode = dynamic_cast<const FunctionCallNode*>(node)) {
+			std::vector<const Closure*> arguments;
+			for (const ASTNode* argument : callNode->arguments) {
+				arguments.push_back(compile(argument));
+			}
+			Closure& closure = newClosure(&call);
+			closure.name = callNode->name;
+			closure.list = arguments;
+			return &closure;
+		}
+		if (auto ret = dynamic_cast<const ReturnNode*>(node)) {
+			const Closure* value = compile(ret->returnValue);
+			Closure& closure = newClosure(&forward);
+			closure.first = value;
+			return &closure;
+		}
+		if (auto branch = dynamic_cast<const IfNode*>(node)) {
+			const Closure* condition = compile(branch->condition);
+			const Closure* thenBranch = compile(branch->thenBranch);
+			const Closure* elseBranch = compileOptional(branch->elseBranch);
+			Closure& closure = newClosure(elseBranch ? &ifThenElse : &ifThen);
+			closure.first = condition;
+			closure.second = thenBranch;
+			closure.third = elseBranch;
+			return &closure;
+		}
+		if (auto loop = dynamic_cast<const WhileNode*>(node)) {
+			const Closure* condition = compile(loop->condition);
+			const Closure* body = compile(loop->body);
+			Closure& closure = newClosure(&whileLoop);
+			closure.first = condition;
+			closure.second = body;
+			return &closure;
+		}
+		if (auto loop = dynamic_cast<const DoWhileNode*>(node)) {
+			const Closure* body = compile(loop->body);
+			const Closure* condition = compile(loop->condition);
+			Closure& closure = newClosure(&doWhileLoop);
+			closure.first = body;
+			closure.second = condition;
+			return &closure;
+		}
+		if (auto loop = dynamic_cast<const ForNode*>(node)) {
+			const Closure* initializer = compileOptional(loop->initializer);
+			const Closure* condition = compile(loop->condition);
+			const Closure* update = compileOptional(loop->update);
+			const Closure* body = compile(loop->body);
+			Closure& closure = newClosure(&forLoop);
+			closure.first = initializer;
+			closure.second = condition;
+			closure.third = update;
+			closure.fourth = body;
+			return &closure;
+		}
+		if (dynamic_cast<const FunctionNode*>(node)) {
+			Closure& closure = newClosure(&constantValue);  // Registered while parsing
+			return &closure;
+		}
+		throw std::runtime_error("Unknown AST node");
+	}
+
+	const Closure* compileSequence(const std::vector<ASTNode*>& statements) {
+		std::vector<const Closure*> compiled;
+		for (const ASTNode* statement : statements) {
+			compiled.push_back(compile(statement));
+		}
+		Closure& closure = newClosure(&sequence);
+		closure.list = compiled;
+		return &closure;
+	}
+};
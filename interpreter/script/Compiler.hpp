@@ -0,0 +1,364 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "Bytecode.hpp"
+#include "Metrics.hpp"
+#include "IRBuilder.hpp"
+#include "LoopAnalysis.hpp"
+#include "Optimizer.hpp"
+
+struct CompilerOptions {
+	bool optimize = true;
+
+	// Globals the host fixes, compiled as constants; see ProgramSpecializer
+	std::map<std::string, double> constants = {};
+
+	// Counts compilations and their time when set
+	EngineMetrics* metrics = nullptr;
+
+	// Report statement boundaries to ExecutionHooks; costs an instruction per
+	// statement, so only compile them in for tracing and coverage
+	bool statementMarkers = false;
+
+	// Mark the statements and branches this coverage lays out, one byte store
+	// each, in any copy of it given to VirtualMachine::setCoverage
+	const ProgramCoverage* coverage = nullptr;
+};
+
+// Compiles an AST to bytecode: builds SSA IR, optimizes it and lowers it to
+// register code, turning phis into copies on the incoming edges. Counted
+// loops get a fused increment-compare-branch instruction in their latch.
+class Compiler {
+public:
+	explicit Compiler(CompilerOptions options = {}) : options(options) {}
+
+	CompiledProgram compile(const ASTNode* root) {
+		return compileModule(IRBuilder(options.constants, options.statementMarkers, options.coverage).build(root));
+	}
+
+	// A program that resumes a loop at its body, on the Environment frame the
+	// tree walker was running it in, and returns the loop value. For on-stack
+	// replacement of hot loops, see LoopTiering and IRBuilder::buildLoopEntry.
+	CompiledProgram compileLoopEntry(const ASTNode* loop, const std::set<std::string>& cached = {}) {
+		return compileModule(IRBuilder(options.constants, options.statementMarkers, options.coverage).buildLoopEntry(loop, cached));
+	}
+
+	const OptimizerStats& getStats() const {
+		return stats;
+	}
+
+	// The optimized IR of the last compiled program
+	const std::string& getIRDump() const {
+		return irDump;
+	}
+
+private:
+	CompilerOptions options;
+	OptimizerStats stats;
+	std::string irDump;
+
+	CompiledProgram compileModule(IRModule module) {
+		auto start = std::chrono::steady_clock::now();
+		stats = OptimizerStats();
+		for (const IRFunction& function : module.functions) {
+			stats.instructionsBefore += function.instructionCount();
+		}
+
+		Optimizer optimizer(stats);
+		for (IRFunction& function : module.functions) {
+			if (options.optimize) {
+				optimizer.optimize(function);
+			}
+			else {
+				optimizer.propagateCopies(function);  // Single-operand phis are not lowered
+			}
+			stats.instructionsAfter += function.instructionCount();
+		}
+		irDump = module.dump();
+
+		static std::atomic<uint64_t> compiledPrograms{ 0 };
+		CompiledProgram program;
+		program.id = ++compiledPrograms;
+		program.coverageId = options.coverage ? options.coverage->getId() : 0;
+		program.names = module.names;
+		for (IRFunction& function : module.functions) {
+			program.functions.push_back(lower(function));
+		}
+		if (options.metrics) {
+			options.metrics->compilations.add();
+			options.metrics->compileSeconds.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+		}
+		return program;
+	}
+
+	static OpCode binaryOpCode(IROp op) {
+		switch (op) {
+		case IROp::ADD: return OpCode::ADD;
+		case IROp::SUBTRACT: return OpCode::SUBTRACT;
+		case IROp::MULTIPLY: return OpCode::MULTIPLY;
+		case IROp::DIVIDE: return OpCode::DIVIDE;
+		case IROp::EQUALS: return OpCode::EQUALS;
+		case IROp::NOT_EQUALS: return OpCode::NOT_EQUALS;
+		case IROp::LESS: return OpCode::LESS;
+		case IROp::LESS_EQUALS: return OpCode::LESS_EQUALS;
+		case IROp::GREATER: return OpCode::GREATER;
+		case IROp::GREATER_EQUALS: return OpCode::GREATER_EQUALS;
+		case IROp::AND: return OpCode::AND;
+		case IROp::OR: return OpCode::OR;
+		default: throw std::runtime_error("Unexpected IR instruction");
+		}
+	}
+
+	static OpCode loopOpCode(IROp compare) {
+		switch (compare) {
+		case IROp::LESS: return OpCode::LOOP_LESS;
+		case IROp::LESS_EQUALS: return OpCode::LOOP_LESS_EQUALS;
+		case IROp::GREATER: return OpCode::LOOP_GREATER;
+		case IROp::GREATER_EQUALS: return OpCode::LOOP_GREATER_EQUALS;
+		default: throw std::runtime_error("Unexpected loop comparison");
+		}
+	}
+
+	// Give every edge into a block with phis a block of its own to hold the copies
+	static void splitCriticalEdges(IRFunction& function) {
+		size_t blockCount = function.blocks.size();
+		for (IRBlockId block = 0; block < blockCount; ++block) {
+			if (function.blocks[block].removed || function.blocks[block].successors.size() < 2) {
+				continue;
+			}
+			for (size_t i = 0; i < function.blocks[block].successors.size(); ++i) {
+				IRBlockId successor = function.blocks[block].successors[i];
+				if (function.blocks[successor].predecessors.size() < 2) {
+					continue;
+				}
+				IRBlockId middle = function.addBlock();
+				function.append(middle, IRInstruction{ IROp::JUMP });
+				function.blocks[middle].predecessors.push_back(block);
+				function.blocks[middle].successors.push_back(successor);
+				function.blocks[block].successors[i] = middle;
+				std::vector<IRBlockId>& predecessors = function.blocks[successor].predecessors;
+				*std::find(predecessors.begin(), predecessors.end(), block) = middle;
+			}
+		}
+	}
+
+	BytecodeFunction lower(IRFunction& function) {
+		splitCriticalEdges(function);
+
+		BytecodeFunction result;
+		result.name = function.name;
+		result.parameters = function.parameters;
+		result.usesFrame = function.usesFrame;
+		result.memoized = function.memoized;
+		result.sourceOffset = function.sourceOffset;
+
+		// The latch of a counted loop steps, checks and tests the variable in
+		// one instruction, then jumps straight back into the body
+		std::vector<IRCountedLoop> loops;
+		if (options.optimize) {
+			loops = findCountedLoops(function);
+		}
+		std::vector<const IRCountedLoop*> latchLoop(function.blocks.size(), nullptr);
+		std::vector<const IRCountedLoop*> preheaderLoop(function.blocks.size(), nullptr);
+		std::vector<bool> fused(function.values.size(), false);  // Folded into the loop instruction
+		std::vector<bool> loopVariable(function.values.size(), false);
+		for (const IRCountedLoop& loop : loops) {
+			latchLoop[loop.latch] = &loop;
+			preheaderLoop[loop.preheader] = &loop;
+			fused[loop.next] = true;
+			if (loop.check != IR_NONE) {
+				fused[loop.check] = true;
+			}
+			loopVariable[loop.variable] = true;
+			++stats.countedLoopsFused;
+		}
+
+		// One register per value; parameters arrive in the first registers.
+		// A loop variable is followed by its step and its bound.
+		std::vector<uint32_t> registerOf(function.values.size(), IR_NONE);
+		uint32_t registerCount = static_cast<uint32_t>(function.parameters.size());
+		std::vector<IRBlockId> order = function.reversePostorder();
+		for (IRBlockId block : order) {
+			for (IRValueId value : function.blocks[block].instructions) {
+				const IRInstruction& instruction = function.values[value];
+				if (instruction.op == IROp::PARAMETER) {
+					registerOf[value] = instruction.name;
+				}
+				else if (hasResult(instruction.op) && !fused[value]) {
+					registerOf[value] = registerCount;
+					registerCount += loopVariable[value] ? 3 : 1;
+				}
+			}
+		}
+
+		std::vector<uint32_t> blockStart(function.blocks.size(), 0);
+		std::vector<std::pair<size_t, IRBlockId>> fixups;  // Jump operand to patch, target block
+		std::vector<Instruction>& code = result.code;
+
+		auto emit = [&](OpCode op, uint32_t a = 0, uint32_t b = 0, uint32_t c = 0) {
+			Instruction instruction{ op };
+			instruction.a = a;
+			instruction.b = b;
+			instruction.c = c;
+			code.push_back(instruction);
+		};
+		auto reg = [&](IRValueId value) { return registerOf[value]; };
+		auto constantIndex = [&](double value) {
+			auto found = std::find_if(result.constants.begin(), result.constants.end(),
+				[&](double constant) { return std::memcmp(&constant, &value, sizeof(double)) == 0; });
+			if (found == result.constants.end()) {
+				result.constants.push_back(value);
+				return static_cast<uint32_t>(result.constants.size() - 1);
+			}
+			return static_cast<uint32_t>(found - result.constants.begin());
+		};
+
+		// Parallel copies into the phis of `successor` on the edge from `block`
+		auto emitPhiCopies = [&](IRBlockId block, IRBlockId successor, IRValueId skip) {
+			const std::vector<IRBlockId>& predecessors = function.blocks[successor].predecessors;
+			size_t edge = std::find(predecessors.begin(), predecessors.end(), block) - predecessors.begin();
+			std::vector<std::pair<uint32_t, uint32_t>> copies;
+			for (IRValueId value : function.blocks[successor].instructions) {
+				const IRInstruction& phi = function.values[value];
+				if (phi.op != IROp::PHI) {
+					break;
+				}
+				if (value != skip && reg(value) != reg(phi.operands[edge])) {
+					copies.push_back({ reg(value), reg(phi.operands[edge]) });
+				}
+			}
+
+			bool overlapping = false;
+			for (const auto& copy : copies) {
+				for (const auto& other : copies) {
+					overlapping = overlapping || copy.second == other.first;
+				}
+			}
+			if (!overlapping) {
+				for (const auto& [target, source] : copies) {
+					emit(OpCode::MOVE, target, source);
+				}
+				return;
+			}
+			// A phi reads another phi of the same block: go through scratch registers
+			uint32_t scratch = registerCount;
+			for (size_t i = 0; i < copies.size(); ++i) {
+				emit(OpCode::MOVE, scratch + static_cast<uint32_t>(i), copies[i].second);
+			}
+			for (size_t i = 0; i < copies.size(); ++i) {
+				emit(OpCode::MOVE, copies[i].first, scratch + static_cast<uint32_t>(i));
+			}
+			result.registerCount = std::max<uint32_t>(result.registerCount,
+				registerCount + static_cast<uint32_t>(copies.size()));
+		};
+
+		for (size_t position = 0; position < order.size(); ++position) {
+			IRBlockId block = order[position];
+			IRBlockId next = position + 1 < order.size() ? order[position + 1] : IR_NONE;
+			blockStart[block] = static_cast<uint32_t>(code.size());
+
+			for (IRValueId value : function.blocks[block].instructions) {
+				const IRInstruction& instruction = function.values[value];
+				const std::vector<IRValueId>& operands = instruction.operands;
+				if (fused[value]) {
+					continue;
+				}
+				switch (instruction.op) {
+				case IROp::PARAMETER:
+				case IROp::PHI:
+					break;
+				case IROp::CONSTANT: emit(OpCode::LOAD_CONSTANT, reg(value), constantIndex(instruction.constant)); break;
+				case IROp::COPY: emit(OpCode::MOVE, reg(value), reg(operands[0])); break;
+				case IROp::NEGATE: emit(OpCode::NEGATE, reg(value), reg(operands[0])); break;
+				case IROp::NOT: emit(OpCode::NOT, reg(value), reg(operands[0])); break;
+				case IROp::CHECK_INT: emit(OpCode::CHECK_INT, reg(operands[0]), instruction.name); break;
+				case IROp::DECLARE_VAR:
+					emit(OpCode::DECLARE_VAR, instruction.name, static_cast<uint32_t>(instruction.type));
+					break;
+				case IROp::LOAD_VAR: emit(OpCode::LOAD_VAR, reg(value), instruction.name); break;
+				case IROp::STORE_VAR: emit(OpCode::STORE_VAR, instruction.name, reg(operands[0])); break;
+				case IROp::LOAD_GLOBAL: emit(OpCode::LOAD_GLOBAL, reg(value), instruction.name); break;
+				case IROp::STORE_GLOBAL: emit(OpCode::STORE_GLOBAL, instruction.name, reg(operands[0])); break;
+				case IROp::CALL:
+				case IROp::CALL_NATIVE: {
+					uint32_t list = static_cast<uint32_t>(result.argumentLists.size());
+					result.argumentLists.push_back(static_cast<uint32_t>(operands.size()));
+					for (IRValueId operand : operands) {
+						result.argumentLists.push_back(reg(operand));
+					}
+					result.argumentLists.push_back(result.callSites++);
+					emit(instruction.op == IROp::CALL ? OpCode::CALL : OpCode::CALL_NATIVE, reg(value), instruction.name, list);
+					break;
+				}
+				case IROp::STATEMENT: emit(OpCode::STATEMENT, instruction.name, static_cast<uint32_t>(instruction.constant)); break;
+				case IROp::COVER: emit(OpCode::COVER, instruction.name); break;
+				case IROp::RETURN: emit(OpCode::RETURN, reg(operands[0])); break;
+				case IROp::JUMP: {
+					IRBlockId target = function.blocks[block].successors[0];
+					if (const IRCountedLoop* loop = preheaderLoop[block]) {
+						emit(OpCode::LOAD_CONSTANT, reg(loop->variable) + 1, constantIndex(loop->step));
+						emit(OpCode::MOVE, reg(loop->variable) + 2, reg(loop->bound));
+					}
+					if (const IRCountedLoop* loop = latchLoop[block]) {
+						emitPhiCopies(block, target, loop->variable);
+						uint32_t check = loop->check != IR_NONE ? function.values[loop->check].name + 1 : 0;
+						fixups.push_back({ code.size(), loop->body });
+						emit(loopOpCode(loop->compare), reg(loop->variable), 0, check);
+						if (loop->exit != next) {
+							fixups.push_back({ code.size(), loop->exit });
+							emit(OpCode::JUMP);
+						}
+						break;
+					}
+					emitPhiCopies(block, target, IR_NONE);
+					if (target != next) {
+						fixups.push_back({ code.size(), target });
+						emit(OpCode::JUMP);
+					}
+					break;
+				}
+				case IROp::BRANCH: {
+					// Successors of a branch have no phis once critical edges are split
+					IRBlockId ifTrue = function.blocks[block].successors[0];
+					IRBlockId ifFalse = function.blocks[block].successors[1];
+					if (ifTrue == next) {
+						fixups.push_back({ code.size(), ifFalse });
+						emit(OpCode::JUMP_IF_FALSE, reg(operands[0]));
+					}
+					else {
+						fixups.push_back({ code.size(), ifTrue });
+						emit(OpCode::JUMP_IF_TRUE, reg(operands[0]));
+						if (ifFalse != next) {
+							fixups.push_back({ code.size(), ifFalse });
+							emit(OpCode::JUMP);
+						}
+					}
+					break;
+				}
+				default:
+					emit(binaryOpCode(instruction.op), reg(value), reg(operands[0]), reg(operands[1]));
+					break;
+				}
+			}
+		}
+
+		for (const auto& [index, target] : fixups) {
+			if (code[index].op == OpCode::JUMP) {
+				code[index].a = blockStart[target];
+			}
+			else {
+				code[index].b = blockStart[target];
+			}
+		}
+		result.registerCount = std::max(result.registerCount, registerCount);
+		return result;
+	}
+};
@@ -0,0 +1,258 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "AST.hpp"
+#include "PerfMap.hpp"
+
+// What a coverage slot records about a statement
+enum class CoveragePoint : uint8_t {
+	STATEMENT,   // It ran
+	FIRST_ARM,   // An if took its then branch, or a loop ran its body
+	SECOND_ARM   // An if took its else branch (or had none), or a loop was left
+};
+
+// Statement and branch coverage of one program as a bitmap, one byte per
+// slot. Programs compiled with CompilerOptions::coverage mark their slots
+// with a single byte store, and the VM writes into the coverage set with
+// VirtualMachine::setCoverage. As ExecutionHooks it also takes what the tree
+// walker reports, through a lookup per statement.
+//
+// Copies share the slot layout and can be merged, e.g. one per thread. Only
+// function bodies parsed when the coverage is made are covered.
+class ProgramCoverage : public ExecutionHooks {
+public:
+	static constexpr uint32_t NO_SLOT = UINT32_MAX;
+
+	explicit ProgramCoverage(const ASTNode* root) {
+		auto built = std::make_shared<Layout>();
+		built->id = nextId()++;
+		collect(*built, root);
+		layout = std::move(built);
+		hits.assign(layout->slotCount, 0);
+	}
+
+	void onStatement(size_t offset) override {
+		mark(offset, CoveragePoint::STATEMENT);
+	}
+
+	void onBranch(size_t offset, unsigned arm) override {
+		mark(offset, arm == 0 ? CoveragePoint::FIRST_ARM : CoveragePoint::SECOND_ARM);
+	}
+
+	// The slot of a point of the statement at `offset`, or NO_SLOT
+	uint32_t slot(size_t offset, CoveragePoint point) const {
+		auto found = layout->slots.find(key(offset, point));
+		return found != layout->slots.end() ? found->second : NO_SLOT;
+	}
+
+	// Same for copies, so a program compiled for one can mark any
+	uint64_t getId() const {
+		return layout->id;
+	}
+
+	uint8_t* getBitmap() {
+		return hits.data();
+	}
+
+	const std::vector<uint8_t>& getHits() const {
+		return hits;
+	}
+
+	void reset() {
+		std::fill(hits.begin(), hits.end(), 0);
+	}
+
+	// Add what a copy covered
+	void merge(const ProgramCoverage& other) {
+		if (other.getId() != getId()) {
+			throw std::runtime_error("Cannot merge coverage of different programs");
+		}
+		for (size_t i = 0; i < hits.size(); ++i) {
+			hits[i] |= other.hits[i];
+		}
+	}
+
+	size_t getStatements() const {
+		return layout->sites.size();
+	}
+
+	size_t getCoveredStatements() const {
+		return std::count_if(layout->sites.begin(), layout->sites.end(), [&](const Site& site) {
+			return hits[site.statement] != 0;
+		});
+	}
+
+	// Arms of if statements and loops
+	size_t getBranches() const {
+		return 2 * std::count_if(layout->sites.begin(), layout->sites.end(), [](const Site& site) {
+			return site.arms[0] != NO_SLOT;
+		});
+	}
+
+	size_t getCoveredBranches() const {
+		size_t covered = 0;
+		for (const Site& site : layout->sites) {
+			for (uint32_t arm : site.arms) {
+				covered += arm != NO_SLOT && hits[arm] != 0;
+			}
+		}
+		return covered;
+	}
+
+	// An lcov tracefile of the source `file` with text `source`: a line is hit
+	// when a statement starting on it ran, and each if or loop has two branches
+	std::string lcov(const std::string& file, std::string_view source) const {
+		std::vector<size_t> lines = PerfMap::lineStarts(source);
+		auto lineOf = [&](size_t offset) {
+			return static_cast<size_t>(std::upper_bound(lines.begin(), lines.end(), offset) - lines.begin());
+		};
+
+		std::map<size_t, bool> lineHits;
+		std::map<size_t, std::vector<const Site*>> branchSites;  // By line, in source order
+		for (const Site& site : layout->sites) {
+			size_t line = lineOf(site.offset);
+			lineHits[line] = lineHits[line] || hits[site.statement] != 0;
+			if (site.arms[0] != NO_SLOT) {
+				branchSites[line].push_back(&site);
+			}
+		}
+
+		std::ostringstream out;
+		out << "TN:\nSF:" << file << "\n";
+		size_t branches = 0;
+		size_t branchesHit = 0;
+		for (auto& [line, sites] : branchSites) {
+			std::stable_sort(sites.begin(), sites.end(), [](const Site* a, const Site* b) { return a->offset < b->offset; });
+			for (size_t block = 0; block < sites.size(); ++block) {
+				for (size_t arm = 0; arm < 2; ++arm) {
+					out << "BRDA:" << line << "," << block << "," << arm << ",";
+					if (!hits[sites[block]->statement]) {
+						out << "-\n";  // The statement never ran
+					}
+					else {
+						out << (hits[sites[block]->arms[arm]] ? 1 : 0) << "\n";
+					}
+					++branches;
+					branchesHit += hits[sites[block]->arms[arm]] != 0;
+				}
+			}
+		}
+		out << "BRF:" << branches << "\nBRH:" << branchesHit << "\n";
+		size_t linesHit = 0;
+		for (const auto& [line, hit] : lineHits) {
+			out << "DA:" << line << "," << (hit ? 1 : 0) << "\n";
+			linesHit += hit;
+		}
+		out << "LF:" << lineHits.size() << "\nLH:" << linesHit << "\nend_of_record\n";
+		return out.str();
+	}
+
+	void writeLcov(const std::string& path, const std::string& file, std::string_view source) const {
+		std::ofstream out(path);
+		if (!out) {
+			throw std::runtime_error("Cannot write coverage file: " + path);
+		}
+		out << lcov(file, source);
+	}
+
+private:
+	// A statement, and for ifs and loops the slots of their two arms
+	struct Site {
+		size_t offset;
+		uint32_t statement;
+		uint32_t arms[2];
+	};
+
+	struct Layout {
+		uint64_t id = 0;
+		std::vector<Site> sites;
+		std::unordered_map<uint64_t, uint32_t> slots;  // By offset and point
+		uint32_t slotCount = 0;
+	};
+
+	std::shared_ptr<const Layout> layout;
+	std::vector<uint8_t> hits;
+
+	static std::atomic<uint64_t>& nextId() {
+		static std::atomic<uint64_t> id{ 1 };
+		return id;
+	}
+
+	static uint64_t key(size_t offset, CoveragePoint point) {
+		return static_cast<uint64_t>(offset) << 2 | static_cast<uint64_t>(point);
+	}
+
+	void mark(size_t offset, CoveragePoint point) {
+		uint32_t index = slot(offset, point);
+		if (index != NO_SLOT) {
+			hits[index] = 1;
+		}
+	}
+
+	static uint32_t add(Layout& layout, size_t offset, CoveragePoint point) {
+		auto inserted = layout.slots.emplace(key(offset, point), layout.slotCount);
+		if (inserted.second) {
+			++layout.slotCount;
+		}
+		return inserted.first->second;
+	}
+
+	// The statements ASTNode::evaluate reports to the hooks, the same ones
+	// compiled code marks
+	static void collect(Layout& layout, const ASTNode* node) {
+		if (!node) {
+			return;
+		}
+		if (auto program = dynamic_cast<const ProgramNode*>(node)) {
+			for (const ASTNode* statement : program->statements) {
+				collect(layout, statement);
+			}
+			return;
+		}
+		if (auto block = dynamic_cast<const BlockNode*>(node)) {
+			for (const ASTNode* statement : block->statements) {
+				collect(layout, statement);
+			}
+			return;
+		}
+
+		Site site{ node->getSourceOffset(), add(layout, node->getSourceOffset(), CoveragePoint::STATEMENT), { NO_SLOT, NO_SLOT } };
+		auto conditional = dynamic_cast<const IfNode*>(node);
+		const ASTNode* body = nullptr;
+		if (auto loop = dynamic_cast<const WhileNode*>(node)) {
+			body = loop->body;
+		}
+		else if (auto loop = dynamic_cast<const ForNode*>(node)) {
+			body = loop->body;
+		}
+		else if (auto loop = dynamic_cast<const DoWhileNode*>(node)) {
+			body = loop->body;
+		}
+		if (conditional || body) {
+			site.arms[0] = add(layout, node->getSourceOffset(), CoveragePoint::FIRST_ARM);
+			site.arms[1] = add(layout, node->getSourceOffset(), CoveragePoint::SECOND_ARM);
+		}
+		layout.sites.push_back(site);
+
+		if (conditional) {
+			collect(layout, conditional->thenBranch);
+			collect(layout, conditional->elseBranch);
+		}
+		collect(layout, body);
+		if (auto definition = dynamic_cast<const FunctionNode*>(node)) {
+			collect(layout, definition->body);
+		}
+	}
+};
@@ -0,0 +1,380 @@
+#pragma once
+
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "AST.hpp"
+#include "ASTAnalysis.hpp"
+
+// Translates a parsed script into C++ source with the interpreter's semantics.
+// The generated header defines, inside the chosen namespace:
+//   void registerFunctions(Environment&)  - registers the script's functions as natives
+//   void run(Environment&)                - executes the top-level statements
+// Variables still live in the Environment, so natives, type checks and errors
+// behave as in the tree walker. Expressions are lowered to sequenced temporaries
+// to keep the left-to-right evaluation order. Calls to functions defined in the
+// script bind directly; all other calls go through Environment::evaluateFunction.
+class CppEmitter {
+public:
+	explicit CppEmitter(const std::string& namespaceName = "vfscript") : namespaceName(namespaceName) {}
+
+	std::string emit(const ASTNode* root) {
+		names.clear();
+		functions.clear();
+		temporaryCount = 0;
+		indent = 1;
+		collectFunctions(root);
+
+		body.str("");
+		emitFunctions();
+		emitEntryPoint(root);
+
+		std::ostringstream out;
+		out << "// Generated by vfScript --emit-cpp; do not edit.\n"
+			<< "#pragma once\n\n"
+			<< "#include <stdexcept>\n"
+			<< "#include <string>\n"
+			<< "#include <vector>\n\n"
+			<< "#include \"AST.hpp\"\n\n"
+			<< "namespace " << namespaceName << " {\n\n"
+			<< runtimeSupport;
+		for (const auto& name : names) {
+			out << "\tinline const std::string " << name.second << " = \"" << name.first << "\";\n";
+		}
+		out << "\n" << body.str() << "} // namespace " << namespaceName << "\n";
+		return out.str();
+	}
+
+private:
+	static constexpr const char* runtimeSupport =
+		"\tinline double divide(double left, double right) {\n"
+		"\t\tif (right == 0) {\n"
+		"\t\t\tthrow std::runtime_error(\"Division by zero\");\n"
+		"\t\t}\n"
+		"\t\treturn left / right;\n"
+		"\t}\n\n"
+		"\tinline void checkArity(const char* name, size_t given, size_t expected) {\n"
+		"\t\tif (given != expected) {\n"
+		"\t\t\tthrow std::runtime_error(std::string(\"Function \") + name + \" expects \" + std::to_string(expected) + \" arguments\");\n"
+		"\t\t}\n"
+		"\t}\n\n"
+		"\t// Call frame of a script function, popped on return and on exceptions\n"
+		"\tstruct Frame {\n"
+		"\t\tEnvironment& env;\n"
+		"\t\texplicit Frame(Environment& env) : env(env) { env.pushFrame(); }\n"
+		"\t\t~Frame() { env.popFrame(); }\n"
+		"\t};\n\n";
+
+	std::string namespaceName;
+	std::ostringstream body;
+	std::map<std::string, std::string> names;              // Script identifier -> string constant
+	std::map<std::string, const FunctionNode*> functions;  // Functions defined in the script
+	int indent = 1;
+	int temporaryCount = 0;
+
+	void line(const std::string& text) {
+		if (!text.empty()) {
+			body << std::string(indent, '\t') << text;
+		}
+		body << '\n';
+	}
+
+	std::string temporary() {
+		return "t" + std::to_string(temporaryCount++);
+	}
+
+	const std::string& nameConstant(const std::string& name) {
+		auto found = names.find(name);
+		if (found == names.end()) {
+			found = names.emplace(name, "name_" + name).first;
+		}
+		return found->second;
+	}
+
+	static std::string functionName(const std::string& name) {
+		return "function_" + name;
+	}
+
+	static std::string typeName(ValueType type) {
+		switch (type) {
+		case ValueType::INT: return "ValueType::INT";
+		case ValueType::FLOAT: return "ValueType::FLOAT";
+		case ValueType::BOOL: return "ValueType::BOOL";
+		default: return "ValueType::STRING";
+		}
+	}
+
+	// A double literal that round-trips exactly
+	static std::string literal(double value) {
+		std::ostringstream text;
+		text.precision(17);
+		text << value;
+		std::string result = text.str();
+		if (result.find_first_of(".e") == std::string::npos) {
+			result += ".0";
+		}
+		return result;
+	}
+
+	// Every definition in the script, wherever it is nested: the parser
+	// registers them all before the script runs
+	void collectFunctions(const ASTNode* node) {
+		if (!node) {
+			return;
+		}
+		if (auto function = dynamic_cast<const FunctionNode*>(node)) {
+			if (!function->body) {
+				throw std::runtime_error("Function body not parsed: " + function->name);
+			}
+			functions[function->name] = function;
+			collectFunctions(function->body);
+		}
+		forEachChild(node, [&](const ASTNode* child) { collectFunctions(child); });
+	}
+
+	static std::string signature(const std::string& name, const FunctionNode* function) {
+		std::string result = "double " + functionName(name) + "(Environment& env";
+		for (size_t i = 0; i < function->parameters.size(); ++i) {
+			result += ", double p" + std::to_string(i);
+		}
+		return result + ")";
+	}
+
+	void emitFunctions() {
+		for (const auto& entry : functions) {
+			line("inline " + signature(entry.first, entry.second) + ";");
+		}
+		if (!functions.empty()) {
+			line("");
+		}
+
+		for (const auto& entry : functions) {
+			const FunctionNode* function = entry.second;
+			line("inline " + signature(entry.first, function) + " {");
+			++indent;
+			line("Frame frame(env);");
+			for (size_t i = 0; i < function->parameters.size(); ++i) {
+				const std::string& name = nameConstant(function->parameters[i].first);
+				line("env.declareVariable(" + name + ", " + typeName(function->parameters[i].second) + ");");
+				line("env.setVariable(" + name + ", p" + std::to_string(i) + ");");
+			}
+			line("double result = 0;");
+			emitStatement(function->body, "result");
+			line("return result;");
+			--indent;
+			line("}");
+			line("");
+		}
+
+		line("inline void registerFunctions(Environment& env) {");
+		++indent;
+		for (const auto& entry : functions) {
+			size_t arity = entry.second->parameters.size();
+			std::string arguments = "env";
+			for (size_t i = 0; i < arity; ++i) {
+				arguments += ", args[" + std::to_string(i) + "]";
+			}
+			line("env.registerFunction(\"" + entry.first + "\", [&env](const std::vector<double>& args) -> double {");
+			++indent;
+			line("checkArity(\"" + entry.first + "\", args.size(), " + std::to_string(arity) + ");");
+			line("return " + functionName(entry.first) + "(" + arguments + ");");
+			--indent;
+			line("});");
+		}
+		--indent;
+		line("}");
+		line("");
+	}
+
+	void emitEntryPoint(const ASTNode* root) {
+		line("inline void run(Environment& env) {");
+		++indent;
+		emitStatement(root, "");
+		--indent;
+		line("}");
+		line("");
+	}
+
+	// Emit a statement; its value is stored in `target` unless that is empty
+	void emitStatement(const ASTNode* node, const std::string& target) {
+		auto store = [&](const std::string& value) {
+			if (!target.empty()) {
+				line(target + " = " + value + ";");
+			}
+		};
+		// An expression value: stored, or discarded so that its temporary is used
+		auto result = [&](const std::string& value) {
+			if (target.empty()) {
+				line("static_cast<void>(" + value + ");");
+			}
+			store(value);
+		};
+
+		if (auto declaration = dynamic_cast<const DeclarationNode*>(node)) {
+			const std::string& name = nameConstant(declaration->variableName);
+			line("env.declareVariable(" + name + ", " + typeName(declaration->type) + ");");
+			if (declaration->initializer) {
+				line("env.setVariable(" + name + ", " + emitExpression(declaration->initializer) + ");");
+			}
+			store("0");
+		}
+		else if (auto assignment = dynamic_cast<const AssignmentNode*>(node)) {
+			std::string value = emitExpression(assignment->expression);
+			line("env.setVariable(" + nameConstant(assignment->variableName) + ", " + value + ");");
+			store(value);
+		}
+		else if (auto program = dynamic_cast<const ProgramNode*>(node)) {
+			emitSequence(program->statements);
+			store("0");
+		}
+		else if (auto block = dynamic_cast<const BlockNode*>(node)) {
+			line("{");
+			++indent;
+			emitSequence(block->statements);
+			--indent;
+			line("}");
+			store("0");
+		}
+		else if (auto branch = dynamic_cast<const IfNode*>(node)) {
+			std::string condition = emitExpression(branch->condition);
+			line("if (" + condition + " != 0) {");
+			++indent;
+			emitStatement(branch->thenBranch, target);
+			--indent;
+			line("}");
+			line("else {");
+			++indent;
+			if (branch->elseBranch) {
+				emitStatement(branch->elseBranch, target);
+			}
+			else {
+				store("0");
+			}
+			--indent;
+			line("}");
+		}
+		else if (auto loop = dynamic_cast<const WhileNode*>(node)) {
+			store("0");
+			line("while (true) {");
+			++indent;
+			line("if (" + emitExpression(loop->condition) + " == 0) {");
+			line("\tbreak;");
+			line("}");
+			emitStatement(loop->body, target);
+			--indent;
+			line("}");
+		}
+		else if (auto loop = dynamic_cast<const DoWhileNode*>(node)) {
+			line("while (true) {");
+			++indent;
+			emitStatement(loop->body, target);
+			line("if (" + emitExpression(loop->condition) + " == 0) {");
+			line("\tbreak;");
+			line("}");
+			--indent;
+			line("}");
+		}
+		else if (auto loop = dynamic_cast<const ForNode*>(node)) {
+			if (loop->initializer) {
+				emitStatement(loop->initializer, "");
+			}
+			store("0");
+			line("while (true) {");
+			++indent;
+			line("if (" + emitExpression(loop->condition) + " == 0) {");
+			line("\tbreak;");
+			line("}");
+			emitStatement(loop->body, target);
+			if (loop->update) {
+				emitStatement(loop->update, "");
+			}
+			--indent;
+			line("}");
+		}
+		else if (auto ret = dynamic_cast<const ReturnNode*>(node)) {
+			result(emitExpression(ret->returnValue));
+		}
+		else if (dynamic_cast<const FunctionNode*>(node)) {
+			store("0");  // Emitted at namespace scope
+		}
+		else {
+			result(emitExpression(node));
+		}
+	}
+
+	void emitSequence(const std::vector<ASTNode*>& statements) {
+		for (const ASTNode* statement : statements) {
+			emitStatement(statement, "");
+		}
+	}
+
+	// Emit the code computing an expression; returns a literal or a temporary holding its value
+	std::string emitExpression(const ASTNode* node) {
+		if (auto number = dynamic_cast<const NumberNode*>(node)) {
+			return literal(number->value);
+		}
+		if (auto variable = dynamic_cast<const VariableNode*>(node)) {
+			return define("env.getVariable(" + nameConstant(variable->name) + ")");
+		}
+		if (auto binary = dynamic_cast<const BinaryOpNode*>(node)) {
+			std::string left = emitExpression(binary->left);
+			std::string right = emitExpression(binary->right);
+			switch (binary->op) {
+			case TokenType::PLUS: return define(left + " + " + right);
+			case TokenType::MINUS: return define(left + " - " + right);
+			case TokenType::MULTIPLY: return define(left + " * " + right);
+			case TokenType::DIVIDE: return define("divide(" + left + ", " + right + ")");
+			case TokenType::AND: return define("(" + left + " != 0 && " + right + " != 0) ? 1.0 : 0.0");
+			case TokenType::OR: return define("(" + left + " != 0 || " + right + " != 0) ? 1.0 : 0.0");
+			case TokenType::EQUALS: return define("(" + left + " == " + right + ") ? 1.0 : 0.0");
+			case TokenType::NOT_EQUALS: return define("(" + left + " != " + right + ") ? 1.0 : 0.0");
+			case TokenType::LESS: return define("(" + left + " < " + right + ") ? 1.0 : 0.0");
+			case TokenType::LESS_EQUALS: return define("(" + left + " <= " + right + ") ? 1.0 : 0.0");
+			case TokenType::GREATER: return define("(" + left + " > " + right + ") ? 1.0 : 0.0");
+			case TokenType::GREATER_EQUALS: return define("(" + left + " >= " + right + ") ? 1.0 : 0.0");
+			default: throw std::runtime_error("Unknown binary operator");
+			}
+		}
+		if (auto unary = dynamic_cast<const UnaryOpNode*>(node)) {
+			std::string operand = emitExpression(unary->operand);
+			switch (unary->op) {
+			case TokenType::MINUS: return define("-(" + operand + ")");
+			case TokenType::NOT: return define("(" + operand + " == 0) ? 1.0 : 0.0");
+			default: throw std::runtime_error("Unknown unary operator");
+			}
+		}
+		if (auto call = dynamic_cast<const FunctionCallNode*>(node)) {
+			std::vector<std::string> arguments;
+			for (const ASTNode* argument : call->arguments) {
+				arguments.push_back(emitExpression(argument));
+			}
+
+			std::string list;
+			for (const std::string& argument : arguments) {
+				list += (list.empty() ? "" : ", ") + argument;
+			}
+
+			auto function = functions.find(call->name);
+			if (function == functions.end()) {
+				return define("env.evaluateFunction(" + nameConstant(call->name) + ", { " + list + " })");
+			}
+			size_t arity = function->second->parameters.size();
+			if (arguments.size() != arity) {
+				// Reported when the call runs, as in the interpreter
+				return define("(checkArity(\"" + call->name + "\", " + std::to_string(arguments.size()) + ", "
+					+ std::to_string(arity) + "), 0.0)");
+			}
+			return define(functionName(call->name) + "(env" + (list.empty() ? "" : ", ") + list + ")");
+		}
+		throw std::runtime_error("Unsupported AST node in C++ emitter");
+	}
+
+	std::string define(const std::string& value) {
+		std::string name = temporary();
+		line("const double " + name + " = " + value + ";");
+		return name;
+	}
+};
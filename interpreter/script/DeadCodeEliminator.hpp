@@ -0,0 +1,355 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "ASTAnalysis.hpp"
+#include "Optimizer.hpp"
+
+// Source-level dead code elimination, for the tree walker and every backend
+// that starts from the AST. Folds constant conditions, drops statements that
+// never run or have no effect, and removes stores to function locals that are
+// never read. Calls to natives not registered as pure are always kept.
+//
+// Top-level variables are left alone: the host may read them after the run.
+// Run it before compiling the tree, and not on trees owned by an
+// IncrementalParser, which tracks top-level statements by position.
+class DeadCodeEliminator {
+public:
+	DeadCodeEliminator(const Environment& env, OptimizerStats& stats) : env(env), stats(stats) {}
+
+	// Rewrite the tree in place; `root` itself is kept
+	void run(ASTNode* root) {
+		scope = Scope();
+		if (auto program = dynamic_cast<ProgramNode*>(root)) {
+			statementList(program->statements);
+		}
+		else if (auto definition = dynamic_cast<FunctionNode*>(root)) {
+			function(definition);
+		}
+	}
+
+private:
+	// Locals of the function being simplified, empty unless they are static
+	struct Scope {
+		std::unordered_map<std::string, ValueType> locals;
+		std::unordered_set<std::string> dead;  // Never read, every store removable
+	};
+
+	const Environment& env;
+	OptimizerStats& stats;
+	Scope scope;
+
+	// Removing stores can make further locals dead, so repeat until nothing changes
+	void function(FunctionNode* definition) {
+		if (!definition->body) {
+			return;  // Deferred body, not parsed yet
+		}
+		Scope outer = std::move(scope);
+		size_t removed;
+		do {
+			removed = stats.storesRemoved;
+			LocalAnalysis analysis(definition);
+			scope = Scope();
+			if (analysis.isStatic()) {
+				scope.locals = analysis.getLocals();
+				scope.dead = findDeadLocals(definition->body);
+			}
+			bool completes;
+			definition->body = statement(definition->body, true, completes);
+		} while (stats.storesRemoved != removed);
+		scope = std::move(outer);
+	}
+
+	// Simplify a list of statements; returns false if it never runs to its end
+	bool statementList(std::vector<ASTNode*>& statements) {
+		std::vector<ASTNode*> kept;
+		bool completes = true;
+		for (ASTNode* child : statements) {
+			if (!completes && !definesFunctions(child)) {
+				delete child;  // Follows a loop that never exits
+				++stats.statementsRemoved;
+				continue;
+			}
+			bool childCompletes;
+			if (ASTNode* replacement = statement(child, false, childCompletes)) {
+				kept.push_back(replacement);
+			}
+			completes = completes && childCompletes;
+		}
+		statements = std::move(kept);
+		return completes;
+	}
+
+	// Simplify a statement and return what replaces it, or nullptr when it can
+	// be dropped. With `valueUsed` the replacement evaluates to the same value.
+	ASTNode* statement(ASTNode* node, bool valueUsed, bool& completes) {
+		completes = true;
+		if (!node) {
+			return nullptr;
+		}
+		if (auto block = dynamic_cast<BlockNode*>(node)) {
+			completes = statementList(block->statements);
+			if (block->statements.empty() && !valueUsed) {
+				delete block;
+				return nullptr;
+			}
+			return block;
+		}
+		if (auto declaration = dynamic_cast<DeclarationNode*>(node)) {
+			if (!scope.dead.count(declaration->variableName)) {
+				return node;
+			}
+			ASTNode* effects = effectsOf(release(declaration->initializer));
+			delete declaration;
+			++stats.storesRemoved;
+			if (valueUsed) {
+				return new BlockNode(effects ? std::vector<ASTNode*>{ effects } : std::vector<ASTNode*>{});
+			}
+			return effects;
+		}
+		if (auto assignment = dynamic_cast<AssignmentNode*>(node)) {
+			if (!scope.dead.count(assignment->variableName)) {
+				return node;
+			}
+			ASTNode* value = release(assignment->expression);
+			delete assignment;
+			++stats.storesRemoved;
+			return valueUsed ? value : effectsOf(value);
+		}
+		if (auto conditional = dynamic_cast<IfNode*>(node)) {
+			return ifStatement(conditional, valueUsed, completes);
+		}
+		if (auto loop = dynamic_cast<WhileNode*>(node)) {
+			double value;
+			bool constant = constantValue(loop->condition, value);
+			if (constant && value == 0 && !definesFunctions(loop->body)) {
+				delete loop;
+				++stats.conditionsFolded;
+				return valueUsed ? new NumberNode(0) : nullptr;
+			}
+			bool bodyCompletes;
+			loop->body = orEmpty(statement(loop->body, valueUsed, bodyCompletes));
+			completes = !constant;
+			return loop;
+		}
+		if (auto loop = dynamic_cast<ForNode*>(node)) {
+			bool initializerCompletes, bodyCompletes;
+			loop->initializer = statement(loop->initializer, false, initializerCompletes);
+			double value;
+			bool constant = constantValue(loop->condition, value);
+			if (constant && value == 0 && !definesFunctions(loop->body)) {
+				ASTNode* initializer = release(loop->initializer);
+				delete loop;
+				++stats.conditionsFolded;
+				if (valueUsed) {
+					return new BlockNode(initializer ? std::vector<ASTNode*>{ initializer } : std::vector<ASTNode*>{});
+				}
+				return initializer;
+			}
+			loop->body = orEmpty(statement(loop->body, valueUsed, bodyCompletes));
+			loop->update = statement(loop->update, false, bodyCompletes);
+			completes = !constant;
+			return loop;
+		}
+		if (auto loop = dynamic_cast<DoWhileNode*>(node)) {
+			double value;
+			bool constant = constantValue(loop->condition, value);
+			if (constant && value == 0) {
+				ASTNode* body = release(loop->body);
+				delete loop;
+				++stats.conditionsFolded;
+				return statement(body, valueUsed, completes);  // Runs exactly once
+			}
+			bool bodyCompletes;
+			loop->body = orEmpty(statement(loop->body, valueUsed, bodyCompletes));
+			completes = bodyCompletes && !constant;
+			return loop;
+		}
+		if (auto ret = dynamic_cast<ReturnNode*>(node)) {
+			if (!valueUsed && isPure(ret->returnValue)) {
+				delete ret;
+				++stats.statementsRemoved;
+				return nullptr;
+			}
+			return node;
+		}
+		if (auto definition = dynamic_cast<FunctionNode*>(node)) {
+			function(definition);
+			return node;
+		}
+		if (!valueUsed && isPure(node)) {
+			delete node;
+			++stats.statementsRemoved;
+			return nullptr;
+		}
+		return node;
+	}
+
+	ASTNode* ifStatement(IfNode* conditional, bool valueUsed, bool& completes) {
+		double value;
+		if (constantValue(conditional->condition, value)) {
+			ASTNode*& taken = value != 0 ? conditional->thenBranch : conditional->elseBranch;
+			ASTNode*& skipped = value != 0 ? conditional->elseBranch : conditional->thenBranch;
+			if (!definesFunctions(skipped)) {
+				ASTNode* branch = release(taken);
+				delete conditional;
+				++stats.conditionsFolded;
+				if (!branch) {
+					return valueUsed ? new NumberNode(0) : nullptr;
+				}
+				return statement(branch, valueUsed, completes);
+			}
+		}
+
+		bool thenCompletes, elseCompletes;
+		conditional->thenBranch = orEmpty(statement(conditional->thenBranch, valueUsed, thenCompletes));
+		conditional->elseBranch = statement(conditional->elseBranch, valueUsed, elseCompletes);
+		completes = thenCompletes || elseCompletes;
+		if (!valueUsed && !conditional->elseBranch && isEmpty(conditional->thenBranch) && isPure(conditional->condition)) {
+			delete conditional;
+			++stats.statementsRemoved;
+			return nullptr;
+		}
+		return conditional;
+	}
+
+	// --- Helpers ---
+
+	static ASTNode* release(ASTNode*& child) {
+		return std::exchange(child, nullptr);
+	}
+
+	static ASTNode* orEmpty(ASTNode* node) {
+		return node ? node : new BlockNode({});
+	}
+
+	static bool isEmpty(const ASTNode* node) {
+		auto block = dynamic_cast<const BlockNode*>(node);
+		return block && block->statements.empty();
+	}
+
+	// Definitions are registered while parsing, so their nodes must outlive the run
+	static bool definesFunctions(const ASTNode* node) {
+		if (!node) {
+			return false;
+		}
+		if (dynamic_cast<const FunctionNode*>(node)) {
+			return true;
+		}
+		bool found = false;
+		forEachChild(node, [&](const ASTNode* child) { found = found || definesFunctions(child); });
+		return found;
+	}
+
+	// The part of an unused expression that must still run
+	ASTNode* effectsOf(ASTNode* expression) {
+		if (expression && isPure(expression)) {
+			delete expression;
+			return nullptr;
+		}
+		return expression;
+	}
+
+	// Value of an expression made of literals only; false if it has none or would throw
+	static bool constantValue(const ASTNode* node, double& value) {
+		if (auto number = dynamic_cast<const NumberNode*>(node)) {
+			value = number->value;
+			return true;
+		}
+		if (auto unary = dynamic_cast<const UnaryOpNode*>(node)) {
+			double operand;
+			if (!constantValue(unary->operand, operand)) {
+				return false;
+			}
+			value = UnaryOpNode::apply(unary->op, operand);
+			return true;
+		}
+		if (auto binary = dynamic_cast<const BinaryOpNode*>(node)) {
+			double left, right;
+			if (!constantValue(binary->left, left) || !constantValue(binary->right, right)
+				|| (binary->op == TokenType::DIVIDE && right == 0)) {
+				return false;
+			}
+			value = BinaryOpNode::apply(binary->op, left, right);
+			return true;
+		}
+		return false;
+	}
+
+	// Evaluating `node` has no side effects and cannot throw
+	bool isPure(const ASTNode* node) const {
+		if (dynamic_cast<const NumberNode*>(node)) {
+			return true;
+		}
+		if (auto variable = dynamic_cast<const VariableNode*>(node)) {
+			return scope.locals.count(variable->name) != 0;  // Static locals are declared before every read
+		}
+		if (auto unary = dynamic_cast<const UnaryOpNode*>(node)) {
+			return isPure(unary->operand);
+		}
+		if (auto binary = dynamic_cast<const BinaryOpNode*>(node)) {
+			double divisor;
+			if (binary->op == TokenType::DIVIDE && !(constantValue(binary->right, divisor) && divisor != 0)) {
+				return false;
+			}
+			return isPure(binary->left) && isPure(binary->right);
+		}
+		if (auto call = dynamic_cast<const FunctionCallNode*>(node)) {
+			if (!env.isPureFunction(call->name)) {
+				return false;
+			}
+			for (const ASTNode* argument : call->arguments) {
+				if (!isPure(argument)) {
+					return false;
+				}
+			}
+			return true;
+		}
+		return false;
+	}
+
+	// Locals that are never read. An int local is only dead if all its stores
+	// pass the type check, since dropping a store would hide the type error.
+	std::unordered_set<std::string> findDeadLocals(const ASTNode* body) const {
+		std::unordered_set<std::string> read, checked;
+		collectUses(body, read, checked);
+		std::unordered_set<std::string> dead;
+		for (const auto& local : scope.locals) {
+			if (!read.count(local.first) && !checked.count(local.first)) {
+				dead.insert(local.first);
+			}
+		}
+		return dead;
+	}
+
+	void collectUses(const ASTNode* node, std::unordered_set<std::string>& read, std::unordered_set<std::string>& checked) const {
+		if (!node || dynamic_cast<const FunctionNode*>(node)) {
+			return;
+		}
+		const std::string* name = nullptr;
+		const ASTNode* stored = nullptr;
+		if (auto variable = dynamic_cast<const VariableNode*>(node)) {
+			read.insert(variable->name);
+		}
+		else if (auto declaration = dynamic_cast<const DeclarationNode*>(node)) {
+			name = &declaration->variableName;
+			stored = declaration->initializer;
+		}
+		else if (auto assignment = dynamic_cast<const AssignmentNode*>(node)) {
+			name = &assignment->variableName;
+			stored = assignment->expression;
+		}
+
+		auto local = name ? scope.locals.find(*name) : scope.locals.end();
+		double value;
+		if (stored && local != scope.locals.end() && local->second == ValueType::INT
+			&& !(constantValue(stored, value) && isIntValue(value))) {
+			checked.insert(*name);
+		}
+		forEachChild(node, [&](const ASTNode* child) { collectUses(child, read, checked); });
+	}
+};
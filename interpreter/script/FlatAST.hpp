@@ -0,0 +1,322 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "AST.hpp"
+
+// Node kind tag used for dispatch in the flat layout
+enum class NodeKind : uint8_t {
+	PROGRAM,
+	BLOCK,
+	FOR,
+	DO_WHILE,
+	DECLARATION,
+	ASSIGNMENT,
+	VARIABLE,
+	NUMBER,
+	FUNCTION,
+	FUNCTION_CALL,
+	RETURN,
+	IF,
+	WHILE,
+	BINARY_OP,
+	UNARY_OP
+};
+
+// Struct-of-arrays copy of a pointer-based AST. Node i is kinds[i] plus up to
+// four 32-bit operands holding child node indices, name/number table indices or
+// an operator; child lists live in one shared array. Operands per kind:
+//   PROGRAM, BLOCK: first child, child count
+//   FOR: initializer, condition, update, body    DO_WHILE: body, condition
+//   DECLARATION: name, ValueType, initializer    ASSIGNMENT: name, expression
+//   VARIABLE, FUNCTION: name    NUMBER: number    RETURN: expression
+//   FUNCTION_CALL: name, first argument, argument count
+//   IF: condition, then, else    WHILE: condition, body
+//   BINARY_OP: TokenType, left, right    UNARY_OP: TokenType, operand
+// Function bodies stay in the pointer tree; calls go through the Environment.
+// Nodes take about two thirds of the memory of the pointer tree's, but evaluation is
+// slower than the tree walker's (test14 compares both).
+class FlatAST {
+public:
+	static constexpr uint32_t NONE = UINT32_MAX;
+
+	explicit FlatAST(const ASTNode* root) {
+		rootIndex = add(root);
+	}
+
+	double evaluate(Environment& env) const {
+		return evaluateNode(env, rootIndex);
+	}
+
+	size_t getNodeCount() const {
+		return kinds.size();
+	}
+
+	// Bytes held by the flat layout (excluding allocator overhead), counted by
+	// capacity like the source tree
+	size_t getMemoryBytes() const {
+		size_t bytes = kinds.capacity() * sizeof(NodeKind) + (operand0.capacity() + operand1.capacity() +
+			operand2.capacity() + operand3.capacity()) * sizeof(uint32_t) +
+			children.capacity() * sizeof(uint32_t) + numbers.capacity() * sizeof(double) +
+			names.capacity() * sizeof(std::string);
+		for (const std::string& name : names) {
+			bytes += name.capacity() >= sizeof(std::string) ? name.capacity() + 1 : 0;
+		}
+		return bytes;
+	}
+
+	// Bytes held by the source tree's nodes, measured while flattening
+	size_t getTreeMemoryBytes() const {
+		return treeBytes;
+	}
+
+private:
+	std::vector<NodeKind> kinds;
+	std::vector<uint32_t> operand0;
+	std::vector<uint32_t> operand1;
+	std::vector<uint32_t> operand2;
+	std::vector<uint32_t> operand3;
+	std::vector<uint32_t> children;
+	std::vector<double> numbers;
+	std::vector<std::string> names;
+	std::unordered_map<std::string, uint32_t> nameIndices;
+	uint32_t rootIndex;
+	size_t treeBytes = 0;
+
+	uint32_t addNode(NodeKind kind, uint32_t a = NONE, uint32_t b = NONE, uint32_t c = NONE, uint32_t d = NONE) {
+		kinds.push_back(kind);
+		operand0.push_back(a);
+		operand1.push_back(b);
+		operand2.push_back(c);
+		operand3.push_back(d);
+		return static_cast<uint32_t>(kinds.size() - 1);
+	}
+
+	uint32_t intern(const std::string& name) {
+		treeBytes += name.capacity() >= sizeof(std::string) ? name.capacity() + 1 : 0;
+		auto found = nameIndices.find(name);
+		if (found != nameIndices.end()) {
+			return found->second;
+		}
+		names.push_back(name);
+		return nameIndices[name] = static_cast<uint32_t>(names.size() - 1);
+	}
+
+	uint32_t addOptional(const ASTNode* node) {
+		return node ? add(node) : NONE;
+	}
+
+	// Flatten a child list; returns the index of its first entry in `children`
+	uint32_t addList(const std::vector<ASTNode*>& nodes) {
+		treeBytes += nodes.capacity() * sizeof(ASTNode*);
+		std::vector<uint32_t> indices;
+		for (const ASTNode* node : nodes) {
+			indices.push_back(add(node));
+		}
+		uint32_t first = static_cast<uint32_t>(children.size());
+		children.insert(children.end(), indices.begin(), indices.end());
+		return first;
+	}
+
+	uint32_t add(const ASTNode* node) {
+		if (auto program = dynamic_cast<const ProgramNode*>(node)) {
+			treeBytes += sizeof(ProgramNode);
+			uint32_t first = addList(program->statements);
+			return addNode(NodeKind::PROGRAM, first, static_cast<uint32_t>(program->statements.size()));
+		}
+		if (auto block = dynamic_cast<const BlockNode*>(node)) {
+			treeBytes += sizeof(BlockNode);
+			uint32_t first = addList(block->statements);
+			return addNode(NodeKind::BLOCK, first, static_cast<uint32_t>(block->statements.size()));
+		}
+		if (auto loop = dynamic_cast<const ForNode*>(node)) {
+			treeBytes += sizeof(ForNode);
+			return addNode(NodeKind::FOR, addOptional(loop->initializer), add(loop->condition),
+				addOptional(loop->update), add(loop->body));
+		}
+		if (auto loop = dynamic_cast<const DoWhileNode*>(node)) {
+			treeBytes += sizeof(DoWhileNode);
+			return addNode(NodeKind::DO_WHILE, add(loop->body), add(loop->condition));
+		}
+		if (auto declaration = dynamic_cast<const DeclarationNode*>(node)) {
+			treeBytes += sizeof(DeclarationNode);
+			return addNode(NodeKind::DECLARATION, intern(declaration->variableName),
+				static_cast<uint32_t>(declaration->type), addOptional(declaration->initializer));
+		}
+		if (auto assignment = dynamic_cast<const AssignmentNode*>(node)) {
+			treeBytes += sizeof(AssignmentNode);
+			return addNode(NodeKind::ASSIGNMENT, intern(assignment->variableName), add(assignment->expression));
+		}
+		if (auto variable = dynamic_cast<const VariableNode*>(node)) {
+			treeBytes += sizeof(VariableNode);
+			return addNode(NodeKind::VARIABLE, intern(variable->name));
+		}
+		if (auto number = dynamic_cast<const NumberNode*>(node)) {
+			treeBytes += sizeof(NumberNode);
+			numbers.push_back(number->value);
+			return addNode(NodeKind::NUMBER, static_cast<uint32_t>(numbers.size() - 1));
+		}
+		if (auto function = dynamic_cast<const FunctionNode*>(node)) {
+			treeBytes += sizeof(FunctionNode);
+			return addNode(NodeKind::FUNCTION, intern(function->name));
+		}
+		if (auto call = dynamic_cast<const FunctionCallNode*>(node)) {
+			treeBytes += sizeof(FunctionCallNode);
+			uint32_t name = intern(call->name);
+			uint32_t first = addList(call->arguments);
+			return addNode(NodeKind::FUNCTION_CALL, name, first, static_cast<uint32_t>(call->arguments.size()));
+		}
+		if (auto ret = dynamic_cast<const ReturnNode*>(node)) {
+			treeBytes += sizeof(ReturnNode);
+			return addNode(NodeKind::RETURN, add(ret->returnValue));
+		}
+		if (auto branch = dynamic_cast<const IfNode*>(node)) {
+			treeBytes += sizeof(IfNode);
+			return addNode(NodeKind::IF, add(branch->condition), add(branch->thenBranch), addOptional(branch->elseBranch));
+		}
+		if (auto loop = dynamic_cast<const WhileNode*>(node)) {
+			treeBytes += sizeof(WhileNode);
+			return addNode(NodeKind::WHILE, add(loop->condition), add(loop->body));
+		}
+		if (auto binary = dynamic_cast<const BinaryOpNode*>(node)) {
+			treeBytes += sizeof(BinaryOpNode);
+			return addNode(NodeKind::BINARY_OP, static_cast<uint32_t>(binary->op), add(binary->left), add(binary->right));
+		}
+		if (auto unary = dynamic_cast<const UnaryOpNode*>(node)) {
+			treeBytes += sizeof(UnaryOpNode);
+			return addNode(NodeKind::UNARY_OP, static_cast<uint32_t>(unary->op), add(unary->operand));
+		}
+		throw std::runtime_error("Unknown AST node");
+	}
+
+	// Mirrors ASTNode::evaluate of each node type. The dispatcher stays small;
+	// the heavier cases live in their own functions.
+	double evaluateNode(Environment& env, uint32_t node) const {
+		switch (kinds[node]) {
+		case NodeKind::PROGRAM:
+		case NodeKind::BLOCK:
+			return evaluateBlock(env, node);
+		case NodeKind::FOR:
+			return evaluateFor(env, node);
+		case NodeKind::DO_WHILE:
+			return evaluateDoWhile(env, node);
+		case NodeKind::DECLARATION:
+			return evaluateDeclaration(env, node);
+		case NodeKind::ASSIGNMENT:
+			return evaluateAssignment(env, node);
+		case NodeKind::VARIABLE:
+			return env.getVariable(names[operand0[node]]);
+		case NodeKind::NUMBER:
+			return numbers[operand0[node]];
+		case NodeKind::FUNCTION:
+			return 0;
+		case NodeKind::FUNCTION_CALL:
+			return evaluateCall(env, node);
+		case NodeKind::RETURN:
+			return evaluateNode(env, operand0[node]);
+		case NodeKind::IF:
+			return evaluateIf(env, node);
+		case NodeKind::WHILE:
+			return evaluateWhile(env, node);
+		case NodeKind::BINARY_OP:
+			return evaluateBinary(env, node);
+		case NodeKind::UNARY_OP:
+			return UnaryOpNode::apply(static_cast<TokenType>(operand0[node]), evaluateNode(env, operand1[node]));
+		}
+		throw std::runtime_error("Unknown AST node");
+	}
+
+	double evaluateBlock(Environment& env, uint32_t node) const {
+		uint32_t end = operand0[node] + operand1[node];
+		for (uint32_t i = operand0[node]; i < end; ++i) {
+			evaluateNode(env, children[i]);
+		}
+		return 0;
+	}
+
+	double evaluateFor(Environment& env, uint32_t node) const {
+		if (operand0[node] != NONE) {
+			evaluateNode(env, operand0[node]);
+		}
+		double result = 0;
+		while (evaluateNode(env, operand1[node]) != 0) {
+			result = evaluateNode(env, operand3[node]);
+			if (operand2[node] != NONE) {
+				evaluateNode(env, operand2[node]);
+			}
+		}
+		return result;
+	}
+
+	double evaluateDoWhile(Environment& env, uint32_t node) const {
+		double result = 0;
+		do {
+			result = evaluateNode(env, operand0[node]);
+		} while (evaluateNode(env, operand1[node]) != 0);
+		return result;
+	}
+
+	double evaluateDeclaration(Environment& env, uint32_t node) const {
+		const std::string& name = names[operand0[node]];
+		env.declareVariable(name, static_cast<ValueType>(operand1[node]));
+		if (operand2[node] != NONE) {
+			env.setVariable(name, evaluateNode(env, operand2[node]));
+		}
+		return 0;
+	}
+
+	double evaluateAssignment(Environment& env, uint32_t node) const {
+		double value = evaluateOperand(env, operand1[node]);
+		env.setVariable(names[operand0[node]], value);
+		return value;
+	}
+
+	double evaluateCall(Environment& env, uint32_t node) const {
+		std::vector<double> argValues;
+		uint32_t end = operand1[node] + operand2[node];
+		for (uint32_t i = operand1[node]; i < end; ++i) {
+			argValues.push_back(evaluateNode(env, children[i]));
+		}
+		return env.evaluateFunction(names[operand0[node]], argValues);
+	}
+
+	double evaluateIf(Environment& env, uint32_t node) const {
+		if (evaluateNode(env, operand0[node]) != 0) {
+			return evaluateNode(env, operand1[node]);
+		}
+		else if (operand2[node] != NONE) {
+			return evaluateNode(env, operand2[node]);
+		}
+		return 0;
+	}
+
+	double evaluateWhile(Environment& env, uint32_t node) const {
+		double result = 0;
+		while (evaluateNode(env, operand0[node]) != 0) {
+			result = evaluateNode(env, operand1[node]);
+		}
+		return result;
+	}
+
+	// Leaves are resolved at the use site: this spreads dispatch over several
+	// well-predicted branches instead of funnelling every node through one switch
+	double evaluateOperand(Environment& env, uint32_t node) const {
+		if (kinds[node] == NodeKind::NUMBER) {
+			return numbers[operand0[node]];
+		}
+		if (kinds[node] == NodeKind::VARIABLE) {
+			return env.getVariable(names[operand0[node]]);
+		}
+		return evaluateNode(env, node);
+	}
+
+	double evaluateBinary(Environment& env, uint32_t node) const {
+		double leftValue = evaluateOperand(env, operand1[node]);
+		double rightValue = evaluateOperand(env, operand2[node]);
+		return BinaryOpNode::apply(static_cast<TokenType>(operand0[node]), leftValue, rightValue);
+	}
+};
@@ -0,0 +1,247 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Counts of the calling thread in user space. Counters that could not be
+// opened stay 0.
+struct CounterValues {
+	uint64_t taskClock = 0;  // Nanoseconds on a CPU; a software counter, so also in VMs
+	uint64_t cycles = 0;
+	uint64_t instructions = 0;
+	uint64_t branchMisses = 0;
+	uint64_t cacheMisses = 0;
+
+	CounterValues& operator+=(const CounterValues& other) {
+		taskClock += other.taskClock;
+		cycles += other.cycles;
+		instructions += other.instructions;
+		branchMisses += other.branchMisses;
+		cacheMisses += other.cacheMisses;
+		return *this;
+	}
+
+	// Counts since `earlier`
+	CounterValues operator-(const CounterValues& earlier) const {
+		CounterValues result;
+		result.taskClock = taskClock - earlier.taskClock;
+		result.cycles = cycles - earlier.cycles;
+		result.instructions = instructions - earlier.instructions;
+		result.branchMisses = branchMisses - earlier.branchMisses;
+		result.cacheMisses = cacheMisses - earlier.cacheMisses;
+		return result;
+	}
+};
+
+// Hardware performance counters of the calling thread through
+// perf_event_open, read together as one group and scaled when the kernel
+// multiplexes them. Where perf events are unavailable (other platforms,
+// perf_event_paranoid, VMs without a PMU) the missing counters read as 0, and
+// getError() says why.
+class HardwareCounters {
+public:
+	HardwareCounters() {
+#ifdef __linux__
+		open(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, &CounterValues::taskClock, "task-clock");
+		open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, &CounterValues::cycles, "cycles");
+		open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, &CounterValues::instructions, "instructions");
+		open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, &CounterValues::branchMisses, "branch-misses");
+		open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, &CounterValues::cacheMisses, "cache-misses");
+		if (leader >= 0) {
+			ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+		}
+#else
+		error = "perf events are only available on Linux";
+#endif
+	}
+
+	HardwareCounters(const HardwareCounters&) = delete;
+	HardwareCounters& operator=(const HardwareCounters&) = delete;
+
+	~HardwareCounters() {
+#ifdef __linux__
+		for (const Counter& counter : counters) {
+			close(counter.descriptor);
+		}
+#endif
+	}
+
+	// True if any counter could be opened
+	bool isAvailable() const {
+		return !counters.empty();
+	}
+
+	// True if the hardware counters could be opened, not just task-clock
+	bool hasHardwareCounters() const {
+		return counters.size() > 1 || (counters.size() == 1 && counters[0].field != &CounterValues::taskClock);
+	}
+
+	// Names of the counters not opened, with the reason, or an empty string
+	const std::string& getError() const {
+		return error;
+	}
+
+	// Counts since the counters were opened
+	CounterValues read() const {
+		CounterValues values;
+#ifdef __linux__
+		if (counters.empty()) {
+			return values;
+		}
+		uint64_t buffer[3 + MAX_COUNTERS];  // nr, time enabled, time running, values
+		if (::read(leader, buffer, sizeof(buffer)) < static_cast<ssize_t>(3 * sizeof(uint64_t))) {
+			return values;
+		}
+		uint64_t enabled = buffer[1];
+		uint64_t running = buffer[2];
+		for (size_t i = 0; i < counters.size() && i < buffer[0]; ++i) {
+			uint64_t value = buffer[3 + i];
+			if (running != 0 && running < enabled) {
+				value = static_cast<uint64_t>(static_cast<double>(value) * enabled / running);
+			}
+			values.*counters[i].field = value;
+		}
+#endif
+		return values;
+	}
+
+private:
+	static constexpr size_t MAX_COUNTERS = 5;
+
+	struct Counter {
+		int descriptor;
+		uint64_t CounterValues::*field;
+	};
+
+	std::vector<Counter> counters;  // In group order, the leader first
+	int leader = -1;
+	std::string error;
+
+#ifdef __linux__
+	void open(uint32_t type, uint64_t config, uint64_t CounterValues::*field, const char* name) {
+		perf_event_attr attributes;
+		std::memset(&attributes, 0, sizeof(attributes));
+		attributes.size = sizeof(attributes);
+		attributes.type = type;
+		attributes.config = config;
+		attributes.disabled = leader < 0;  // The group starts when complete
+		attributes.exclude_kernel = 1;
+		attributes.exclude_hv = 1;
+		attributes.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		int descriptor = static_cast<int>(syscall(SYS_perf_event_open, &attributes, 0, -1, leader, 0));
+		if (descriptor < 0) {
+			error += (error.empty() ? "" : "; ") + std::string(name) + ": " + std::strerror(errno);
+			return;
+		}
+		if (leader < 0) {
+			leader = descriptor;
+		}
+		counters.push_back({ descriptor, field });
+	}
+#endif
+};
+
+// Hardware counts attributed to the script executions and the compiled
+// functions a VirtualMachine runs. Each function gets its calls, its counts
+// including callees, and its self counts without them; recursion counts a
+// function's inclusive time once per active call. An execution is one
+// outermost run or call.
+class CounterProfile {
+public:
+	struct Entry {
+		size_t calls = 0;
+		CounterValues total;
+		CounterValues self;
+	};
+
+	explicit CounterProfile(const HardwareCounters& counters) : counters(counters) {}
+
+	void enter() {
+		stack.push_back({ counters.read(), CounterValues() });
+	}
+
+	void exit(const std::string& function) {
+		Frame frame = stack.back();
+		stack.pop_back();
+		CounterValues total = counters.read() - frame.start;
+		Entry& entry = functions[function];
+		++entry.calls;
+		entry.total += total;
+		entry.self += total - frame.children;
+		if (stack.empty()) {
+			++executions.calls;
+			executions.total += total;
+			executions.self += total;
+		}
+		else {
+			stack.back().children += total;
+		}
+	}
+
+	const Entry& getExecutions() const {
+		return executions;
+	}
+
+	const std::map<std::string, Entry>& getFunctions() const {
+		return functions;
+	}
+
+	std::string report() const {
+		std::ostringstream out;
+		out << "Counters: " << executions.calls << " executions\n";
+		if (!counters.isAvailable()) {
+			out << "  unavailable: " << counters.getError() << "\n";
+			return out.str();
+		}
+		if (!counters.getError().empty()) {
+			out << "  missing " << counters.getError() << "\n";
+		}
+		out << "  executions: " << describe(executions.total) << "\n";
+		std::vector<std::pair<std::string, Entry>> sorted(functions.begin(), functions.end());
+		std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) {
+			return a.second.self.taskClock > b.second.self.taskClock;
+		});
+		for (const auto& [name, entry] : sorted) {
+			out << "  " << name << " (" << entry.calls << " calls) self: " << describe(entry.self) << "\n";
+		}
+		return out.str();
+	}
+
+private:
+	struct Frame {
+		CounterValues start;
+		CounterValues children;
+	};
+
+	const HardwareCounters& counters;
+	std::vector<Frame> stack;
+	std::map<std::string, Entry> functions;
+	Entry executions;
+
+	std::string describe(const CounterValues& values) const {
+		std::ostringstream out;
+		out << values.taskClock / 1000 << " us";
+		if (counters.hasHardwareCounters()) {
+			out << ", " << values.cycles << " cycles, " << values.instructions << " instructions";
+			if (values.cycles != 0) {
+				out << " (IPC " << static_cast<double>(values.instructions) / values.cycles << ")";
+			}
+			out << ", " << values.branchMisses << " branch misses, " << values.cacheMisses << " cache misses";
+		}
+		return out.str();
+	}
+};
@@ -0,0 +1,383 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "AST.hpp"
+
+// Mid-level SSA representation used by the optimizer. Every instruction defines
+// one value, identified by its index in IRFunction::values; blocks list their
+// instructions in order, phis first, and end in a terminator.
+using IRValueId = uint32_t;
+using IRBlockId = uint32_t;
+constexpr uint32_t IR_NONE = UINT32_MAX;
+
+enum class IROp : uint8_t {
+	CONSTANT,
+	PARAMETER,       // name: parameter index
+	PHI,             // operands parallel to the block's predecessors
+	COPY,
+	ADD, SUBTRACT, MULTIPLY, DIVIDE,
+	EQUALS, NOT_EQUALS, LESS, LESS_EQUALS, GREATER, GREATER_EQUALS,
+	AND, OR, NEGATE, NOT,
+	CHECK_INT,       // Type error unless operand 0 is integral; name: variable
+	DECLARE_VAR,     // Environment variables, resolved in the current frame, then globals
+	LOAD_VAR,
+	STORE_VAR,
+	LOAD_GLOBAL,     // Environment globals only, for functions without a frame
+	STORE_GLOBAL,
+	CALL,            // name: callee index in the module
+	CALL_NATIVE,     // name: function name, called through Environment::evaluateFunction
+	STATEMENT,       // name: source offset of a statement about to run, for ExecutionHooks;
+	                 // constant: 1 + the arm it takes when it is an if or loop branch
+	COVER,           // name: coverage slot to mark
+	JUMP,            // successors[0]
+	BRANCH,          // successors[0] if operand 0 is non-zero, else successors[1]
+	RETURN
+};
+
+inline const char* irOpName(IROp op) {
+	static const char* const names[] = {
+		"const", "param", "phi", "copy",
+		"add", "sub", "mul", "div",
+		"eq", "ne", "lt", "le", "gt", "ge",
+		"and", "or", "neg", "not",
+		"checkint", "declare", "load", "store", "loadglobal", "storeglobal",
+		"call", "callnative", "stmt", "cover", "jump", "branch", "return"
+	};
+	return names[static_cast<size_t>(op)];
+}
+
+inline bool isTerminator(IROp op) {
+	return op == IROp::JUMP || op == IROp::BRANCH || op == IROp::RETURN;
+}
+
+inline bool isBinary(IROp op) {
+	return op >= IROp::ADD && op <= IROp::OR;
+}
+
+inline bool isCommutative(IROp op) {
+	return op == IROp::ADD || op == IROp::MULTIPLY || op == IROp::EQUALS || op == IROp::NOT_EQUALS
+		|| op == IROp::AND || op == IROp::OR;
+}
+
+// Instructions that can be removed when their value is unused. DIVIDE and
+// CHECK_INT may throw and are only pure once their operands are known.
+inline bool isPure(IROp op) {
+	return op == IROp::CONSTANT || op == IROp::PARAMETER || op == IROp::PHI || op == IROp::COPY
+		|| (isBinary(op) && op != IROp::DIVIDE) || op == IROp::NEGATE || op == IROp::NOT;
+}
+
+inline bool hasResult(IROp op) {
+	return !(op == IROp::CHECK_INT || op == IROp::DECLARE_VAR || op == IROp::STORE_VAR
+		|| op == IROp::STORE_GLOBAL || op == IROp::STATEMENT || op == IROp::COVER || isTerminator(op));
+}
+
+inline IROp irBinaryOp(TokenType token) {
+	switch (token) {
+	case TokenType::PLUS: return IROp::ADD;
+	case TokenType::MINUS: return IROp::SUBTRACT;
+	case TokenType::MULTIPLY: return IROp::MULTIPLY;
+	case TokenType::DIVIDE: return IROp::DIVIDE;
+	case TokenType::AND: return IROp::AND;
+	case TokenType::OR: return IROp::OR;
+	case TokenType::EQUALS: return IROp::EQUALS;
+	case TokenType::NOT_EQUALS: return IROp::NOT_EQUALS;
+	case TokenType::LESS: return IROp::LESS;
+	case TokenType::LESS_EQUALS: return IROp::LESS_EQUALS;
+	case TokenType::GREATER: return IROp::GREATER;
+	case TokenType::GREATER_EQUALS: return IROp::GREATER_EQUALS;
+	default: throw std::runtime_error("Unknown binary operator");
+	}
+}
+
+// Evaluate an arithmetic instruction on constants; false when it would throw
+inline bool foldConstant(IROp op, double left, double right, double& result) {
+	switch (op) {
+	case IROp::ADD: result = left + right; return true;
+	case IROp::SUBTRACT: result = left - right; return true;
+	case IROp::MULTIPLY: result = left * right; return true;
+	case IROp::DIVIDE:
+		if (right == 0) {
+			return false;
+		}
+		result = left / right;
+		return true;
+	case IROp::AND: result = (left != 0 && right != 0) ? 1 : 0; return true;
+	case IROp::OR: result = (left != 0 || right != 0) ? 1 : 0; return true;
+	case IROp::EQUALS: result = (left == right) ? 1 : 0; return true;
+	case IROp::NOT_EQUALS: result = (left != right) ? 1 : 0; return true;
+	case IROp::LESS: result = (left < right) ? 1 : 0; return true;
+	case IROp::LESS_EQUALS: result = (left <= right) ? 1 : 0; return true;
+	case IROp::GREATER: result = (left > right) ? 1 : 0; return true;
+	case IROp::GREATER_EQUALS: result = (left >= right) ? 1 : 0; return true;
+	case IROp::NEGATE: result = -left; return true;
+	case IROp::NOT: result = (left == 0) ? 1 : 0; return true;
+	default: return false;
+	}
+}
+
+struct IRInstruction {
+	IROp op;
+	ValueType type = ValueType::FLOAT;  // DECLARE_VAR
+	bool removed = false;
+	IRBlockId block = IR_NONE;
+	uint32_t name = IR_NONE;
+	double constant = 0;
+	std::vector<IRValueId> operands = {};
+};
+
+struct IRBlock {
+	std::vector<IRValueId> instructions;
+	std::vector<IRBlockId> predecessors;
+	std::vector<IRBlockId> successors;
+	bool removed = false;
+};
+
+struct IRFunction {
+	std::string name;
+	std::vector<std::pair<std::string, ValueType>> parameters;
+	bool usesFrame = false;  // Locals live in an Environment call frame
+	bool memoized = false;   // Results are cached by the Environment
+	size_t sourceOffset = 0;
+	std::vector<IRInstruction> values;
+	std::vector<IRBlock> blocks;
+
+	IRBlockId addBlock() {
+		blocks.emplace_back();
+		return static_cast<IRBlockId>(blocks.size() - 1);
+	}
+
+	IRValueId append(IRBlockId block, IRInstruction instruction) {
+		instruction.block = block;
+		values.push_back(std::move(instruction));
+		IRValueId id = static_cast<IRValueId>(values.size() - 1);
+		blocks[block].instructions.push_back(id);
+		return id;
+	}
+
+	// Phis go before every other instruction of their block
+	IRValueId prependPhi(IRBlockId block) {
+		IRInstruction phi{ IROp::PHI };
+		phi.block = block;
+		values.push_back(phi);
+		IRValueId id = static_cast<IRValueId>(values.size() - 1);
+		std::vector<IRValueId>& list = blocks[block].instructions;
+		auto position = std::find_if(list.begin(), list.end(),
+			[&](IRValueId value) { return values[value].op != IROp::PHI; });
+		list.insert(position, id);
+		return id;
+	}
+
+	void addEdge(IRBlockId from, IRBlockId to) {
+		blocks[from].successors.push_back(to);
+		blocks[to].predecessors.push_back(from);
+	}
+
+	// Drop the edge and the matching phi operands in `to`
+	void removeEdge(IRBlockId from, IRBlockId to) {
+		std::vector<IRBlockId>& successors = blocks[from].successors;
+		successors.erase(std::find(successors.begin(), successors.end(), to));
+
+		std::vector<IRBlockId>& predecessors = blocks[to].predecessors;
+		size_t index = std::find(predecessors.begin(), predecessors.end(), from) - predecessors.begin();
+		predecessors.erase(predecessors.begin() + index);
+		for (IRValueId value : blocks[to].instructions) {
+			if (values[value].op == IROp::PHI) {
+				values[value].operands.erase(values[value].operands.begin() + index);
+			}
+		}
+	}
+
+	const IRInstruction& terminator(IRBlockId block) const {
+		return values[blocks[block].instructions.back()];
+	}
+
+	IRInstruction& terminator(IRBlockId block) {
+		return values[blocks[block].instructions.back()];
+	}
+
+	// Reachable blocks, entry first
+	std::vector<IRBlockId> reversePostorder() const {
+		std::vector<IRBlockId> order;
+		std::vector<uint8_t> state(blocks.size(), 0);
+		std::vector<std::pair<IRBlockId, size_t>> stack{ { 0, 0 } };
+		state[0] = 1;
+		while (!stack.empty()) {
+			auto& [block, next] = stack.back();
+			if (next < blocks[block].successors.size()) {
+				IRBlockId successor = blocks[block].successors[next++];
+				if (!state[successor]) {
+					state[successor] = 1;
+					stack.push_back({ successor, 0 });
+				}
+			}
+			else {
+				order.push_back(block);
+				stack.pop_back();
+			}
+		}
+		std::reverse(order.begin(), order.end());
+		return order;
+	}
+
+	// Immediate dominators (Cooper, Harvey and Kennedy); IR_NONE for unreachable blocks
+	std::vector<IRBlockId> immediateDominators() const {
+		std::vector<IRBlockId> order = reversePostorder();
+		std::vector<uint32_t> rank(blocks.size(), IR_NONE);
+		for (size_t i = 0; i < order.size(); ++i) {
+			rank[order[i]] = static_cast<uint32_t>(i);
+		}
+
+		std::vector<IRBlockId> dominator(blocks.size(), IR_NONE);
+		dominator[0] = 0;
+		for (bool changed = true; changed;) {
+			changed = false;
+			for (size_t i = 1; i < order.size(); ++i) {
+				IRBlockId block = order[i];
+				IRBlockId candidate = IR_NONE;
+				for (IRBlockId predecessor : blocks[block].predecessors) {
+					if (dominator[predecessor] == IR_NONE) {
+						continue;
+					}
+					if (candidate == IR_NONE) {
+						candidate = predecessor;
+						continue;
+					}
+					IRBlockId other = predecessor;
+					while (candidate != other) {
+						while (rank[candidate] > rank[other]) {
+							candidate = dominator[candidate];
+						}
+						while (rank[other] > rank[candidate]) {
+							other = dominator[other];
+						}
+					}
+				}
+				if (dominator[block] != candidate) {
+					dominator[block] = candidate;
+					changed = true;
+				}
+			}
+		}
+		return dominator;
+	}
+
+	// Drop removed instructions from the block lists
+	void compact() {
+		for (IRBlock& block : blocks) {
+			block.instructions.erase(std::remove_if(block.instructions.begin(), block.instructions.end(),
+				[&](IRValueId value) { return values[value].removed; }), block.instructions.end());
+		}
+	}
+
+	size_t instructionCount() const {
+		size_t count = 0;
+		for (const IRBlock& block : blocks) {
+			if (!block.removed) {
+				count += block.instructions.size();
+			}
+		}
+		return count;
+	}
+};
+
+struct IRModule {
+	std::vector<std::string> names;
+	std::vector<IRFunction> functions;  // functions[0] is the top-level code
+
+	uint32_t internName(const std::string& name) {
+		auto found = std::find(names.begin(), names.end(), name);
+		if (found != names.end()) {
+			return static_cast<uint32_t>(found - names.begin());
+		}
+		names.push_back(name);
+		return static_cast<uint32_t>(names.size() - 1);
+	}
+
+	// Textual form for debugging, e.g. "%3 = add %1, %2"
+	std::string dump() const {
+		std::ostringstream out;
+		for (const IRFunction& function : functions) {
+			out << "function " << function.name << "(";
+			for (size_t i = 0; i < function.parameters.size(); ++i) {
+				out << (i ? ", " : "") << function.parameters[i].first;
+			}
+			out << ")" << (function.usesFrame ? " frame" : "") << "\n";
+
+			for (IRBlockId block : function.reversePostorder()) {
+				out << "block" << block << ":";
+				if (!function.blocks[block].predecessors.empty()) {
+					out << "  ; preds";
+					for (IRBlockId predecessor : function.blocks[block].predecessors) {
+						out << " block" << predecessor;
+					}
+				}
+				out << "\n";
+				for (IRValueId value : function.blocks[block].instructions) {
+					dumpInstruction(out, function, value);
+				}
+			}
+			out << "\n";
+		}
+		return out.str();
+	}
+
+private:
+	void dumpInstruction(std::ostringstream& out, const IRFunction& function, IRValueId value) const {
+		const IRInstruction& instruction = function.values[value];
+		out << "  ";
+		if (hasResult(instruction.op)) {
+			out << "%" << value << " = ";
+		}
+		out << irOpName(instruction.op);
+
+		const char* separator = " ";
+		auto item = [&](const std::string& text) {
+			out << separator << text;
+			separator = ", ";
+		};
+
+		switch (instruction.op) {
+		case IROp::CONSTANT: {
+			std::ostringstream number;
+			number.precision(17);
+			number << instruction.constant;
+			item(number.str());
+			break;
+		}
+		case IROp::PARAMETER: case IROp::COVER: item(std::to_string(instruction.name)); break;
+		case IROp::STATEMENT:
+			item(std::to_string(instruction.name));
+			if (instruction.constant != 0) {
+				item("arm " + std::to_string(static_cast<int>(instruction.constant) - 1));
+			}
+			break;
+		case IROp::CALL: item(functions[instruction.name].name); break;
+		case IROp::JUMP: case IROp::BRANCH: case IROp::PHI: break;
+		default:
+			if (instruction.name != IR_NONE) {
+				item(names[instruction.name]);
+			}
+			break;
+		}
+
+		const IRBlock& block = function.blocks[instruction.block];
+		for (size_t i = 0; i < instruction.operands.size(); ++i) {
+			std::string operand = "%" + std::to_string(instruction.operands[i]);
+			if (instruction.op == IROp::PHI) {
+				operand = "[" + operand + ", block" + std::to_string(block.predecessors[i]) + "]";
+			}
+			item(operand);
+		}
+		if (instruction.op == IROp::JUMP || instruction.op == IROp::BRANCH) {
+			for (IRBlockId successor : block.successors) {
+				item("block" + std::to_string(successor));
+			}
+		}
+		out << "\n";
+	}
+};
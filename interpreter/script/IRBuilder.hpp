@@ -0,0 +1,547 @@
+#pragma once
+
+#include <cstring>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "ASTAnalysis.hpp"
+#include "Coverage.hpp"
+#include "IR.hpp"
+
+// Builds SSA form from the AST, following Braun et al., "Simple and Efficient
+// Construction of Static Single Assignment Form": locals are read through
+// on-demand phis, and loops and branches become basic blocks.
+//
+// Top-level variables stay in the Environment. Function locals become SSA
+// values when every declaration runs at most once per call and dominates its
+// uses; otherwise the function keeps an Environment frame like the tree walker.
+//
+// Globals bound to constants are read as those constants wherever no local
+// of the same name can shadow them. The script may not declare or assign them.
+//
+// With statement markers, every statement the tree walker reports to
+// ExecutionHooks starts with a STATEMENT instruction holding its offset, and
+// the arms of ifs and loops with one holding the arm. With coverage, the same
+// places mark their coverage slots with COVER instructions.
+class IRBuilder {
+public:
+	explicit IRBuilder(std::map<std::string, double> boundGlobals = {}, bool statementMarkers = false,
+		const ProgramCoverage* coverage = nullptr)
+		: boundGlobals(std::move(boundGlobals)), statementMarkers(statementMarkers), coverage(coverage) {}
+
+	IRModule build(const ASTNode* root) {
+		module = IRModule();
+		functionIndices.clear();
+
+		std::vector<const FunctionNode*> definitions;
+		collectFunctions(root, definitions);
+		module.functions.resize(definitions.size() + 1);
+		module.functions[0].name = "<main>";
+		for (size_t i = 0; i < definitions.size(); ++i) {
+			module.functions[i + 1].name = definitions[i]->name;
+			module.functions[i + 1].parameters = definitions[i]->parameters;
+			module.functions[i + 1].memoized = definitions[i]->memoized;
+			module.functions[i + 1].sourceOffset = definitions[i]->getSourceOffset();
+			functionIndices[definitions[i]->name] = static_cast<uint32_t>(i + 1);
+		}
+
+		buildTopLevel(root);
+		for (size_t i = 0; i < definitions.size(); ++i) {
+			buildFunction(i + 1, definitions[i]);
+		}
+		return std::move(module);
+	}
+
+	// A module whose main function resumes a while, for or do-while loop at its
+	// body, with the condition already found true, and returns the loop value.
+	// Variables stay in the Environment, so the loop continues on the frame the
+	// tree walker ran it in. Calls go through the Environment.
+	//
+	// `cached` variables, which must exist and which nothing but the loop may
+	// change while it runs, are loaded once on entry and then read as SSA
+	// values; assignments still store them right away.
+	IRModule buildLoopEntry(const ASTNode* loop, const std::set<std::string>& cached = {}) {
+		module = IRModule();
+		functionIndices.clear();
+		module.functions.resize(1);
+		module.functions[0].name = "<loop>";
+		beginFunction(0);
+		environmentVariables = true;
+		collectShadowed(loop);
+		for (const std::string& name : cached) {
+			if (!boundValue(name)) {
+				cachedVariables.insert(name);
+				writeVariable(name, current, emit(IROp::LOAD_VAR, {}, module.internName(name)));
+			}
+		}
+
+		IRValueId value;
+		if (auto node = dynamic_cast<const WhileNode*>(loop)) {
+			value = doWhileStatement(node, node->body, node->condition, nullptr);
+		}
+		else if (auto node = dynamic_cast<const ForNode*>(loop)) {
+			value = doWhileStatement(node, node->body, node->condition, node->update);
+		}
+		else if (auto node = dynamic_cast<const DoWhileNode*>(loop)) {
+			value = doWhileStatement(node, node->body, node->condition, nullptr);
+		}
+		else {
+			throw std::runtime_error("Not a loop");
+		}
+		IRInstruction ret{ IROp::RETURN };
+		ret.operands = { value };
+		function->append(current, ret);
+		return std::move(module);
+	}
+
+private:
+	const std::string RESULT = "%result";  // Pseudo-variable holding the last statement value
+
+	IRModule module;
+	std::map<std::string, uint32_t> functionIndices;
+	std::map<std::string, double> boundGlobals;
+	bool statementMarkers;
+	const ProgramCoverage* coverage;
+
+	// State of the function being built
+	IRFunction* function = nullptr;
+	IRBlockId current = 0;
+	bool environmentVariables = true;  // Variables go through the Environment by name
+	std::unordered_map<std::string, ValueType> locals;
+	std::unordered_set<std::string> shadowed;  // Bound globals that may be locals here
+	std::unordered_set<std::string> cachedVariables;  // Environment variables read as SSA values
+	std::vector<std::unordered_map<std::string, IRValueId>> definitions;
+	std::vector<std::vector<std::pair<std::string, IRValueId>>> incompletePhis;
+	std::vector<bool> sealed;
+	std::unordered_map<uint64_t, IRValueId> constants;
+
+	void collectFunctions(const ASTNode* node, std::vector<const FunctionNode*>& found) {
+		if (auto definition = dynamic_cast<const FunctionNode*>(node)) {
+			if (!definition->body) {
+				throw std::runtime_error("Function body not parsed: " + definition->name);
+			}
+			found.push_back(definition);
+		}
+		else if (auto program = dynamic_cast<const ProgramNode*>(node)) {
+			for (const ASTNode* statement : program->statements) {
+				collectFunctions(statement, found);
+			}
+		}
+		else if (auto block = dynamic_cast<const BlockNode*>(node)) {
+			for (const ASTNode* statement : block->statements) {
+				collectFunctions(statement, found);
+			}
+		}
+	}
+
+	void beginFunction(size_t index) {
+		function = &module.functions[index];
+		definitions.clear();
+		incompletePhis.clear();
+		sealed.clear();
+		constants.clear();
+		locals.clear();
+		shadowed.clear();
+		cachedVariables.clear();
+		current = newBlock();
+		seal(current);
+	}
+
+	void buildTopLevel(const ASTNode* root) {
+		beginFunction(0);
+		environmentVariables = true;
+		statement(root);
+		IRInstruction ret{ IROp::RETURN };
+		ret.operands = { constant(0) };
+		function->append(current, ret);
+	}
+
+	void buildFunction(size_t index, const FunctionNode* definition) {
+		beginFunction(index);
+		LocalAnalysis analysis(definition);
+		environmentVariables = !analysis.isStatic();
+		function->usesFrame = environmentVariables;
+		if (!environmentVariables) {
+			locals = analysis.getLocals();
+		}
+		for (const auto& parameter : definition->parameters) {
+			if (boundGlobals.count(parameter.first)) {
+				shadowed.insert(parameter.first);
+			}
+		}
+		collectShadowed(definition->body);
+
+		for (size_t i = 0; i < definition->parameters.size(); ++i) {
+			const std::string& name = definition->parameters[i].first;
+			ValueType type = definition->parameters[i].second;
+			IRInstruction parameter{ IROp::PARAMETER };
+			parameter.name = static_cast<uint32_t>(i);
+			IRValueId value = function->append(current, parameter);
+			if (environmentVariables) {
+				IRInstruction declare{ IROp::DECLARE_VAR };
+				declare.name = module.internName(name);
+				declare.type = type;
+				function->append(current, declare);
+			}
+			assign(name, value);
+		}
+
+		IRInstruction ret{ IROp::RETURN };
+		ret.operands = { statement(definition->body) };
+		function->append(current, ret);
+	}
+
+	void collectShadowed(const ASTNode* node) {
+		auto declaration = dynamic_cast<const DeclarationNode*>(node);
+		if (declaration && boundGlobals.count(declaration->variableName)) {
+			shadowed.insert(declaration->variableName);
+		}
+		forEachChild(node, [&](const ASTNode* child) { collectShadowed(child); });
+	}
+
+	// --- SSA construction ---
+
+	IRBlockId newBlock() {
+		IRBlockId block = function->addBlock();
+		definitions.emplace_back();
+		incompletePhis.emplace_back();
+		sealed.push_back(false);
+		return block;
+	}
+
+	void jump(IRBlockId target) {
+		function->append(current, IRInstruction{ IROp::JUMP });
+		function->addEdge(current, target);
+	}
+
+	void branch(IRValueId condition, IRBlockId ifTrue, IRBlockId ifFalse) {
+		IRInstruction instruction{ IROp::BRANCH };
+		instruction.operands = { condition };
+		function->append(current, instruction);
+		function->addEdge(current, ifTrue);
+		function->addEdge(current, ifFalse);
+	}
+
+	void writeVariable(const std::string& name, IRBlockId block, IRValueId value) {
+		definitions[block][name] = value;
+	}
+
+	IRValueId readVariable(const std::string& name, IRBlockId block) {
+		auto found = definitions[block].find(name);
+		if (found != definitions[block].end()) {
+			return found->second;
+		}
+
+		IRValueId value;
+		const std::vector<IRBlockId>& predecessors = function->blocks[block].predecessors;
+		if (!sealed[block]) {
+			value = function->prependPhi(block);
+			incompletePhis[block].push_back({ name, value });
+		}
+		else if (predecessors.size() == 1) {
+			value = readVariable(name, predecessors[0]);
+		}
+		else if (predecessors.empty()) {
+			value = constant(0);  // Only reachable for variables that are never written
+		}
+		else {
+			value = function->prependPhi(block);
+			writeVariable(name, block, value);
+			addPhiOperands(name, value);
+		}
+		writeVariable(name, block, value);
+		return value;
+	}
+
+	void addPhiOperands(const std::string& name, IRValueId phi) {
+		IRBlockId block = function->values[phi].block;
+		for (size_t i = 0; i < function->blocks[block].predecessors.size(); ++i) {
+			IRValueId operand = readVariable(name, function->blocks[block].predecessors[i]);
+			function->values[phi].operands.push_back(operand);
+		}
+	}
+
+	void seal(IRBlockId block) {
+		for (const auto& [name, phi] : incompletePhis[block]) {
+			addPhiOperands(name, phi);
+		}
+		incompletePhis[block].clear();
+		sealed[block] = true;
+	}
+
+	// Constants live at the top of the entry block so they dominate every use
+	IRValueId constant(double value) {
+		uint64_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		auto found = constants.find(bits);
+		if (found != constants.end()) {
+			return found->second;
+		}
+
+		IRInstruction instruction{ IROp::CONSTANT };
+		instruction.constant = value;
+		instruction.block = 0;
+		function->values.push_back(instruction);
+		IRValueId id = static_cast<IRValueId>(function->values.size() - 1);
+		std::vector<IRValueId>& entry = function->blocks[0].instructions;
+		entry.insert(entry.begin(), id);
+		constants[bits] = id;
+		return id;
+	}
+
+	IRValueId emit(IROp op, std::vector<IRValueId> operands, uint32_t name = IR_NONE) {
+		IRInstruction instruction{ op };
+		instruction.operands = std::move(operands);
+		instruction.name = name;
+		return function->append(current, instruction);
+	}
+
+	// --- Variables ---
+
+	bool isLocal(const std::string& name) const {
+		return !environmentVariables && locals.count(name);
+	}
+
+	// The constant a read of `name` is bound to, if any
+	const double* boundValue(const std::string& name) const {
+		auto bound = boundGlobals.find(name);
+		return bound != boundGlobals.end() && !shadowed.count(name) ? &bound->second : nullptr;
+	}
+
+	void assign(const std::string& name, IRValueId value) {
+		if (boundValue(name)) {
+			throw std::runtime_error("Cannot bind global " + name + ": the script assigns it");
+		}
+		if (environmentVariables) {
+			emit(IROp::STORE_VAR, { value }, module.internName(name));
+			if (cachedVariables.count(name)) {
+				writeVariable(name, current, value);
+			}
+		}
+		else if (isLocal(name)) {
+			if (locals.at(name) == ValueType::INT) {
+				emit(IROp::CHECK_INT, { value }, module.internName(name));
+			}
+			writeVariable(name, current, value);
+		}
+		else {
+			emit(IROp::STORE_GLOBAL, { value }, module.internName(name));
+		}
+	}
+
+	IRValueId load(const std::string& name) {
+		if (const double* bound = boundValue(name)) {
+			return constant(*bound);
+		}
+		if (cachedVariables.count(name)) {
+			return readVariable(name, current);
+		}
+		if (environmentVariables) {
+			return emit(IROp::LOAD_VAR, {}, module.internName(name));
+		}
+		if (isLocal(name)) {
+			return readVariable(name, current);
+		}
+		return emit(IROp::LOAD_GLOBAL, {}, module.internName(name));
+	}
+
+	// --- Statements and expressions ---
+
+	// Lower a statement and return its value, as ASTNode::evaluate would.
+	// Parts of statements, like the update of a for loop, are no boundary.
+	IRValueId statement(const ASTNode* node, bool boundary = true) {
+		if (boundary && !dynamic_cast<const ProgramNode*>(node) && !dynamic_cast<const BlockNode*>(node)) {
+			mark(node, CoveragePoint::STATEMENT);
+		}
+		if (auto program = dynamic_cast<const ProgramNode*>(node)) {
+			for (const ASTNode* child : program->statements) {
+				statement(child);
+			}
+			return constant(0);
+		}
+		if (auto block = dynamic_cast<const BlockNode*>(node)) {
+			for (const ASTNode* child : block->statements) {
+				statement(child);
+			}
+			return constant(0);
+		}
+		if (auto declaration = dynamic_cast<const DeclarationNode*>(node)) {
+			if (boundValue(declaration->variableName)) {
+				throw std::runtime_error("Cannot bind global " + declaration->variableName + ": the script declares it");
+			}
+			if (environmentVariables) {
+				IRInstruction declare{ IROp::DECLARE_VAR };
+				declare.name = module.internName(declaration->variableName);
+				declare.type = declaration->type;
+				function->append(current, declare);
+			}
+			else {
+				writeVariable(declaration->variableName, current, constant(0));
+			}
+			if (declaration->initializer) {
+				assign(declaration->variableName, expression(declaration->initializer));
+			}
+			return constant(0);
+		}
+		if (auto assignment = dynamic_cast<const AssignmentNode*>(node)) {
+			IRValueId value = expression(assignment->expression);
+			assign(assignment->variableName, value);
+			return value;
+		}
+		if (auto conditional = dynamic_cast<const IfNode*>(node)) {
+			return ifStatement(conditional);
+		}
+		if (auto loop = dynamic_cast<const WhileNode*>(node)) {
+			return whileStatement(loop, loop->condition, loop->body, nullptr);
+		}
+		if (auto loop = dynamic_cast<const ForNode*>(node)) {
+			if (loop->initializer) {
+				statement(loop->initializer, false);
+			}
+			return whileStatement(loop, loop->condition, loop->body, loop->update);
+		}
+		if (auto loop = dynamic_cast<const DoWhileNode*>(node)) {
+			return doWhileStatement(loop, loop->body, loop->condition, nullptr);
+		}
+		if (auto ret = dynamic_cast<const ReturnNode*>(node)) {
+			return expression(ret->returnValue);
+		}
+		if (dynamic_cast<const FunctionNode*>(node)) {
+			return constant(0);  // Registered while parsing
+		}
+		return expression(node);
+	}
+
+	// Report a statement, or the arm of an if or loop it takes, to the hooks
+	// and the coverage it is compiled for
+	void mark(const ASTNode* node, CoveragePoint point) {
+		if (statementMarkers) {
+			IRInstruction marker{ IROp::STATEMENT };
+			marker.name = static_cast<uint32_t>(node->getSourceOffset());
+			marker.constant = static_cast<double>(point);  // 1 + the arm, 0 for the statement
+			function->append(current, marker);
+		}
+		uint32_t slot = coverage ? coverage->slot(node->getSourceOffset(), point) : ProgramCoverage::NO_SLOT;
+		if (slot != ProgramCoverage::NO_SLOT) {
+			emit(IROp::COVER, {}, slot);
+		}
+	}
+
+	IRValueId ifStatement(const IfNode* node) {
+		IRValueId condition = expression(node->condition);
+		IRBlockId thenBlock = newBlock();
+		IRBlockId elseBlock = newBlock();
+		IRBlockId join = newBlock();
+		branch(condition, thenBlock, elseBlock);
+		seal(thenBlock);
+		seal(elseBlock);
+
+		current = thenBlock;
+		mark(node, CoveragePoint::FIRST_ARM);
+		IRValueId thenValue = statement(node->thenBranch);
+		writeVariable(RESULT, current, thenValue);
+		jump(join);
+
+		current = elseBlock;
+		mark(node, CoveragePoint::SECOND_ARM);
+		IRValueId elseValue = node->elseBranch ? statement(node->elseBranch) : constant(0);
+		writeVariable(RESULT, current, elseValue);
+		jump(join);
+
+		seal(join);
+		current = join;
+		return readVariable(RESULT, join);
+	}
+
+	// While loops, and for loops once their initializer ran
+	IRValueId whileStatement(const ASTNode* loop, const ASTNode* conditionNode, const ASTNode* bodyNode, const ASTNode* update) {
+		writeVariable(RESULT, current, constant(0));
+		IRBlockId header = newBlock();
+		IRBlockId body = newBlock();
+		IRBlockId exit = newBlock();
+		jump(header);
+
+		current = header;
+		branch(expression(conditionNode), body, exit);
+		seal(body);
+
+		current = body;
+		mark(loop, CoveragePoint::FIRST_ARM);
+		IRValueId value = statement(bodyNode);
+		writeVariable(RESULT, current, value);
+		if (update) {
+			statement(update, false);
+		}
+		jump(header);
+		seal(header);
+		seal(exit);
+
+		current = exit;
+		mark(loop, CoveragePoint::SECOND_ARM);
+		return readVariable(RESULT, exit);
+	}
+
+	// Do-while loops, and loops entered at their body
+	IRValueId doWhileStatement(const ASTNode* loop, const ASTNode* bodyNode, const ASTNode* conditionNode, const ASTNode* update) {
+		IRBlockId body = newBlock();
+		IRBlockId exit = newBlock();
+		jump(body);
+
+		current = body;
+		mark(loop, CoveragePoint::FIRST_ARM);
+		IRValueId value = statement(bodyNode);
+		writeVariable(RESULT, current, value);
+		if (update) {
+			statement(update, false);
+		}
+		branch(expression(conditionNode), body, exit);
+		seal(body);
+		seal(exit);
+
+		current = exit;
+		mark(loop, CoveragePoint::SECOND_ARM);
+		return readVariable(RESULT, exit);
+	}
+
+	IRValueId expression(const ASTNode* node) {
+		if (auto number = dynamic_cast<const NumberNode*>(node)) {
+			return constant(number->value);
+		}
+		if (auto variable = dynamic_cast<const VariableNode*>(node)) {
+			return load(variable->name);
+		}
+		if (auto binary = dynamic_cast<const BinaryOpNode*>(node)) {
+			IRValueId left = expression(binary->left);
+			IRValueId right = expression(binary->right);
+			return emit(irBinaryOp(binary->op), { left, right });
+		}
+		if (auto unary = dynamic_cast<const UnaryOpNode*>(node)) {
+			IRValueId operand = expression(unary->operand);
+			switch (unary->op) {
+			case TokenType::MINUS: return emit(IROp::NEGATE, { operand });
+			case TokenType::NOT: return emit(IROp::NOT, { operand });
+			default: throw std::runtime_error("Unknown unary operator");
+			}
+		}
+		if (auto call = dynamic_cast<const FunctionCallNode*>(node)) {
+			std::vector<IRValueId> arguments;
+			for (const ASTNode* argument : call->arguments) {
+				arguments.push_back(expression(argument));
+			}
+			auto callee = functionIndices.find(call->name);
+			if (callee != functionIndices.end()
+				&& module.functions[callee->second].parameters.size() == arguments.size()) {
+				return emit(IROp::CALL, std::move(arguments), callee->second);
+			}
+			// Natives, functions defined elsewhere and arity errors are left to the Environment
+			return emit(IROp::CALL_NATIVE, std::move(arguments), module.internName(call->name));
+		}
+		return statement(node, false);
+	}
+};
@@ -0,0 +1,222 @@
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Parser.hpp"
+
+// Keeps the AST of an edited script in sync with its source text. An edit only
+// re-lexes and re-parses the top-level statements it touches; every other
+// statement subtree is reused as-is. Offsets inside a top-level statement are
+// relative to its start, so an edit before it only moves that start.
+class IncrementalParser {
+public:
+	explicit IncrementalParser(Environment& env) : env(env) {}
+
+	IncrementalParser(const IncrementalParser&) = delete;
+	IncrementalParser& operator=(const IncrementalParser&) = delete;
+
+	~IncrementalParser() {
+		release();
+	}
+
+	// Parse a whole script, discarding any previous tree
+	ProgramNode* parse(const std::string& input) {
+		release();
+		source = input;
+		reparseAll();
+		return program;
+	}
+
+	// Replace `removedLength` characters at `offset` with `insertedText` and
+	// update the tree. Throws if the edited script no longer parses; the next
+	// edit then falls back to a full parse.
+	ProgramNode* edit(size_t offset, size_t removedLength, const std::string& insertedText) {
+		if (offset > source.length() || removedLength > source.length() - offset) {
+			throw std::out_of_range("Edit range outside of source");
+		}
+
+		size_t oldLength = source.length();
+		source.replace(offset, removedLength, insertedText);
+		if (!program) {
+			reparseAll();
+			return program;
+		}
+
+		// Statements touching the edit, inclusive on both ends so that tokens
+		// glued to the edit boundary are re-lexed together with it
+		size_t editEnd = offset + removedLength;
+		size_t first = std::lower_bound(spans.begin(), spans.end(), offset,
+			[](const Span& span, size_t value) { return span.endOffset() < value; }) - spans.begin();
+		size_t last = std::upper_bound(spans.begin(), spans.end(), editEnd,
+			[](size_t value, const Span& span) { return value < span.startOffset(); }) - spans.begin();
+
+		// Keep one statement of left context so a trailing `else` re-attaches to its `if`
+		if (first > 0) {
+			--first;
+		}
+
+		size_t regionStart = first < spans.size() ? std::min(spans[first].startOffset(), offset) : offset;
+		size_t regionEnd = last < spans.size() ? spans[last].startOffset() : oldLength;
+		regionEnd = regionEnd + insertedText.length() - removedLength;
+		size_t delta = insertedText.length() - removedLength;  // Wraps around for deletions
+
+		try {
+			replaceStatements(first, last, regionStart, regionEnd, delta);
+		}
+		catch (const std::exception&) {
+			// The edit changed statement boundaries (e.g. an opened brace); re-parse the rest of the script
+			try {
+				replaceStatements(first, spans.size(), regionStart, source.length(), 0);
+			}
+			catch (const std::exception&) {
+				release();
+				throw;
+			}
+		}
+
+		return program;
+	}
+
+	ProgramNode* getProgram() const {
+		return program;
+	}
+
+	const std::string& getSource() const {
+		return source;
+	}
+
+private:
+	// Source range of a top-level statement, parallel to program->statements.
+	// The statement's nodes keep their offsets relative to `*start`.
+	struct Span {
+		size_t* start;
+		size_t length;
+
+		size_t startOffset() const {
+			return *start;
+		}
+
+		size_t endOffset() const {
+			return *start + length;
+		}
+	};
+
+	Environment& env;
+	std::string source;
+	ProgramNode* program = nullptr;
+	std::vector<Span> spans;
+	// Storage of the span starts: the addresses stay put, and the cells of
+	// re-parsed statements are reused
+	std::deque<size_t> startCells;
+	std::vector<size_t*> freeStarts;
+
+	size_t* acquireStart(size_t offset) {
+		size_t* start = nullptr;
+		if (freeStarts.empty()) {
+			startCells.push_back(0);
+			start = &startCells.back();
+		}
+		else {
+			start = freeStarts.back();
+			freeStarts.pop_back();
+		}
+		*start = offset;
+		return start;
+	}
+
+	void reparseAll() {
+		program = new ProgramNode({});
+		try {
+			replaceStatements(0, 0, 0, source.length(), 0);
+		}
+		catch (const std::exception&) {
+			delete program;
+			program = nullptr;
+			throw;
+		}
+	}
+
+	void release() {
+		if (program) {
+			for (ASTNode* statement : program->statements) {
+				unregisterFunction(statement);
+			}
+			delete program;
+			program = nullptr;
+		}
+		spans.clear();
+		startCells.clear();
+		freeStarts.clear();
+	}
+
+	void unregisterFunction(ASTNode* statement) {
+		if (FunctionNode* function = dynamic_cast<FunctionNode*>(statement)) {
+			env.unregisterUserFunction(function->name);
+		}
+	}
+
+	// Re-parse source[regionStart, regionEnd) into the statements [first, last).
+	// Spans after the region are shifted by `delta`. Leaves the tree untouched on failure.
+	void replaceStatements(size_t first, size_t last, size_t regionStart, size_t regionEnd, size_t delta) {
+		std::vector<ASTNode*>& statements = program->statements;
+		for (size_t i = first; i < last; ++i) {
+			unregisterFunction(statements[i]);
+		}
+
+		std::vector<ASTNode*> parsed;
+		std::vector<Span> parsedSpans;
+		try {
+			Lexer lexer(std::string_view(source).substr(regionStart, regionEnd - regionStart), regionStart);
+			Parser parser(lexer, env);
+			while (!parser.atEnd()) {
+				size_t start = parser.currentOffset();
+				parsed.push_back(parser.parseNextStatement());
+				parsedSpans.push_back({ acquireStart(start), parser.consumedOffset() - start });
+			}
+		}
+		catch (const std::exception&) {
+			for (ASTNode* statement : parsed) {
+				unregisterFunction(statement);
+				delete statement;
+			}
+			for (const Span& span : parsedSpans) {
+				freeStarts.push_back(span.start);
+			}
+			for (size_t i = first; i < last; ++i) {
+				if (FunctionNode* function = dynamic_cast<FunctionNode*>(statements[i])) {
+					env.registerUserFunction(function->name, function);
+				}
+			}
+			throw;
+		}
+
+		for (size_t i = first; i < last; ++i) {
+			delete statements[i];
+			freeStarts.push_back(spans[i].start);
+		}
+		if (delta != 0) {
+			for (size_t i = last; i < spans.size(); ++i) {
+				*spans[i].start += delta;
+			}
+		}
+		for (size_t i = 0; i < parsed.size(); ++i) {
+			anchorSourceOffsets(parsed[i], parsedSpans[i].start);
+		}
+
+		// Most edits keep the statement count; avoid shifting the tail of the tree then
+		if (parsed.size() == last - first) {
+			std::copy(parsed.begin(), parsed.end(), statements.begin() + first);
+			std::copy(parsedSpans.begin(), parsedSpans.end(), spans.begin() + first);
+			return;
+		}
+
+		statements.erase(statements.begin() + first, statements.begin() + last);
+		statements.insert(statements.begin() + first, parsed.begin(), parsed.end());
+		spans.erase(spans.begin() + first, spans.begin() + last);
+		spans.insert(spans.begin() + first, parsedSpans.begin(), parsedSpans.end());
+	}
+};
@@ -1,13 +1,17 @@
 #pragma once
 
+#include <charconv>
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 #include <cctype>
 #include <stdexcept>
 #include <stack>
 
+#include "ChunkReader.hpp"
+
 enum class TokenType {
     IDENTIFIER,
     NUMBER,
@@ -30,20 +34,73 @@ enum class TokenType {
 struct Token {
     TokenType type;
     double numberValue;
-    std::string stringValue;
+    std::string_view stringValue;  // Points into the lexer input; copy it before the next token is read
+    size_t start = 0; // Source offset of the first character
+    size_t end = 0;   // Source offset one past the last character
 
     Token(TokenType type) : type(type), numberValue(0) {}
     Token(TokenType type, double numberValue) : type(type), numberValue(numberValue) {}
-    Token(TokenType type, const std::string& stringValue) : type(type), stringValue(stringValue) {}
+    Token(TokenType type, std::string_view stringValue) : type(type), stringValue(stringValue) {}
 };
 
 // Lexer to tokenize input code
 class Lexer {
 public:
-    explicit Lexer(const std::string& input) : input(input), pos(0) {}
+    explicit Lexer(const std::string& input) : buffer(input), input(buffer), pos(0) {}
+
+    // Copies, like the std::string form; literals would otherwise match both it and std::string_view
+    explicit Lexer(const char* input) : Lexer(std::string(input)) {}
+
+    // Lex caller-owned text (e.g. a mapped file) in place; it must outlive the lexer
+    explicit Lexer(std::string_view input) : input(input), pos(0) {}
+
+    // Lex caller-owned text that starts at offset `base` of a larger source,
+    // so that token offsets are offsets in that source
+    Lexer(std::string_view input, size_t base) : input(input), pos(0), base(base) {}
+
+    Lexer(const Lexer&) = delete;
+    Lexer& operator=(const Lexer&) = delete;
+
+    // Lex text pulled from `reader` chunk by chunk; only the current token and
+    // the unread rest of the last chunk are kept in memory
+    explicit Lexer(ChunkReader& reader, size_t chunkSize = 64 * 1024)
+        : pos(0), reader(&reader), chunkSize(chunkSize) {}
 
     Token getNextToken() {
-        while (pos < input.length()) {
+        Token token = scanToken();
+        token.start = base + tokenStart;
+        token.end = base + pos;
+        return token;
+    }
+
+    // Skip the rest of a `{ ... }` block whose opening brace was just returned,
+    // stopping before the matching `}`. Only comments and brace balance are
+    // inspected; returns the skipped source text, valid until the next token is read.
+    std::string_view skipBlock() {
+        tokenStart = pos;  // Keep the body text while streaming
+        int depth = 0;
+        while (available(0)) {
+            if (skipComment()) {
+                continue;
+            }
+            if (input[pos] == '{') {
+                ++depth;
+            }
+            else if (input[pos] == '}') {
+                if (depth == 0) {
+                    return input.substr(tokenStart, pos - tokenStart);
+                }
+                --depth;
+            }
+            ++pos;
+        }
+        throw std::runtime_error("Unmatched opening symbols found");
+    }
+
+private:
+    Token scanToken() {
+        while (available(0)) {
+            tokenStart = pos;
             char current = input[pos];
 
             // Skip whitespaces
@@ -52,22 +109,7 @@ public:
                 continue;
             }
 
-            // Skip single-line comments (`//`)
-            if (current == '/' && pos + 1 < input.length() && input[pos + 1] == '/') {
-                pos += 2;  // Skip `//`
-                while (pos < input.length() && input[pos] != '\n') {
-                    ++pos;  // Skip until the end of the line
-                }
-                continue;
-            }
-
-            // Skip multi-line comments (`/* ... */`)
-            if (current == '/' && pos + 1 < input.length() && input[pos + 1] == '*') {
-                pos += 2;  // Skip `/*`
-                while (pos + 1 < input.length() && !(input[pos] == '*' && input[pos + 1] == '/')) {
-                    ++pos;  // Skip until closing `*/`
-                }
-                pos += 2;  // Skip `*/`
+            if (skipComment()) {
                 continue;
             }
 
@@ -78,34 +120,35 @@ public:
 
             // Tokenize identifiers and keywords
             if (isalpha(current) || current == '_') {
-                std::string identifier = parseIdentifier();
-                if (keywords.find(identifier) != keywords.end()) {
-                    return Token(keywords[identifier]);
+                std::string_view identifier = parseIdentifier();
+                auto keyword = keywords.find(identifier);
+                if (keyword != keywords.end()) {
+                    return Token(keyword->second);
                 }
                 return Token(TokenType::IDENTIFIER, identifier);
             }
 
             // Handling two-character logical operators `&&` and `||`
-            if (current == '&' && pos + 1 < input.length() && input[pos + 1] == '&') {
+            if (current == '&' && available(1) && input[pos + 1] == '&') {
                 pos += 2;
                 return Token(TokenType::AND);
             }
-            if (current == '|' && pos + 1 < input.length() && input[pos + 1] == '|') {
+            if (current == '|' && available(1) && input[pos + 1] == '|') {
                 pos += 2;
                 return Token(TokenType::OR);
             }
 
             // Handling comparison operators (`==`, `!=`, `<`, `>`, `<=`, `>=`)
-            if (current == '=' && pos + 1 < input.length() && input[pos + 1] == '=') {
+            if (current == '=' && available(1) && input[pos + 1] == '=') {
                 pos += 2;
                 return Token(TokenType::EQUALS);
             }
-            if (current == '!' && pos + 1 < input.length() && input[pos + 1] == '=') {
+            if (current == '!' && available(1) && input[pos + 1] == '=') {
                 pos += 2;
                 return Token(TokenType::NOT_EQUALS);
             }
             if (current == '<') {
-                if (pos + 1 < input.length() && input[pos + 1] == '=') {
+                if (available(1) && input[pos + 1] == '=') {
                     pos += 2;
                     return Token(TokenType::LESS_EQUALS);
                 }
@@ -113,7 +156,7 @@ public:
                 return Token(TokenType::LESS);
             }
             if (current == '>') {
-                if (pos + 1 < input.length() && input[pos + 1] == '=') {
+                if (available(1) && input[pos + 1] == '=') {
                     pos += 2;
                     return Token(TokenType::GREATER_EQUALS);
                 }
@@ -162,16 +205,21 @@ public:
             throw std::runtime_error("Unmatched opening symbols found");
         }
 
+        tokenStart = pos;
         return Token(TokenType::END);
     }
 
-private:
-    std::string input;
+    std::string buffer;  // Owned copy of the source, or the current window when streaming
+    std::string_view input;  // The text being lexed: `buffer` or caller-owned memory
     size_t pos;
+    size_t tokenStart = 0;  // Offset where the token being scanned begins
+    size_t base = 0;  // Source offset of input[0]
+    ChunkReader* reader = nullptr;  // Remaining source when streaming
+    size_t chunkSize = 0;
     std::stack<char> balanceStack;  // Stack for keeping track of parentheses and braces
 
     // List of keywords and their corresponding TokenType
-    std::unordered_map<std::string, TokenType> keywords = {
+    std::unordered_map<std::string_view, TokenType> keywords = {
         {"func", TokenType::FUNC},
         {"return", TokenType::RETURN},
         {"if", TokenType::IF},
@@ -187,19 +235,83 @@ private:
         {"false", TokenType::FALSE}
     };
 
+    // Whether input[pos + ahead] exists, reading further chunks as needed
+    bool available(size_t ahead) {
+        while (pos + ahead >= input.length()) {
+            if (!readChunk()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool readChunk() {
+        if (!reader) {
+            return false;
+        }
+
+        // Text before the current token is no longer needed
+        buffer.erase(0, tokenStart);
+        base += tokenStart;
+        pos -= tokenStart;
+        tokenStart = 0;
+
+        size_t length = buffer.length();
+        buffer.resize(length + chunkSize);
+        size_t count = reader->read(&buffer[length], chunkSize);
+        buffer.resize(length + count);
+        input = buffer;
+        if (count == 0) {
+            reader = nullptr;
+        }
+        return count > 0;
+    }
+
+    // Skip a `//` or `/* ... */` comment starting at pos, if there is one
+    bool skipComment() {
+        if (input[pos] != '/' || !available(1)) {
+            return false;
+        }
+
+        if (input[pos + 1] == '/') {
+            pos += 2;  // Skip `//`
+            while (available(0) && input[pos] != '\n') {
+                ++pos;  // Skip until the end of the line
+            }
+            return true;
+        }
+
+        if (input[pos + 1] == '*') {
+            pos += 2;  // Skip `/*`
+            while (available(1) && !(input[pos] == '*' && input[pos + 1] == '/')) {
+                ++pos;  // Skip until closing `*/`
+            }
+            if (!available(1)) {
+                throw std::runtime_error("Unterminated multi-line comment");
+            }
+            pos += 2;  // Skip `*/`
+            return true;
+        }
+
+        return false;
+    }
+
     double parseNumber() {
-        size_t startPos = pos;
-        while (pos < input.length() && (isdigit(input[pos]) || input[pos] == '.')) {
+        while (available(0) && (isdigit(input[pos]) || input[pos] == '.')) {
             ++pos;
         }
-        return std::stod(input.substr(startPos, pos - startPos));
+        double value = 0;
+        std::from_chars_result result = std::from_chars(input.data() + tokenStart, input.data() + pos, value);
+        if (result.ec != std::errc()) {
+            throw std::runtime_error("Invalid number literal");
+        }
+        return value;
     }
 
-    std::string parseIdentifier() {
-        size_t startPos = pos;
-        while (pos < input.length() && (isalnum(input[pos]) || input[pos] == '_')) {
+    std::string_view parseIdentifier() {
+        while (available(0) && (isalnum(input[pos]) || input[pos] == '_')) {
             ++pos;
         }
-        return input.substr(startPos, pos - startPos);
+        return input.substr(tokenStart, pos - tokenStart);
     }
 };
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "IR.hpp"
+
+// A natural loop in canonical counted form:
+//   header: variable = phi(init, next); condition = variable <compare> bound; branch body, exit
+//   latch:  ...; next = variable + step; [checkint next]; jump header
+// The bound is defined outside the loop, the constant step moves the variable
+// towards it, and next is only used by the phi and its int check, with nothing
+// but pure instructions after it in the latch.
+struct IRCountedLoop {
+	IRBlockId header = IR_NONE;
+	IRBlockId preheader = IR_NONE;  // The predecessor outside the loop
+	IRBlockId latch = IR_NONE;      // Source of the back edge
+	IRBlockId body = IR_NONE;       // Header successor inside the loop
+	IRBlockId exit = IR_NONE;       // Header successor outside the loop
+	std::vector<bool> contains;     // Loop membership by block
+	IRValueId variable = IR_NONE;   // The header phi
+	IRValueId init = IR_NONE;
+	IRValueId next = IR_NONE;
+	IRValueId check = IR_NONE;      // CHECK_INT of next for int variables
+	IRValueId condition = IR_NONE;
+	IRValueId bound = IR_NONE;
+	IROp compare = IROp::LESS;
+	double step = 0;
+};
+
+// `left op right` as `right op' left`
+inline IROp mirrorComparison(IROp op) {
+	switch (op) {
+	case IROp::LESS: return IROp::GREATER;
+	case IROp::LESS_EQUALS: return IROp::GREATER_EQUALS;
+	case IROp::GREATER: return IROp::LESS;
+	case IROp::GREATER_EQUALS: return IROp::LESS_EQUALS;
+	default: return op;
+	}
+}
+
+// Recognizes loops of the form above; while and for loops over a local
+// counter lower to it once the optimizer has run
+inline std::vector<IRCountedLoop> findCountedLoops(const IRFunction& function) {
+	const std::vector<IRInstruction>& values = function.values;
+	std::vector<IRBlockId> dominator = function.immediateDominators();
+	auto dominates = [&](IRBlockId block, IRBlockId other) {
+		while (other != block) {
+			if (other == 0 || dominator[other] == IR_NONE) {
+				return false;
+			}
+			other = dominator[other];
+		}
+		return true;
+	};
+
+	std::vector<uint32_t> uses(values.size(), 0);
+	for (const IRBlock& block : function.blocks) {
+		if (block.removed) {
+			continue;
+		}
+		for (IRValueId value : block.instructions) {
+			for (IRValueId operand : values[value].operands) {
+				uses[operand] += values[value].removed ? 0 : 1;
+			}
+		}
+	}
+
+	std::vector<IRCountedLoop> loops;
+	for (IRBlockId header = 0; header < function.blocks.size(); ++header) {
+		const IRBlock& block = function.blocks[header];
+		if (block.removed || dominator[header] == IR_NONE || block.predecessors.size() != 2) {
+			continue;
+		}
+		size_t latchEdge = dominates(header, block.predecessors[0]) ? 0 : 1;
+		if (!dominates(header, block.predecessors[latchEdge]) || dominates(header, block.predecessors[1 - latchEdge])) {
+			continue;
+		}
+
+		IRCountedLoop loop;
+		loop.header = header;
+		loop.latch = block.predecessors[latchEdge];
+		loop.preheader = block.predecessors[1 - latchEdge];
+		if (function.terminator(loop.latch).op != IROp::JUMP) {
+			continue;
+		}
+
+		// The header holds phis, the comparison and the branch on it
+		const IRInstruction& branch = function.terminator(header);
+		size_t phis = 0;
+		while (values[block.instructions[phis]].op == IROp::PHI) {
+			++phis;
+		}
+		if (branch.op != IROp::BRANCH || block.instructions.size() != phis + 2
+			|| block.instructions[phis] != branch.operands[0] || uses[branch.operands[0]] != 1) {
+			continue;
+		}
+		loop.condition = branch.operands[0];
+		const IRInstruction& condition = values[loop.condition];
+		if (condition.op < IROp::LESS || condition.op > IROp::GREATER_EQUALS) {
+			continue;
+		}
+
+		// Blocks that reach the latch without passing the header
+		loop.contains.assign(function.blocks.size(), false);
+		loop.contains[header] = true;
+		std::vector<IRBlockId> work{ loop.latch };
+		while (!work.empty()) {
+			IRBlockId member = work.back();
+			work.pop_back();
+			if (!loop.contains[member]) {
+				loop.contains[member] = true;
+				work.insert(work.end(), function.blocks[member].predecessors.begin(), function.blocks[member].predecessors.end());
+			}
+		}
+		loop.body = block.successors[0];
+		loop.exit = block.successors[1];
+		if (!loop.contains[loop.body] || loop.contains[loop.exit]) {
+			continue;
+		}
+
+		for (size_t side = 0; side < 2; ++side) {
+			IRValueId candidate = condition.operands[side];
+			IRValueId other = condition.operands[1 - side];
+			if (values[candidate].op == IROp::PHI && values[candidate].block == header && !loop.contains[values[other].block]) {
+				loop.variable = candidate;
+				loop.bound = other;
+				loop.compare = side == 0 ? condition.op : mirrorComparison(condition.op);
+			}
+		}
+		if (loop.variable == IR_NONE) {
+			continue;
+		}
+		loop.init = values[loop.variable].operands[1 - latchEdge];
+		loop.next = values[loop.variable].operands[latchEdge];
+
+		// next = variable + constant, or variable - constant
+		const IRInstruction& next = values[loop.next];
+		if (next.block != loop.latch || (next.op != IROp::ADD && next.op != IROp::SUBTRACT)) {
+			continue;
+		}
+		size_t constantSide = next.operands[0] == loop.variable ? 1 : 0;
+		const IRInstruction& step = values[next.operands[constantSide]];
+		if (next.operands[1 - constantSide] != loop.variable || step.op != IROp::CONSTANT
+			|| (next.op == IROp::SUBTRACT && constantSide == 0)) {
+			continue;
+		}
+		loop.step = next.op == IROp::ADD ? step.constant : -step.constant;
+		bool increasing = loop.compare == IROp::LESS || loop.compare == IROp::LESS_EQUALS;
+		if (!std::isfinite(loop.step) || !(increasing ? loop.step > 0 : loop.step < 0)) {
+			continue;
+		}
+
+		const std::vector<IRValueId>& latch = function.blocks[loop.latch].instructions;
+		size_t position = std::find(latch.begin(), latch.end(), loop.next) - latch.begin();
+		bool valid = true;
+		for (size_t i = position + 1; i + 1 < latch.size() && valid; ++i) {
+			const IRInstruction& instruction = values[latch[i]];
+			if (instruction.op == IROp::CHECK_INT && instruction.operands[0] == loop.next && loop.check == IR_NONE) {
+				loop.check = latch[i];
+				continue;
+			}
+			valid = isPure(instruction.op);
+		}
+		if (!valid || uses[loop.next] != (loop.check == IR_NONE ? 1u : 2u)) {
+			continue;
+		}
+		loops.push_back(std::move(loop));
+	}
+	return loops;
+}
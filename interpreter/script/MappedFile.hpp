@@ -0,0 +1,116 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "Parser.hpp"
+
+// A script file mapped read-only into memory. The lexer reads the mapping in
+// place, so loading costs page faults rather than copies of the source.
+class MappedFile {
+public:
+	explicit MappedFile(const std::string& path) {
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+			FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (file == INVALID_HANDLE_VALUE) {
+			throw std::runtime_error("Cannot open script file: " + path);
+		}
+
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(file, &fileSize)) {
+			CloseHandle(file);
+			throw std::runtime_error("Cannot read script file size: " + path);
+		}
+		size = static_cast<size_t>(fileSize.QuadPart);
+
+		// Empty files cannot be mapped
+		if (size > 0) {
+			mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			data = mapping ? static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+			if (!data) {
+				if (mapping) {
+					CloseHandle(mapping);
+				}
+				CloseHandle(file);
+				throw std::runtime_error("Cannot map script file: " + path);
+			}
+		}
+#else
+		int descriptor = open(path.c_str(), O_RDONLY);
+		if (descriptor < 0) {
+			throw std::runtime_error("Cannot open script file: " + path);
+		}
+
+		struct stat status;
+		if (fstat(descriptor, &status) != 0) {
+			close(descriptor);
+			throw std::runtime_error("Cannot read script file size: " + path);
+		}
+		size = static_cast<size_t>(status.st_size);
+
+		// Empty files cannot be mapped; the mapping stays valid after the descriptor is closed
+		if (size > 0) {
+			void* address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+			if (address == MAP_FAILED) {
+				close(descriptor);
+				throw std::runtime_error("Cannot map script file: " + path);
+			}
+			madvise(address, size, MADV_SEQUENTIAL);
+			data = static_cast<const char*>(address);
+		}
+		close(descriptor);
+#endif
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile() {
+#ifdef _WIN32
+		if (data) {
+			UnmapViewOfFile(data);
+			CloseHandle(mapping);
+		}
+		CloseHandle(file);
+#else
+		if (data) {
+			munmap(const_cast<char*>(data), size);
+		}
+#endif
+	}
+
+	std::string_view getText() const {
+		return std::string_view(data ? data : "", size);
+	}
+
+private:
+	const char* data = nullptr;
+	size_t size = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#endif
+};
+
+// Map a script file and parse it straight from the mapping. The tree copies
+// every name it keeps, so the file is unmapped again before returning.
+inline ASTNode* loadScript(const std::string& path, Environment& env, ParserOptions options = {}) {
+	MappedFile file(path);
+	Lexer lexer(file.getText());
+	Parser parser(lexer, env, options);
+	return parser.parse();
+}
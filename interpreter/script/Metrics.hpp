@@ -0,0 +1,326 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+using MetricLabels = std::vector<std::pair<std::string, std::string>>;
+
+// A metric merged over all threads
+struct MetricSample {
+	enum class Type { COUNTER, HISTOGRAM };
+
+	std::string name;
+	std::string help;
+	MetricLabels labels;
+	Type type;
+	uint64_t value = 0;             // Counters
+	std::vector<double> bounds;     // Histograms: bucket upper bounds
+	std::vector<uint64_t> buckets;  // Per bucket, not cumulative; the last is +Inf
+	double sum = 0;
+
+	uint64_t count() const {
+		uint64_t total = 0;
+		for (uint64_t bucket : buckets) {
+			total += bucket;
+		}
+		return total;
+	}
+};
+
+// Counters and histograms sharded per thread. Each thread writes only its own
+// shard, so recording is a thread-local load and store with no lock and no
+// shared cache line; snapshot() sums the shards. Metrics are registered up
+// front, and handles are cheap to copy and keep. Shards of finished threads
+// stay, so their counts are not lost.
+class MetricsRegistry {
+public:
+	class Counter {
+	public:
+		Counter() = default;
+
+		void add(uint64_t amount = 1) const {
+			if (registry) {
+				std::atomic<uint64_t>& slot = registry->localShard()[index];
+				slot.store(slot.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+			}
+		}
+
+	private:
+		friend class MetricsRegistry;
+		Counter(MetricsRegistry* registry, size_t index) : registry(registry), index(index) {}
+
+		MetricsRegistry* registry = nullptr;
+		size_t index = 0;
+	};
+
+	class Histogram {
+	public:
+		Histogram() = default;
+
+		void observe(double value) const {
+			if (!registry) {
+				return;
+			}
+			std::atomic<uint64_t>* slots = registry->localShard() + index;
+			size_t bucket = 0;
+			while (bucket < bounds->size() && value > (*bounds)[bucket]) {
+				++bucket;
+			}
+			slots[bucket].store(slots[bucket].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+			std::atomic<uint64_t>& sum = slots[bounds->size() + 1];  // A double, by bits
+			double total = fromBits(sum.load(std::memory_order_relaxed)) + value;
+			sum.store(toBits(total), std::memory_order_relaxed);
+		}
+
+	private:
+		friend class MetricsRegistry;
+		Histogram(MetricsRegistry* registry, size_t index, const std::vector<double>* bounds)
+			: registry(registry), index(index), bounds(bounds) {}
+
+		MetricsRegistry* registry = nullptr;
+		size_t index = 0;
+		const std::vector<double>* bounds = nullptr;
+	};
+
+	// Room for `capacity` values per thread: one per counter, and per
+	// histogram one per bucket plus the sum
+	explicit MetricsRegistry(size_t capacity = 4096) : capacity(capacity) {}
+
+	MetricsRegistry(const MetricsRegistry&) = delete;
+	MetricsRegistry& operator=(const MetricsRegistry&) = delete;
+
+	// The counter of a name and labels, registered on first use
+	Counter counter(const std::string& name, const std::string& help, const MetricLabels& labels = {}) {
+		std::lock_guard<std::mutex> lock(mutex);
+		const Definition& definition = define(name, help, labels, MetricSample::Type::COUNTER, {});
+		return Counter(this, definition.index);
+	}
+
+	// The histogram of a name and labels with ascending bucket bounds
+	Histogram histogram(const std::string& name, const std::string& help, std::vector<double> bounds,
+		const MetricLabels& labels = {}) {
+		std::lock_guard<std::mutex> lock(mutex);
+		const Definition& definition = define(name, help, labels, MetricSample::Type::HISTOGRAM, std::move(bounds));
+		return Histogram(this, definition.index, &definition.bounds);
+	}
+
+	// All metrics, summed over the thread shards, in registration order
+	std::vector<MetricSample> snapshot() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		std::vector<MetricSample> samples;
+		for (const std::unique_ptr<Definition>& definition : definitions) {
+			MetricSample sample;
+			sample.name = definition->name;
+			sample.help = definition->help;
+			sample.labels = definition->labels;
+			sample.type = definition->type;
+			sample.bounds = definition->bounds;
+			if (definition->type == MetricSample::Type::COUNTER) {
+				for (const std::unique_ptr<std::atomic<uint64_t>[]>& shard : shards) {
+					sample.value += shard[definition->index].load(std::memory_order_relaxed);
+				}
+			}
+			else {
+				sample.buckets.assign(definition->bounds.size() + 1, 0);
+				for (const std::unique_ptr<std::atomic<uint64_t>[]>& shard : shards) {
+					for (size_t i = 0; i < sample.buckets.size(); ++i) {
+						sample.buckets[i] += shard[definition->index + i].load(std::memory_order_relaxed);
+					}
+					sample.sum += fromBits(shard[definition->index + sample.buckets.size()].load(std::memory_order_relaxed));
+				}
+			}
+			samples.push_back(std::move(sample));
+		}
+		return samples;
+	}
+
+	// The snapshot in the Prometheus text exposition format
+	std::string prometheus() const {
+		std::vector<MetricSample> samples = snapshot();
+		std::map<std::string, std::vector<const MetricSample*>> families;  // Samples of a name go together
+		std::vector<std::string> order;
+		for (const MetricSample& sample : samples) {
+			auto& family = families[sample.name];
+			if (family.empty()) {
+				order.push_back(sample.name);
+			}
+			family.push_back(&sample);
+		}
+
+		std::ostringstream out;
+		out.precision(17);
+		for (const std::string& name : order) {
+			const std::vector<const MetricSample*>& family = families[name];
+			bool counter = family[0]->type == MetricSample::Type::COUNTER;
+			out << "# HELP " << name << " " << family[0]->help << "\n";
+			out << "# TYPE " << name << " " << (counter ? "counter" : "histogram") << "\n";
+			for (const MetricSample* sample : family) {
+				if (counter) {
+					out << name << labelText(sample->labels) << " " << sample->value << "\n";
+					continue;
+				}
+				uint64_t cumulative = 0;
+				for (size_t i = 0; i < sample->buckets.size(); ++i) {
+					cumulative += sample->buckets[i];
+					std::ostringstream bound;
+					bound.precision(17);
+					if (i < sample->bounds.size()) {
+						bound << sample->bounds[i];
+					}
+					else {
+						bound << "+Inf";
+					}
+					MetricLabels labels = sample->labels;
+					labels.emplace_back("le", bound.str());
+					out << name << "_bucket" << labelText(labels) << " " << cumulative << "\n";
+				}
+				out << name << "_sum" << labelText(sample->labels) << " " << sample->sum << "\n";
+				out << name << "_count" << labelText(sample->labels) << " " << cumulative << "\n";
+			}
+		}
+		return out.str();
+	}
+
+	void writePrometheus(const std::string& path) const {
+		std::ofstream file(path);
+		if (!file) {
+			throw std::runtime_error("Cannot write metrics file: " + path);
+		}
+		file << prometheus();
+	}
+
+private:
+	struct Definition {
+		std::string name;
+		std::string help;
+		MetricLabels labels;
+		MetricSample::Type type;
+		std::vector<double> bounds;
+		size_t index;  // First slot
+	};
+
+	size_t capacity;
+	size_t used = 0;
+	const uint64_t id = nextId()++;
+	std::vector<std::unique_ptr<Definition>> definitions;  // Stable, handles point at the bounds
+	std::map<std::pair<std::string, MetricLabels>, Definition*> byKey;
+	std::vector<std::unique_ptr<std::atomic<uint64_t>[]>> shards;
+	mutable std::mutex mutex;
+
+	static std::atomic<uint64_t>& nextId() {
+		static std::atomic<uint64_t> id{ 0 };
+		return id;
+	}
+
+	static uint64_t toBits(double value) {
+		uint64_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		return bits;
+	}
+
+	static double fromBits(uint64_t bits) {
+		double value;
+		std::memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+
+	const Definition& define(const std::string& name, const std::string& help, const MetricLabels& labels,
+		MetricSample::Type type, std::vector<double> bounds) {
+		auto found = byKey.find({ name, labels });
+		if (found != byKey.end()) {
+			if (found->second->type != type || (type == MetricSample::Type::HISTOGRAM && found->second->bounds != bounds)) {
+				throw std::runtime_error("Metric registered twice with different types: " + name);
+			}
+			return *found->second;
+		}
+		size_t slots = type == MetricSample::Type::COUNTER ? 1 : bounds.size() + 2;
+		if (used + slots > capacity) {
+			throw std::runtime_error("Metrics registry full");
+		}
+		definitions.push_back(std::make_unique<Definition>(Definition{ name, help, labels, type, std::move(bounds), used }));
+		used += slots;
+		byKey[{ name, labels }] = definitions.back().get();
+		return *definitions.back();
+	}
+
+	// This thread's shard, made on its first write. Registry ids are never
+	// reused, so a cached shard of a destroyed registry is never looked up.
+	std::atomic<uint64_t>* localShard() {
+		thread_local std::vector<std::atomic<uint64_t>*> cache;  // By registry id
+		if (id < cache.size() && cache[id]) {
+			return cache[id];
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		shards.emplace_back(new std::atomic<uint64_t>[capacity]());
+		if (cache.size() <= id) {
+			cache.resize(id + 1, nullptr);
+		}
+		cache[id] = shards.back().get();
+		return cache[id];
+	}
+
+	static std::string labelText(const MetricLabels& labels) {
+		if (labels.empty()) {
+			return "";
+		}
+		std::string text = "{";
+		for (size_t i = 0; i < labels.size(); ++i) {
+			text += (i ? "," : "") + labels[i].first + "=\"";
+			for (char c : labels[i].second) {
+				if (c == '\\' || c == '"') {
+					text += '\\';
+					text += c;
+				}
+				else if (c == '\n') {
+					text += "\\n";
+				}
+				else {
+					text += c;
+				}
+			}
+			text += "\"";
+		}
+		return text + "}";
+	}
+};
+
+// The metrics the engine records when given a registry: script executions
+// and their latency, native calls by function, compilations and their time,
+// and register stack growth of the VM
+struct EngineMetrics {
+	explicit EngineMetrics(MetricsRegistry& registry)
+		: registry(registry),
+		executions(registry.counter("vf_executions_total", "Outermost VM runs and calls")),
+		executionSeconds(registry.histogram("vf_execution_seconds", "Latency of outermost VM runs and calls", latencyBounds())),
+		compilations(registry.counter("vf_compilations_total", "Programs compiled to bytecode")),
+		compileSeconds(registry.histogram("vf_compile_seconds", "Time to compile a program to bytecode", latencyBounds())),
+		stackBytes(registry.counter("vf_vm_stack_growth_bytes_total", "Bytes allocated growing VM register stacks")) {}
+
+	MetricsRegistry& registry;
+	MetricsRegistry::Counter executions;
+	MetricsRegistry::Histogram executionSeconds;
+	MetricsRegistry::Counter compilations;
+	MetricsRegistry::Histogram compileSeconds;
+	MetricsRegistry::Counter stackBytes;
+
+	// Registers the counter on first use; keep the handle rather than calling this per call
+	MetricsRegistry::Counter nativeCalls(const std::string& function) {
+		return registry.counter("vf_native_calls_total", "Calls to native functions", { { "function", function } });
+	}
+
+	static std::vector<double> latencyBounds() {
+		return { 1e-6, 1e-5, 1e-4, 1e-3, 1e-2, 0.1, 1, 10 };
+	}
+};
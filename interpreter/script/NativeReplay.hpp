@@ -0,0 +1,303 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "AST.hpp"
+
+// Records what native functions return during a run, and replays those
+// results later without calling the host, for reproducible benchmarks of real
+// scripts away from the services their natives talk to.
+//
+// Natives are registered through the log, which wraps them. Impure calls
+// replay in the order they were recorded, and a call whose name or arguments
+// differ from the recording throws; so do exceptions the native threw. Pure
+// natives replay by their arguments, in any order and any number of times,
+// since optimizers may drop or repeat them.
+//
+// Calls a native makes by running script are part of what it does, so they
+// are not recorded; replay skips them with it. A log serves one run at a
+// time, and once registered must neither move nor die before the Environments.
+class NativeCallLog {
+public:
+	// A log that records
+	NativeCallLog() = default;
+
+	NativeCallLog(const NativeCallLog&) = delete;
+	NativeCallLog& operator=(const NativeCallLog&) = delete;
+	NativeCallLog(NativeCallLog&&) = default;
+	NativeCallLog& operator=(NativeCallLog&&) = default;
+
+	// A log that replays the recording saved at `path`
+	static NativeCallLog load(const std::string& path) {
+		std::ifstream file(path, std::ios::binary);
+		char magic[sizeof(MAGIC)];
+		if (!file.read(magic, sizeof(magic)) || std::memcmp(magic, MAGIC, sizeof(magic)) != 0) {
+			throw std::runtime_error("Not a native call recording: " + path);
+		}
+
+		NativeCallLog log;
+		log.names.resize(get<uint32_t>(file));
+		for (uint32_t i = 0; i < log.names.size(); ++i) {
+			log.names[i] = getString(file);
+			log.nameIds[log.names[i]] = i;
+		}
+		log.calls.resize(get<uint64_t>(file));
+		for (Call& call : log.calls) {
+			call.name = get<uint32_t>(file);
+			call.arguments = get<uint64_t>(file);
+			call.result = get<double>(file);
+			call.threw = get<uint8_t>(file) != 0;
+			if (call.threw) {
+				call.error = getString(file);
+			}
+		}
+		uint64_t pureCount = get<uint64_t>(file);
+		for (uint64_t i = 0; i < pureCount; ++i) {
+			PureKey key;
+			key.first = get<uint32_t>(file);
+			key.second.resize(get<uint32_t>(file));
+			for (uint64_t& bits : key.second) {
+				bits = get<uint64_t>(file);
+			}
+			log.pureResults[key] = get<double>(file);
+		}
+		log.replaying = true;
+		return log;
+	}
+
+	// Register `function` in `env` under `name`: called and recorded while
+	// recording, replaced by the recorded results while replaying
+	void registerFunction(Environment& env, const std::string& name, ScriptFunction function, bool pure = false) {
+		uint32_t id = nameId(name);
+		if (pure) {
+			env.registerFunction(name, [this, id, function](const std::vector<double>& args) {
+				return callPure(id, function, args);
+			}, true);
+		}
+		else {
+			env.registerFunction(name, [this, id, function](const std::vector<double>& args) {
+				return callImpure(id, function, args);
+			});
+		}
+	}
+
+	// Replay what was recorded so far from the start, in this process
+	void startReplay() {
+		replaying = true;
+		position = 0;
+	}
+
+	bool isReplaying() const {
+		return replaying;
+	}
+
+	// Impure calls recorded, and replayed so far
+	size_t getCalls() const {
+		return calls.size();
+	}
+
+	size_t getReplayed() const {
+		return position;
+	}
+
+	// Distinct pure calls recorded
+	size_t getPureResults() const {
+		return pureResults.size();
+	}
+
+	// True once a replay has consumed every recorded impure call
+	bool isComplete() const {
+		return replaying && position == calls.size();
+	}
+
+	void save(const std::string& path) const {
+		std::ofstream file(path, std::ios::binary);
+		if (!file) {
+			throw std::runtime_error("Cannot write native call recording: " + path);
+		}
+		file.write(MAGIC, sizeof(MAGIC));
+		put(file, static_cast<uint32_t>(names.size()));
+		for (const std::string& name : names) {
+			putString(file, name);
+		}
+		put(file, static_cast<uint64_t>(calls.size()));
+		for (const Call& call : calls) {
+			put(file, call.name);
+			put(file, call.arguments);
+			put(file, call.result);
+			put(file, static_cast<uint8_t>(call.threw));
+			if (call.threw) {
+				putString(file, call.error);
+			}
+		}
+		put(file, static_cast<uint64_t>(pureResults.size()));
+		for (const auto& [key, result] : pureResults) {
+			put(file, key.first);
+			put(file, static_cast<uint32_t>(key.second.size()));
+			for (uint64_t bits : key.second) {
+				put(file, bits);
+			}
+			put(file, result);
+		}
+		if (!file) {
+			throw std::runtime_error("Cannot write native call recording: " + path);
+		}
+	}
+
+private:
+	static constexpr char MAGIC[8] = { 'V', 'F', 'N', 'A', 'T', 'L', 'O', 'G' };
+
+	struct Call {
+		uint32_t name = 0;
+		uint64_t arguments = 0;  // Hash of the argument bit patterns, to catch divergence
+		double result = 0;
+		bool threw = false;
+		std::string error = {};
+	};
+
+	// Name and arguments by bit pattern, so that 0 and -0 stay apart
+	using PureKey = std::pair<uint32_t, std::vector<uint64_t>>;
+
+	bool replaying = false;
+	std::vector<std::string> names;
+	std::unordered_map<std::string, uint32_t> nameIds;
+	std::vector<Call> calls;
+	std::map<PureKey, double> pureResults;
+	size_t position = 0;  // Next impure call to replay
+	size_t depth = 0;     // Recorded natives running
+
+	uint32_t nameId(const std::string& name) {
+		auto found = nameIds.find(name);
+		if (found != nameIds.end()) {
+			return found->second;
+		}
+		names.push_back(name);
+		return nameIds[name] = static_cast<uint32_t>(names.size() - 1);
+	}
+
+	static std::vector<uint64_t> bitsOf(const std::vector<double>& args) {
+		std::vector<uint64_t> bits(args.size());
+		if (!args.empty()) {
+			std::memcpy(bits.data(), args.data(), args.size() * sizeof(double));
+		}
+		return bits;
+	}
+
+	// FNV-1a over the argument bit patterns
+	static uint64_t hashOf(const std::vector<double>& args) {
+		uint64_t hash = 14695981039346656037ull;
+		for (uint64_t bits : bitsOf(args)) {
+			for (int byte = 0; byte < 8; ++byte) {
+				hash = (hash ^ (bits >> (byte * 8) & 0xff)) * 1099511628211ull;
+			}
+		}
+		return hash;
+	}
+
+	double callImpure(uint32_t name, const ScriptFunction& function, const std::vector<double>& args) {
+		if (!replaying) {
+			if (depth != 0) {
+				return function(args);
+			}
+			size_t index = calls.size();
+			calls.push_back({ name, hashOf(args) });
+			++depth;
+			try {
+				double result = function(args);
+				--depth;
+				calls[index].result = result;
+				return result;
+			}
+			catch (const std::exception& e) {
+				--depth;
+				calls[index].threw = true;
+				calls[index].error = e.what();
+				throw;
+			}
+			catch (...) {
+				--depth;
+				calls[index].threw = true;
+				calls[index].error = "Unknown native error";
+				throw;
+			}
+		}
+
+		if (position == calls.size()) {
+			throw std::runtime_error("Native call replay ran past the recording at call " + std::to_string(position + 1)
+				+ " (" + names[name] + ")");
+		}
+		const Call& call = calls[position];
+		if (call.name != name || call.arguments != hashOf(args)) {
+			throw std::runtime_error("Native call replay diverged at call " + std::to_string(position + 1) + ": recorded "
+				+ names[call.name] + (call.name == name ? " with other arguments" : "") + ", now " + names[name]);
+		}
+		++position;
+		if (call.threw) {
+			throw std::runtime_error(call.error);
+		}
+		return call.result;
+	}
+
+	double callPure(uint32_t name, const ScriptFunction& function, const std::vector<double>& args) {
+		PureKey key{ name, bitsOf(args) };
+		if (!replaying) {
+			if (depth != 0) {
+				return function(args);
+			}
+			++depth;
+			double result;
+			try {
+				result = function(args);
+			}
+			catch (...) {
+				--depth;
+				throw;
+			}
+			--depth;
+			pureResults[key] = result;
+			return result;
+		}
+		auto found = pureResults.find(key);
+		if (found == pureResults.end()) {
+			throw std::runtime_error("Native call replay has no result for pure " + names[name] + " with these arguments");
+		}
+		return found->second;
+	}
+
+	template<typename T>
+	static void put(std::ofstream& file, T value) {
+		file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+	}
+
+	static void putString(std::ofstream& file, const std::string& text) {
+		put(file, static_cast<uint32_t>(text.size()));
+		file.write(text.data(), text.size());
+	}
+
+	template<typename T>
+	static T get(std::ifstream& file) {
+		T value{};
+		file.read(reinterpret_cast<char*>(&value), sizeof(value));
+		if (!file) {
+			throw std::runtime_error("Truncated native call recording");
+		}
+		return value;
+	}
+
+	static std::string getString(std::ifstream& file) {
+		std::string text(get<uint32_t>(file), '\0');
+		file.read(text.data(), text.size());
+		if (!file) {
+			throw std::runtime_error("Truncated native call recording");
+		}
+		return text;
+	}
+};
@@ -0,0 +1,912 @@
+#pragma once
+
+#include <cmath>
+#include <cstring>
+#include <set>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "IR.hpp"
+#include "LoopAnalysis.hpp"
+
+// Counts of what the optimizer changed, for tuning and debugging
+struct OptimizerStats {
+	size_t instructionsBefore = 0;
+	size_t instructionsAfter = 0;
+	size_t constantsFolded = 0;
+	size_t branchesFolded = 0;
+	size_t blocksRemoved = 0;
+	size_t redundanciesRemoved = 0;
+	size_t copiesPropagated = 0;
+	size_t deadInstructionsRemoved = 0;
+	size_t multipliesReduced = 0;
+	size_t loopsUnrolled = 0;
+	size_t loopsPartiallyUnrolled = 0;
+	size_t countedLoopsFused = 0;  // Lowered to a fused increment-compare-branch
+
+	// Source-level dead code elimination (DeadCodeEliminator)
+	size_t conditionsFolded = 0;
+	size_t statementsRemoved = 0;
+	size_t storesRemoved = 0;
+
+	std::string report() const {
+		std::ostringstream out;
+		if (conditionsFolded || statementsRemoved || storesRemoved) {
+			out << "Statements:\n"
+				<< "  constant conditions folded: " << conditionsFolded << "\n"
+				<< "  dead or unreachable statements removed: " << statementsRemoved << "\n"
+				<< "  dead stores removed: " << storesRemoved << "\n";
+		}
+		if (instructionsBefore) {
+			out << "IR instructions: " << instructionsBefore << " -> " << instructionsAfter << "\n"
+				<< "  constants folded: " << constantsFolded << "\n"
+				<< "  branches folded: " << branchesFolded << "\n"
+				<< "  unreachable blocks removed: " << blocksRemoved << "\n"
+				<< "  redundant values removed: " << redundanciesRemoved << "\n"
+				<< "  copies propagated: " << copiesPropagated << "\n"
+				<< "  dead instructions removed: " << deadInstructionsRemoved << "\n"
+				<< "  multiplications strength-reduced: " << multipliesReduced << "\n"
+				<< "  loops unrolled: " << loopsUnrolled << " fully, " << loopsPartiallyUnrolled << " partially\n"
+				<< "  counted loops fused: " << countedLoopsFused << "\n";
+		}
+		return out.str();
+	}
+};
+
+// SSA optimization pipeline: sparse conditional constant propagation, global
+// value numbering, copy propagation, strength reduction, loop unrolling and
+// dead code elimination
+class Optimizer {
+public:
+	static constexpr size_t UNROLL_BUDGET = 128;  // Instructions unrolling may add per loop
+	static constexpr size_t MAX_UNROLL_FACTOR = 8;
+
+	explicit Optimizer(OptimizerStats& stats) : stats(stats) {}
+
+	void run(IRModule& module) {
+		for (IRFunction& function : module.functions) {
+			optimize(function);
+		}
+	}
+
+	void optimize(IRFunction& function) {
+		propagateCopies(function);
+		propagateConstants(function);
+		propagateCopies(function);
+		numberValues(function);
+		propagateCopies(function);
+		reduceStrength(function);
+		if (unrollLoops(function)) {
+			// Fold the copies and drop what is left of fully unrolled loops
+			propagateConstants(function);
+			propagateCopies(function);
+			numberValues(function);
+			propagateCopies(function);
+		}
+		eliminateDeadCode(function);
+	}
+
+	// Replace copies and phis whose operands are all the same value
+	void propagateCopies(IRFunction& function) {
+		std::vector<IRValueId> replacement = identity(function);
+		for (bool changed = true; changed;) {
+			changed = false;
+			for (IRValueId value = 0; value < function.values.size(); ++value) {
+				IRInstruction& instruction = function.values[value];
+				if (instruction.removed || replacement[value] != value) {
+					continue;
+				}
+
+				IRValueId same = IR_NONE;
+				if (instruction.op == IROp::COPY) {
+					same = resolve(replacement, instruction.operands[0]);
+				}
+				else if (instruction.op == IROp::PHI) {
+					for (IRValueId operand : instruction.operands) {
+						operand = resolve(replacement, operand);
+						if (operand == value || operand == same) {
+							continue;
+						}
+						if (same != IR_NONE) {
+							same = IR_NONE;
+							break;
+						}
+						same = operand;
+					}
+				}
+
+				if (same != IR_NONE && same != value) {
+					replacement[value] = same;
+					instruction.removed = true;
+					++stats.copiesPropagated;
+					changed = true;
+				}
+			}
+		}
+		replaceUses(function, replacement);
+	}
+
+	// Wegman-Zadeck sparse conditional constant propagation: folds constants
+	// through phis, folds branches on constants and drops unreachable blocks
+	void propagateConstants(IRFunction& function) {
+		enum class Level : uint8_t { UNDEFINED, CONSTANT, OVERDEFINED };
+		struct Lattice {
+			Level level = Level::UNDEFINED;
+			double value = 0;
+		};
+
+		size_t valueCount = function.values.size();
+		std::vector<Lattice> lattice(valueCount);
+		std::vector<std::vector<IRValueId>> users(valueCount);
+		for (IRValueId value = 0; value < valueCount; ++value) {
+			if (!function.values[value].removed) {
+				for (IRValueId operand : function.values[value].operands) {
+					users[operand].push_back(value);
+				}
+			}
+		}
+
+		std::set<std::pair<IRBlockId, IRBlockId>> executable;
+		std::vector<bool> visited(function.blocks.size(), false);
+		std::vector<std::pair<IRBlockId, IRBlockId>> edgeWork{ { IR_NONE, 0 } };
+		std::vector<IRValueId> valueWork;
+
+		// Lower a value in the lattice; values only ever move towards OVERDEFINED
+		auto update = [&](IRValueId value, Level level, double constant) {
+			Lattice& entry = lattice[value];
+			if (entry.level == Level::OVERDEFINED || level == Level::UNDEFINED) {
+				return;
+			}
+			if (level == Level::CONSTANT && entry.level == Level::CONSTANT) {
+				if (equalBits(entry.value, constant)) {
+					return;
+				}
+				level = Level::OVERDEFINED;  // Two different constants meet
+			}
+			entry.level = level;
+			entry.value = constant;
+			valueWork.push_back(value);
+		};
+
+		auto evaluate = [&](IRValueId value) {
+			const IRInstruction& instruction = function.values[value];
+			IRBlockId block = instruction.block;
+			switch (instruction.op) {
+			case IROp::CONSTANT:
+				update(value, Level::CONSTANT, instruction.constant);
+				return;
+			case IROp::PHI: {
+				const std::vector<IRBlockId>& predecessors = function.blocks[block].predecessors;
+				for (size_t i = 0; i < predecessors.size(); ++i) {
+					if (!executable.count({ predecessors[i], block })) {
+						continue;
+					}
+					const Lattice& operand = lattice[instruction.operands[i]];
+					if (operand.level != Level::UNDEFINED) {
+						update(value, operand.level, operand.value);
+					}
+				}
+				return;
+			}
+			case IROp::COPY: {
+				const Lattice& operand = lattice[instruction.operands[0]];
+				if (operand.level != Level::UNDEFINED) {
+					update(value, operand.level, operand.value);
+				}
+				return;
+			}
+			case IROp::JUMP:
+				edgeWork.push_back({ block, function.blocks[block].successors[0] });
+				return;
+			case IROp::BRANCH: {
+				const Lattice& condition = lattice[instruction.operands[0]];
+				const std::vector<IRBlockId>& successors = function.blocks[block].successors;
+				if (condition.level == Level::CONSTANT) {
+					edgeWork.push_back({ block, successors[condition.value != 0 ? 0 : 1] });
+				}
+				else if (condition.level == Level::OVERDEFINED) {
+					edgeWork.push_back({ block, successors[0] });
+					edgeWork.push_back({ block, successors[1] });
+				}
+				return;
+			}
+			default:
+				break;
+			}
+
+			if (!hasResult(instruction.op)) {
+				return;
+			}
+			if (isBinary(instruction.op) || instruction.op == IROp::NEGATE || instruction.op == IROp::NOT) {
+				bool allConstant = true;
+				for (IRValueId operand : instruction.operands) {
+					if (lattice[operand].level == Level::UNDEFINED) {
+						return;
+					}
+					allConstant = allConstant && lattice[operand].level == Level::CONSTANT;
+				}
+				double result;
+				double right = instruction.operands.size() > 1 ? lattice[instruction.operands[1]].value : 0;
+				if (allConstant && foldConstant(instruction.op, lattice[instruction.operands[0]].value, right, result)) {
+					update(value, Level::CONSTANT, result);
+					return;
+				}
+			}
+			update(value, Level::OVERDEFINED, 0);
+		};
+
+		while (!edgeWork.empty() || !valueWork.empty()) {
+			while (!edgeWork.empty()) {
+				auto [from, to] = edgeWork.back();
+				edgeWork.pop_back();
+				if (from != IR_NONE && !executable.insert({ from, to }).second) {
+					continue;
+				}
+				bool first = !visited[to];
+				visited[to] = true;
+				for (IRValueId value : function.blocks[to].instructions) {
+					if (first || function.values[value].op == IROp::PHI) {
+						evaluate(value);
+					}
+				}
+			}
+			while (!valueWork.empty() && edgeWork.empty()) {
+				IRValueId value = valueWork.back();
+				valueWork.pop_back();
+				for (IRValueId user : users[value]) {
+					if (visited[function.values[user].block]) {
+						evaluate(user);
+					}
+				}
+			}
+		}
+
+		// Fold branches on constants and cut the edges that never execute
+		for (IRBlockId block = 0; block < function.blocks.size(); ++block) {
+			if (!visited[block] || function.blocks[block].removed) {
+				continue;
+			}
+			IRInstruction& terminator = function.terminator(block);
+			if (terminator.op == IROp::BRANCH && lattice[terminator.operands[0]].level == Level::CONSTANT) {
+				bool taken = lattice[terminator.operands[0]].value != 0;
+				IRBlockId untaken = function.blocks[block].successors[taken ? 1 : 0];
+				IRBlockId target = function.blocks[block].successors[taken ? 0 : 1];
+				function.removeEdge(block, untaken);
+				terminator.op = IROp::JUMP;
+				terminator.operands.clear();
+				if (function.blocks[block].successors.empty()) {
+					function.addEdge(block, target);  // Both edges led to the same block
+				}
+				++stats.branchesFolded;
+			}
+		}
+		for (IRBlockId block = 0; block < function.blocks.size(); ++block) {
+			if (visited[block] || function.blocks[block].removed) {
+				continue;
+			}
+			while (!function.blocks[block].successors.empty()) {
+				function.removeEdge(block, function.blocks[block].successors.back());
+			}
+			for (IRValueId value : function.blocks[block].instructions) {
+				function.values[value].removed = true;
+			}
+			function.blocks[block].removed = true;
+			++stats.blocksRemoved;
+		}
+
+		// Replace values known to be constant, and integer checks known to pass
+		std::vector<IRValueId> replacement = identity(function);
+		for (IRValueId value = 0; value < valueCount; ++value) {
+			IRInstruction& instruction = function.values[value];
+			if (instruction.removed) {
+				continue;
+			}
+			if (instruction.op == IROp::CHECK_INT) {
+				const Lattice& operand = lattice[instruction.operands[0]];
+				if (operand.level == Level::CONSTANT && isIntValue(operand.value)) {
+					instruction.removed = true;
+					++stats.constantsFolded;
+				}
+				continue;
+			}
+			if (instruction.op == IROp::CONSTANT || lattice[value].level != Level::CONSTANT) {
+				continue;
+			}
+			IRValueId folded = constant(function, lattice[value].value);
+			while (replacement.size() < function.values.size()) {
+				replacement.push_back(static_cast<IRValueId>(replacement.size()));
+			}
+			replacement[value] = folded;
+			function.values[value].removed = true;
+			++stats.constantsFolded;
+		}
+		replaceUses(function, replacement);
+	}
+
+	// Dominator-based global value numbering of pure expressions, plus
+	// redundant load elimination and store-to-load forwarding within blocks
+	void numberValues(IRFunction& function) {
+		std::vector<IRBlockId> dominator = function.immediateDominators();
+		std::vector<std::vector<IRBlockId>> children(function.blocks.size());
+		for (IRBlockId block = 1; block < function.blocks.size(); ++block) {
+			if (dominator[block] != IR_NONE && !function.blocks[block].removed) {
+				children[dominator[block]].push_back(block);
+			}
+		}
+
+		std::vector<IRValueId> replacement = identity(function);
+		std::unordered_map<std::string, IRValueId> available;
+		std::vector<std::pair<IRBlockId, std::vector<std::string>>> stack{ { 0, {} } };
+		std::vector<size_t> nextChild(function.blocks.size(), 0);
+
+		// Visit the dominator tree depth-first; each block's entries leave scope with it
+		numberBlock(function, 0, available, stack.back().second, replacement);
+		while (!stack.empty()) {
+			IRBlockId block = stack.back().first;
+			if (nextChild[block] < children[block].size()) {
+				IRBlockId child = children[block][nextChild[block]++];
+				stack.push_back({ child, {} });
+				numberBlock(function, child, available, stack.back().second, replacement);
+			}
+			else {
+				for (const std::string& key : stack.back().second) {
+					available.erase(key);
+				}
+				stack.pop_back();
+			}
+		}
+		replaceUses(function, replacement);
+	}
+
+	// Products of a counted loop's variable and a constant become induction
+	// variables of their own: a header phi advanced by addition in the latch
+	void reduceStrength(IRFunction& function) {
+		std::vector<IRValueId> replacement = identity(function);
+		size_t valueCount = function.values.size();
+		for (const IRCountedLoop& loop : findCountedLoops(function)) {
+			std::unordered_map<uint64_t, IRValueId> reduced;  // Factor bits -> phi
+			for (IRValueId value = 0; value < valueCount; ++value) {
+				const IRInstruction& instruction = function.values[value];
+				if (instruction.removed || instruction.op != IROp::MULTIPLY || !loop.contains[instruction.block]) {
+					continue;
+				}
+				size_t factorSide = instruction.operands[0] == loop.variable ? 1 : 0;
+				const IRInstruction& factor = function.values[instruction.operands[factorSide]];
+				if (instruction.operands[1 - factorSide] != loop.variable || factor.op != IROp::CONSTANT
+					|| !isExactProduct(function, loop, factor.constant)) {
+					continue;
+				}
+
+				uint64_t bits;
+				std::memcpy(&bits, &factor.constant, sizeof(bits));
+				auto found = reduced.find(bits);
+				if (found == reduced.end()) {
+					found = reduced.emplace(bits, addInductionVariable(function, loop, factor.constant)).first;
+				}
+				replacement[value] = found->second;
+				function.values[value].removed = true;
+				++stats.multipliesReduced;
+			}
+		}
+		while (replacement.size() < function.values.size()) {
+			replacement.push_back(static_cast<IRValueId>(replacement.size()));
+		}
+		replaceUses(function, replacement);
+	}
+
+	// Innermost counted loops with a small constant trip count are replaced by
+	// copies of their body; others run a factor of copies per test in a main
+	// loop, leaving the original as the remainder loop. Returns true on change.
+	bool unrollLoops(IRFunction& function) {
+		bool changed = false;
+		for (const IRCountedLoop& loop : findCountedLoops(function)) {
+			size_t size = bodySize(function, loop);
+			if (!isInnermost(function, loop) || function.blocks[loop.body].predecessors.size() != 1 || size > UNROLL_BUDGET / 2) {
+				continue;
+			}
+
+			size_t trips;
+			if (tripCount(function, loop, UNROLL_BUDGET / size, trips)) {
+				peel(function, loop, trips);
+				++stats.loopsUnrolled;
+				changed = true;
+				continue;
+			}
+
+			size_t factor = MAX_UNROLL_FACTOR;
+			while (factor * size > UNROLL_BUDGET) {
+				factor /= 2;
+			}
+			IRValueId bound = unrolledBound(function, loop, factor);
+			if (bound != IR_NONE) {
+				unrollBy(function, loop, factor, bound);
+				++stats.loopsPartiallyUnrolled;
+				changed = true;
+			}
+		}
+		return changed;
+	}
+
+	// Remove instructions whose values are never used and that have no effect
+	void eliminateDeadCode(IRFunction& function) {
+		std::vector<bool> live(function.values.size(), false);
+		std::vector<IRValueId> work;
+		for (const IRBlock& block : function.blocks) {
+			if (block.removed) {
+				continue;
+			}
+			for (IRValueId value : block.instructions) {
+				if (!isRemovable(function, function.values[value])) {
+					live[value] = true;
+					work.push_back(value);
+				}
+			}
+		}
+		while (!work.empty()) {
+			IRValueId value = work.back();
+			work.pop_back();
+			for (IRValueId operand : function.values[value].operands) {
+				if (!live[operand]) {
+					live[operand] = true;
+					work.push_back(operand);
+				}
+			}
+		}
+
+		for (IRBlock& block : function.blocks) {
+			if (block.removed) {
+				continue;
+			}
+			for (IRValueId value : block.instructions) {
+				if (!live[value]) {
+					function.values[value].removed = true;
+					++stats.deadInstructionsRemoved;
+				}
+			}
+		}
+		function.compact();
+	}
+
+private:
+	OptimizerStats& stats;
+
+	static bool equalBits(double left, double right) {
+		return std::memcmp(&left, &right, sizeof(double)) == 0;
+	}
+
+	static std::vector<IRValueId> identity(const IRFunction& function) {
+		std::vector<IRValueId> replacement(function.values.size());
+		for (IRValueId value = 0; value < replacement.size(); ++value) {
+			replacement[value] = value;
+		}
+		return replacement;
+	}
+
+	static IRValueId resolve(std::vector<IRValueId>& replacement, IRValueId value) {
+		while (replacement[value] != value) {
+			value = replacement[value] = replacement[replacement[value]];
+		}
+		return value;
+	}
+
+	static void replaceUses(IRFunction& function, std::vector<IRValueId>& replacement) {
+		for (IRValueId value = 0; value < function.values.size(); ++value) {
+			IRInstruction& instruction = function.values[value];
+			if (instruction.removed) {
+				continue;
+			}
+			for (IRValueId& operand : instruction.operands) {
+				operand = resolve(replacement, operand);
+			}
+		}
+		function.compact();
+	}
+
+	// The function's constant with this value, added to the entry block if needed
+	static IRValueId constant(IRFunction& function, double value) {
+		for (IRValueId id : function.blocks[0].instructions) {
+			const IRInstruction& instruction = function.values[id];
+			if (instruction.op == IROp::CONSTANT && !instruction.removed && equalBits(instruction.constant, value)) {
+				return id;
+			}
+		}
+		IRInstruction instruction{ IROp::CONSTANT };
+		instruction.constant = value;
+		instruction.block = 0;
+		function.values.push_back(instruction);
+		IRValueId id = static_cast<IRValueId>(function.values.size() - 1);
+		function.blocks[0].instructions.insert(function.blocks[0].instructions.begin(), id);
+		return id;
+	}
+
+	static constexpr double EXACT_INTEGER_LIMIT = 9007199254740992.0;  // 2^53
+
+	static bool isInteger(double value) {
+		return std::isfinite(value) && value == std::floor(value);
+	}
+
+	// Largest magnitude the variable of a counted loop takes, one step past the
+	// bound included; false unless it is known to stay an integer
+	static bool integerReach(const IRFunction& function, const IRCountedLoop& loop, double& reach) {
+		const IRInstruction& init = function.values[loop.init];
+		const IRInstruction& bound = function.values[loop.bound];
+		if (!isInteger(loop.step)) {
+			return false;
+		}
+		if (loop.check != IR_NONE) {
+			reach = 2147483648.0 + std::fabs(loop.step);  // Int checks stop the variable at the int range
+			return true;
+		}
+		if (init.op == IROp::CONSTANT && isInteger(init.constant) && bound.op == IROp::CONSTANT && std::isfinite(bound.constant)) {
+			reach = std::max(std::fabs(init.constant), std::fabs(bound.constant)) + std::fabs(loop.step);
+			return reach < EXACT_INTEGER_LIMIT;
+		}
+		return false;
+	}
+
+	// Whether variable * factor can be tracked by repeated addition without
+	// rounding or signed zeros: every value stays an integer below 2^53
+	static bool isExactProduct(const IRFunction& function, const IRCountedLoop& loop, double factor) {
+		const IRInstruction& init = function.values[loop.init];
+		double reach;
+		if (init.op != IROp::CONSTANT || !isInteger(init.constant) || (init.constant == 0 && std::signbit(init.constant))
+			|| !isInteger(factor) || !(factor > 0) || !integerReach(function, loop, reach)) {
+			return false;
+		}
+		return reach * factor < EXACT_INTEGER_LIMIT;
+	}
+
+	// A phi in the loop header equal to variable * factor on every iteration
+	static IRValueId addInductionVariable(IRFunction& function, const IRCountedLoop& loop, double factor) {
+		IRValueId phi = function.prependPhi(loop.header);
+		IRValueId start = constant(function, function.values[loop.init].constant * factor);
+		IRValueId increment = constant(function, loop.step * factor);
+
+		IRInstruction add{ IROp::ADD };
+		add.operands = { phi, increment };
+		add.block = loop.latch;
+		function.values.push_back(add);
+		IRValueId next = static_cast<IRValueId>(function.values.size() - 1);
+		std::vector<IRValueId>& latch = function.blocks[loop.latch].instructions;
+		latch.insert(latch.end() - 1, next);
+
+		for (IRBlockId predecessor : function.blocks[loop.header].predecessors) {
+			function.values[phi].operands.push_back(predecessor == loop.latch ? next : start);
+		}
+		return phi;
+	}
+
+	// --- Loop unrolling ---
+
+	static bool inLoop(const IRCountedLoop& loop, IRBlockId block) {
+		return block < loop.contains.size() && loop.contains[block];
+	}
+
+	static size_t bodySize(const IRFunction& function, const IRCountedLoop& loop) {
+		size_t size = 0;
+		for (IRBlockId block = 0; block < loop.contains.size(); ++block) {
+			if (loop.contains[block] && block != loop.header) {
+				size += function.blocks[block].instructions.size();
+			}
+		}
+		return size;
+	}
+
+	// No loop nested inside: every edge between body blocks goes forward
+	static bool isInnermost(const IRFunction& function, const IRCountedLoop& loop) {
+		std::vector<IRBlockId> order = function.reversePostorder();
+		std::vector<size_t> rank(function.blocks.size(), 0);
+		for (size_t i = 0; i < order.size(); ++i) {
+			rank[order[i]] = i;
+		}
+		for (IRBlockId block = 0; block < loop.contains.size(); ++block) {
+			if (!loop.contains[block] || block == loop.header) {
+				continue;
+			}
+			for (IRBlockId successor : function.blocks[block].successors) {
+				if (successor != loop.header && inLoop(loop, successor) && rank[successor] <= rank[block]) {
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	// Iterations of a loop between constants, if there are at most `limit`
+	static bool tripCount(const IRFunction& function, const IRCountedLoop& loop, size_t limit, size_t& trips) {
+		const IRInstruction& init = function.values[loop.init];
+		const IRInstruction& bound = function.values[loop.bound];
+		if (init.op != IROp::CONSTANT || bound.op != IROp::CONSTANT) {
+			return false;
+		}
+		double variable = init.constant;
+		double test = 0;
+		for (trips = 0; foldConstant(loop.compare, variable, bound.constant, test) && test != 0; ++trips) {
+			if (trips == limit) {
+				return false;
+			}
+			variable += loop.step;
+		}
+		return true;
+	}
+
+	// The bound a main loop running `factor` iterations per test compares the
+	// variable against: variable < bound - (factor - 1) * step, and likewise for
+	// the other comparisons. IR_NONE unless both sides stay exact.
+	IRValueId unrolledBound(IRFunction& function, const IRCountedLoop& loop, size_t factor) {
+		double offset = loop.step * static_cast<double>(factor - 1);
+		double reach;
+		if (!integerReach(function, loop, reach) || reach + std::fabs(offset) >= EXACT_INTEGER_LIMIT) {
+			return IR_NONE;
+		}
+
+		const IRInstruction& bound = function.values[loop.bound];
+		if (bound.op == IROp::CONSTANT) {
+			double shifted = bound.constant - offset;
+			return shifted + offset == bound.constant ? constant(function, shifted) : IR_NONE;
+		}
+		if (!isIntChecked(function, loop.bound, loop.preheader)) {
+			return IR_NONE;
+		}
+		IRInstruction subtract{ IROp::SUBTRACT };
+		subtract.operands = { loop.bound, constant(function, offset) };
+		subtract.block = loop.preheader;
+		function.values.push_back(subtract);
+		std::vector<IRValueId>& preheader = function.blocks[loop.preheader].instructions;
+		preheader.insert(preheader.end() - 1, static_cast<IRValueId>(function.values.size() - 1));
+		return static_cast<IRValueId>(function.values.size() - 1);
+	}
+
+	// An int check of `value` runs on every path to `block`
+	static bool isIntChecked(const IRFunction& function, IRValueId value, IRBlockId block) {
+		std::vector<IRBlockId> dominator = function.immediateDominators();
+		for (const IRInstruction& instruction : function.values) {
+			if (instruction.removed || instruction.op != IROp::CHECK_INT || instruction.operands[0] != value) {
+				continue;
+			}
+			for (IRBlockId dominated = block;; dominated = dominator[dominated]) {
+				if (dominated == instruction.block) {
+					return true;
+				}
+				if (dominated == 0 || dominator[dominated] == IR_NONE) {
+					break;
+				}
+			}
+		}
+		return false;
+	}
+
+	static std::vector<IRValueId> headerPhis(const IRFunction& function, IRBlockId header) {
+		std::vector<IRValueId> phis;
+		for (IRValueId value : function.blocks[header].instructions) {
+			if (function.values[value].op == IROp::PHI) {
+				phis.push_back(value);
+			}
+		}
+		return phis;
+	}
+
+	static size_t edgeIndex(const IRFunction& function, IRBlockId from, IRBlockId to) {
+		const std::vector<IRBlockId>& predecessors = function.blocks[to].predecessors;
+		return std::find(predecessors.begin(), predecessors.end(), from) - predecessors.begin();
+	}
+
+	static void redirect(IRFunction& function, IRBlockId block, IRBlockId from, IRBlockId to) {
+		std::vector<IRBlockId>& successors = function.blocks[block].successors;
+		*std::find(successors.begin(), successors.end(), from) = to;
+	}
+
+	// Copy the blocks of a loop other than its header; `values` maps the header
+	// phis to their incoming values and receives the copies. Edges to and from
+	// the header are left for the caller to redirect.
+	static std::vector<IRBlockId> cloneBody(IRFunction& function, const IRCountedLoop& loop,
+		std::unordered_map<IRValueId, IRValueId>& values) {
+		std::vector<IRBlockId> blocks(loop.contains.size(), IR_NONE);
+		for (IRBlockId block = 0; block < loop.contains.size(); ++block) {
+			if (loop.contains[block] && block != loop.header) {
+				blocks[block] = function.addBlock();
+			}
+		}
+		auto mapBlock = [&](IRBlockId block) { return block < blocks.size() && blocks[block] != IR_NONE ? blocks[block] : block; };
+
+		// Instructions first, operands once every value has its copy
+		for (IRBlockId block = 0; block < blocks.size(); ++block) {
+			if (blocks[block] == IR_NONE) {
+				continue;
+			}
+			for (IRValueId value : function.blocks[block].instructions) {
+				IRInstruction copy = function.values[value];
+				copy.block = blocks[block];
+				function.values.push_back(std::move(copy));
+				values[value] = static_cast<IRValueId>(function.values.size() - 1);
+				function.blocks[blocks[block]].instructions.push_back(values[value]);
+			}
+			for (IRBlockId predecessor : function.blocks[block].predecessors) {
+				function.blocks[blocks[block]].predecessors.push_back(mapBlock(predecessor));
+			}
+			for (IRBlockId successor : function.blocks[block].successors) {
+				function.blocks[blocks[block]].successors.push_back(mapBlock(successor));
+			}
+		}
+		for (IRBlockId block : blocks) {
+			if (block == IR_NONE) {
+				continue;
+			}
+			for (IRValueId value : function.blocks[block].instructions) {
+				for (IRValueId& operand : function.values[value].operands) {
+					auto found = values.find(operand);
+					if (found != values.end()) {
+						operand = found->second;
+					}
+				}
+			}
+		}
+		return blocks;
+	}
+
+	// Add a copy of the body that `entry` jumps to instead of the header, with the
+	// header test known to pass. Advances `incoming` to the values the copy passes
+	// back to the header phis and returns the copy of the latch.
+	static IRBlockId appendIteration(IRFunction& function, const IRCountedLoop& loop, const std::vector<IRValueId>& phis,
+		std::vector<IRValueId>& incoming, IRBlockId entry) {
+		std::unordered_map<IRValueId, IRValueId> values;
+		for (size_t i = 0; i < phis.size(); ++i) {
+			values[phis[i]] = incoming[i];
+		}
+		std::vector<IRBlockId> blocks = cloneBody(function, loop, values);
+		redirect(function, entry, loop.header, blocks[loop.body]);
+		function.blocks[blocks[loop.body]].predecessors = { entry };
+
+		size_t latchEdge = edgeIndex(function, loop.latch, loop.header);
+		for (size_t i = 0; i < phis.size(); ++i) {
+			IRValueId operand = function.values[phis[i]].operands[latchEdge];
+			auto found = values.find(operand);
+			incoming[i] = found != values.end() ? found->second : operand;
+		}
+		return blocks[loop.latch];
+	}
+
+	// Run the first `count` iterations in copies placed before the loop
+	static void peel(IRFunction& function, const IRCountedLoop& loop, size_t count) {
+		std::vector<IRValueId> phis = headerPhis(function, loop.header);
+		size_t entryEdge = edgeIndex(function, loop.preheader, loop.header);
+		std::vector<IRValueId> incoming;
+		for (IRValueId phi : phis) {
+			incoming.push_back(function.values[phi].operands[entryEdge]);
+		}
+
+		IRBlockId entry = loop.preheader;
+		for (size_t i = 0; i < count; ++i) {
+			entry = appendIteration(function, loop, phis, incoming, entry);
+		}
+		function.blocks[loop.header].predecessors[entryEdge] = entry;
+		for (size_t i = 0; i < phis.size(); ++i) {
+			function.values[phis[i]].operands[entryEdge] = incoming[i];
+		}
+	}
+
+	// Put a main loop running `factor` copies of the body per test against
+	// `bound` in front of the loop, which then handles the remaining iterations
+	static void unrollBy(IRFunction& function, const IRCountedLoop& loop, size_t factor, IRValueId bound) {
+		std::vector<IRValueId> phis = headerPhis(function, loop.header);
+		size_t entryEdge = edgeIndex(function, loop.preheader, loop.header);
+		IRBlockId main = function.addBlock();
+		std::vector<IRValueId> mainPhis;
+		IRValueId variable = IR_NONE;
+		for (IRValueId phi : phis) {
+			IRInstruction mainPhi{ IROp::PHI };
+			mainPhi.operands = { function.values[phi].operands[entryEdge] };
+			mainPhis.push_back(function.append(main, mainPhi));
+			if (phi == loop.variable) {
+				variable = mainPhis.back();
+			}
+		}
+		IRInstruction compare{ loop.compare };
+		compare.operands = { variable, bound };
+		IRInstruction branch{ IROp::BRANCH };
+		branch.operands = { function.append(main, compare) };
+		function.append(main, branch);
+
+		redirect(function, loop.preheader, loop.header, main);
+		function.blocks[main].predecessors = { loop.preheader };
+		function.blocks[main].successors = { loop.header };  // Becomes the first copy
+		std::vector<IRValueId> incoming = mainPhis;
+		IRBlockId entry = main;
+		for (size_t i = 0; i < factor; ++i) {
+			entry = appendIteration(function, loop, phis, incoming, entry);
+		}
+		function.blocks[main].successors.push_back(loop.header);
+		redirect(function, entry, loop.header, main);
+		function.blocks[main].predecessors.push_back(entry);
+		for (size_t i = 0; i < phis.size(); ++i) {
+			function.values[mainPhis[i]].operands.push_back(incoming[i]);
+			function.values[phis[i]].operands[entryEdge] = mainPhis[i];
+		}
+		function.blocks[loop.header].predecessors[entryEdge] = main;
+	}
+
+	bool isRemovable(const IRFunction& function, const IRInstruction& instruction) const {
+		if (isPure(instruction.op)) {
+			return true;
+		}
+		if (instruction.op == IROp::DIVIDE) {
+			const IRInstruction& divisor = function.values[instruction.operands[1]];
+			return divisor.op == IROp::CONSTANT && divisor.constant != 0;
+		}
+		return false;
+	}
+
+	static std::string valueKey(const IRInstruction& instruction) {
+		std::vector<IRValueId> operands = instruction.operands;
+		if (isCommutative(instruction.op) && operands[1] < operands[0]) {
+			std::swap(operands[0], operands[1]);
+		}
+		std::string key(1, static_cast<char>(instruction.op));
+		key.append(reinterpret_cast<const char*>(&instruction.name), sizeof(instruction.name));
+		key.append(reinterpret_cast<const char*>(&instruction.constant), sizeof(instruction.constant));
+		if (instruction.op == IROp::PHI) {
+			key.append(reinterpret_cast<const char*>(&instruction.block), sizeof(instruction.block));
+		}
+		key.append(reinterpret_cast<const char*>(operands.data()), operands.size() * sizeof(IRValueId));
+		return key;
+	}
+
+	void numberBlock(IRFunction& function, IRBlockId block, std::unordered_map<std::string, IRValueId>& available,
+		std::vector<std::string>& scope, std::vector<IRValueId>& replacement) {
+		std::unordered_map<uint32_t, IRValueId> variables;  // Known value of each variable name
+		for (IRValueId value : function.blocks[block].instructions) {
+			IRInstruction& instruction = function.values[value];
+			for (IRValueId& operand : instruction.operands) {
+				operand = resolve(replacement, operand);
+			}
+
+			switch (instruction.op) {
+			case IROp::LOAD_VAR:
+			case IROp::LOAD_GLOBAL: {
+				auto known = variables.find(instruction.name);
+				if (known != variables.end()) {
+					replacement[value] = known->second;
+					instruction.removed = true;
+					++stats.redundanciesRemoved;
+				}
+				else {
+					variables[instruction.name] = value;
+				}
+				continue;
+			}
+			case IROp::STORE_VAR:
+			case IROp::STORE_GLOBAL:
+				variables[instruction.name] = instruction.operands[0];
+				continue;
+			case IROp::DECLARE_VAR:
+				variables.erase(instruction.name);
+				continue;
+			case IROp::CALL:
+			case IROp::CALL_NATIVE:
+				variables.clear();  // Natives may read and write any variable
+				continue;
+			default:
+				break;
+			}
+
+			bool numbered = isPure(instruction.op) || instruction.op == IROp::DIVIDE || instruction.op == IROp::CHECK_INT;
+			if (!numbered || instruction.op == IROp::PARAMETER) {
+				continue;
+			}
+			std::string key = valueKey(instruction);
+			auto found = available.find(key);
+			if (found != available.end()) {
+				replacement[value] = found->second;
+				instruction.removed = true;
+				++stats.redundanciesRemoved;
+			}
+			else {
+				available.emplace(key, value);
+				scope.push_back(std::move(key));
+			}
+		}
+	}
+};
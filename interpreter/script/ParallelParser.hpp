@@ -0,0 +1,162 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "Parser.hpp"
+
+// Parses a script on several threads. A pre-scan splits the source at top-level
+// `func` definitions, skipping their bodies without tokenizing them; the ranges
+// are parsed concurrently and stitched back together in source order.
+class ParallelParser {
+public:
+	explicit ParallelParser(Environment& env, unsigned workerCount = std::thread::hardware_concurrency(),
+		ParserOptions options = {})
+		: env(env), workerCount(std::max(1u, workerCount)), options(options) {
+		// Definitions are registered in source order once all ranges are parsed,
+		// and memo definitions are checked after that
+		this->options.registerFunctions = false;
+	}
+
+	ProgramNode* parse(std::string_view input) {
+		std::vector<Range> chunks = groupRanges(splitTopLevel(input), input.length());
+		std::vector<ChunkResult> results(chunks.size());
+
+		std::atomic<size_t> nextChunk{ 0 };
+		auto worker = [&]() {
+			for (size_t i = nextChunk++; i < chunks.size(); i = nextChunk++) {
+				parseChunk(input, chunks[i], results[i]);
+			}
+		};
+
+		std::vector<std::thread> threads;
+		size_t threadCount = std::min<size_t>(workerCount, chunks.size());
+		for (size_t i = 1; i < threadCount; ++i) {
+			threads.emplace_back(worker);
+		}
+		worker();
+		for (std::thread& thread : threads) {
+			thread.join();
+		}
+
+		// The earliest failing range decides the reported error
+		std::vector<ASTNode*> statements;
+		std::vector<FunctionNode*> functions;
+		std::exception_ptr error;
+		for (ChunkResult& result : results) {
+			if (result.error && !error) {
+				error = result.error;
+			}
+			statements.insert(statements.end(), result.statements.begin(), result.statements.end());
+			functions.insert(functions.end(), result.functions.begin(), result.functions.end());
+		}
+
+		size_t registered = 0;
+		if (!error) {
+			try {
+				for (; registered < functions.size(); ++registered) {
+					env.registerUserFunction(functions[registered]->name, functions[registered]);
+				}
+				Parser::checkMemoFunctions(functions, env);
+			}
+			catch (const std::exception&) {
+				error = std::current_exception();
+			}
+		}
+
+		if (error) {
+			for (size_t i = 0; i < registered; ++i) {
+				env.unregisterUserFunction(functions[i]->name);
+			}
+			for (ASTNode* statement : statements) {
+				delete statement;
+			}
+			std::rethrow_exception(error);
+		}
+
+		return new ProgramNode(statements);
+	}
+
+private:
+	struct Range {
+		size_t start;
+		size_t end;
+	};
+
+	struct ChunkResult {
+		std::vector<ASTNode*> statements;
+		std::vector<FunctionNode*> functions;
+		std::exception_ptr error;
+	};
+
+	Environment& env;
+	unsigned workerCount;
+	ParserOptions options;
+
+	// Offsets of the top-level `func` keywords, preceded by 0
+	std::vector<size_t> splitTopLevel(std::string_view input) const {
+		std::vector<size_t> boundaries{ 0 };
+		Lexer lexer(input);
+		int depth = 0;
+		bool inFunctionHeader = false;
+
+		for (Token token = lexer.getNextToken(); token.type != TokenType::END; token = lexer.getNextToken()) {
+			if (token.type == TokenType::FUNC && depth == 0) {
+				if (token.start > boundaries.back()) {
+					boundaries.push_back(token.start);
+				}
+				inFunctionHeader = true;
+			}
+			else if (token.type == TokenType::LBRACE) {
+				if (inFunctionHeader && depth == 0) {
+					lexer.skipBlock();  // The next token is the matching `}`
+					inFunctionHeader = false;
+				}
+				++depth;
+			}
+			else if (token.type == TokenType::RBRACE) {
+				--depth;
+			}
+		}
+
+		return boundaries;
+	}
+
+	// Merge neighbouring ranges so each worker gets a few sizeable chunks
+	std::vector<Range> groupRanges(const std::vector<size_t>& boundaries, size_t length) const {
+		size_t targetSize = std::max<size_t>(length / (static_cast<size_t>(workerCount) * 4), 1);
+		std::vector<Range> chunks;
+		size_t chunkStart = 0;
+		for (size_t i = 1; i < boundaries.size(); ++i) {
+			if (boundaries[i] - chunkStart >= targetSize) {
+				chunks.push_back({ chunkStart, boundaries[i] });
+				chunkStart = boundaries[i];
+			}
+		}
+		chunks.push_back({ chunkStart, length });
+		return chunks;
+	}
+
+	void parseChunk(std::string_view input, const Range& range, ChunkResult& result) const {
+		try {
+			Lexer lexer(input.substr(range.start, range.end - range.start), range.start);
+			Parser parser(lexer, env, options);
+			while (!parser.atEnd()) {
+				result.statements.push_back(parser.parseNextStatement());
+			}
+			result.functions = parser.getDefinedFunctions();
+		}
+		catch (const std::exception&) {
+			for (ASTNode* statement : result.statements) {
+				delete statement;
+			}
+			result.statements.clear();
+			result.error = std::current_exception();
+		}
+	}
+};
@@ -1,4 +1,5 @@
 #pragma once
+#include <array>
 #include <stdexcept>
 #include <vector>
 #include <string>
@@ -6,22 +7,74 @@
 #include "Lexer.hpp"
 
 #include "AST.hpp"
+#include "ASTAnalysis.hpp"
+
+struct ParserOptions {
+	// Pre-parse function bodies (brace balance only) and parse them on first call
+	bool lazyFunctionBodies = false;
+
+	// Register function definitions in the environment while parsing. When off
+	// they are only collected, see Parser::getDefinedFunctions.
+	bool registerFunctions = true;
+
+	// Parse expressions by recursive descent, one call per precedence level, as
+	// before the precedence parser; kept to compare against. Nesting is bounded
+	// by the call stack.
+	bool recursiveExpressions = false;
+};
 
 class Parser {
 public:
-	Parser(Lexer& lexer, Environment& env) : lexer(lexer), env(env), currentToken(lexer.getNextToken()) {}
+	Parser(Lexer& lexer, Environment& env, ParserOptions options = {})
+		: lexer(lexer), env(env), options(options), currentToken(lexer.getNextToken()) {}
 
 	ASTNode* parse() {
 		return parseProgram();
 	}
 
+	// Parse one top-level statement at a time; used to re-parse edited regions
+	ASTNode* parseNextStatement() {
+		return parseStatement();
+	}
+
+	bool atEnd() const {
+		return currentToken.type == TokenType::END;
+	}
+
+	// Source offset where the upcoming token starts
+	size_t currentOffset() const {
+		return currentToken.start;
+	}
+
+	// Source offset one past the last consumed token
+	size_t consumedOffset() const {
+		return previousTokenEnd;
+	}
+
+	// Function definitions parsed so far, in source order
+	const std::vector<FunctionNode*>& getDefinedFunctions() const {
+		return definedFunctions;
+	}
+
+	// Parses a body deferred by lazyFunctionBodies; see FunctionNode::resolveBody
+	static ASTNode* parseDeferredBody(const FunctionNode& definition, Environment& env);
+
+	// Checks the parsed memo definitions once every function they may call is
+	// registered; throws for the first one in source order that is not pure
+	static void checkMemoFunctions(const std::vector<FunctionNode*>& functions, const Environment& env);
+
 private:
 	Lexer& lexer;
 	Environment& env;
+	ParserOptions options;
 	Token currentToken;
+	size_t previousTokenEnd = 0;
+	std::vector<FunctionNode*> definedFunctions;
+	bool deferMemoChecks = false;
 
 	void eat(TokenType type) {
 		if (currentToken.type == type) {
+			previousTokenEnd = currentToken.end;
 			currentToken = lexer.getNextToken();
 		}
 		else {
@@ -30,14 +83,38 @@ private:
 	}
 
 	ASTNode* parseProgram() {
+		// Memo functions may call each other in any order within a program
+		deferMemoChecks = true;
 		std::vector<ASTNode*> statements;
 		while (currentToken.type != TokenType::END) {
 			statements.push_back(parseStatement());
 		}
-		return new ProgramNode(statements);
+		ProgramNode* program = new ProgramNode(statements);
+		if (!options.registerFunctions) {
+			return program;
+		}
+
+		try {
+			checkMemoFunctions(definedFunctions, env);
+		}
+		catch (const std::exception&) {
+			for (FunctionNode* function : definedFunctions) {
+				env.unregisterUserFunction(function->name);
+			}
+			delete program;
+			throw;
+		}
+		return program;
 	}
 
 	ASTNode* parseStatement() {
+		size_t start = currentToken.start;
+		ASTNode* statement = parseStatementNode();
+		statement->sourceOffset = start;
+		return statement;
+	}
+
+	ASTNode* parseStatementNode() {
 		if (currentToken.type == TokenType::FUNC) {
 			return parseFunctionDefinition();
 		}
@@ -46,13 +123,15 @@ private:
 			return parseDeclaration();
 		}
 		else if (currentToken.type == TokenType::IDENTIFIER) {
-			std::string identifier = currentToken.stringValue;
+			std::string identifier(currentToken.stringValue);
 			eat(TokenType::IDENTIFIER);
 			if (currentToken.type == TokenType::ASSIGN) {
 				return parseAssignment(identifier);
 			}
 			else if (currentToken.type == TokenType::LPAREN) {
-				return parseFunctionCall(identifier);
+				ASTNode* call = parseFunctionCall(identifier);
+				eat(TokenType::SEMICOLON);
+				return call;
 			}
 		}
 		else if (currentToken.type == TokenType::RETURN) {
@@ -98,7 +177,7 @@ private:
 			initializer = parseDeclaration();
 		}
 		else if (currentToken.type == TokenType::IDENTIFIER) {
-			std::string identifier = currentToken.stringValue;
+			std::string identifier(currentToken.stringValue);
 			eat(TokenType::IDENTIFIER);
 			initializer = parseAssignment(identifier);
 		}
@@ -107,8 +186,17 @@ private:
 		ASTNode* condition = parseExpression();
 		eat(TokenType::SEMICOLON);
 
-		// Parse the update expression
+		// Parse the update expression, which may assign the loop variable
 		ASTNode* update = parseExpression();
+		if (currentToken.type == TokenType::ASSIGN) {
+			auto target = dynamic_cast<VariableNode*>(update);
+			if (!target) {
+				throw std::runtime_error("Invalid assignment target");
+			}
+			eat(TokenType::ASSIGN);
+			update = new AssignmentNode(target->name, parseExpression());
+			delete target;
+		}
 		eat(TokenType::RPAREN);
 
 		// Parse the loop body
@@ -130,10 +218,17 @@ private:
 		return new DoWhileNode(body, condition);
 	}
 
+	// func [memo | pure] type name(parameters) { body }
 	ASTNode* parseFunctionDefinition() {
+		size_t start = currentToken.start;
 		eat(TokenType::FUNC);
+		bool memoized = currentToken.type == TokenType::IDENTIFIER
+			&& (currentToken.stringValue == "memo" || currentToken.stringValue == "pure");
+		if (memoized) {
+			eat(TokenType::IDENTIFIER);
+		}
 		ValueType returnType = parseType();
-		std::string functionName = currentToken.stringValue;
+		std::string functionName(currentToken.stringValue);
 		eat(TokenType::IDENTIFIER);
 
 		eat(TokenType::LPAREN);
@@ -141,7 +236,7 @@ private:
 		if (currentToken.type != TokenType::RPAREN) {
 			do {
 				ValueType paramType = parseType();
-				std::string paramName = currentToken.stringValue;
+				std::string paramName(currentToken.stringValue);
 				eat(TokenType::IDENTIFIER);
 				parameters.emplace_back(paramName, paramType);
 				if (currentToken.type == TokenType::COMMA) {
@@ -154,18 +249,44 @@ private:
 		}
 		eat(TokenType::RPAREN);
 
-		eat(TokenType::LBRACE);
-		ASTNode* body = parseStatement();
-		eat(TokenType::RBRACE);
+		FunctionNode* functionNode = nullptr;
+		if (options.lazyFunctionBodies && currentToken.type == TokenType::LBRACE) {
+			// Pre-parse: keep the body source and parse it on the first call
+			size_t bodyOffset = currentToken.end;
+			std::string bodySource(lexer.skipBlock());
+			previousTokenEnd = currentToken.end;
+			currentToken = lexer.getNextToken();
+			eat(TokenType::RBRACE);
+			functionNode = new FunctionNode(functionName, returnType, parameters, bodySource);
+			functionNode->deferredOffset = bodyOffset - start;
+			functionNode->parseDeferred = &parseDeferredBody;
+		}
+		else {
+			eat(TokenType::LBRACE);
+			ASTNode* body = parseStatement();
+			eat(TokenType::RBRACE);
+			functionNode = new FunctionNode(functionName, returnType, parameters, body);
+		}
+		functionNode->memoized = memoized;
+		// Without registration the callees are unknown until the caller checks
+		if (memoized && functionNode->body && options.registerFunctions && !deferMemoChecks) {
+			std::string error = memoizationError(functionNode, env);
+			if (!error.empty()) {
+				delete functionNode;
+				throw std::runtime_error("Function " + functionName + " cannot be memo: " + error);
+			}
+		}
 
-		FunctionNode* functionNode = new FunctionNode(functionName, returnType, parameters, body);
-		env.registerUserFunction(functionName, functionNode);
+		if (options.registerFunctions) {
+			env.registerUserFunction(functionName, functionNode);
+		}
+		definedFunctions.push_back(functionNode);
 		return functionNode;
 	}
 
 	ASTNode* parseDeclaration() {
 		ValueType type = parseType();
-		std::string variableName = currentToken.stringValue;
+		std::string variableName(currentToken.stringValue);
 		eat(TokenType::IDENTIFIER);
 
 		ASTNode* initializer = nullptr;
@@ -200,7 +321,6 @@ private:
 			} while (true);
 		}
 		eat(TokenType::RPAREN);
-		eat(TokenType::SEMICOLON);
 		return new FunctionCallNode(functionName, arguments);
 	}
 
@@ -231,9 +351,111 @@ private:
 	}
 
 	ASTNode* parseExpression() {
-		return parseLogicalOr();
+		return options.recursiveExpressions ? parseLogicalOr() : parseOperators();
+	}
+
+	// Operator-precedence parser: a primary is handled in one step and nesting
+	// (prefix operators, parentheses) lives on explicit stacks, so deeply
+	// nested expressions cannot overflow the call stack.
+	ASTNode* parseOperators() {
+		struct PendingOperator {
+			TokenType type;  // LPAREN marks an open parenthesis
+			int precedence;
+			bool unary;
+		};
+
+		std::vector<ASTNode*> operands;
+		std::vector<PendingOperator> operators;
+		size_t openParentheses = 0;
+
+		// Pop operators down to the innermost open parenthesis while they bind at least as tightly
+		auto reduce = [&](int precedence) {
+			while (!operators.empty() && operators.back().type != TokenType::LPAREN &&
+				operators.back().precedence >= precedence) {
+				PendingOperator op = operators.back();
+				operators.pop_back();
+				ASTNode* right = operands.back();
+				if (op.unary) {
+					operands.back() = new UnaryOpNode(op.type, right);
+				}
+				else {
+					operands.pop_back();
+					operands.back() = new BinaryOpNode(op.type, operands.back(), right);
+				}
+			}
+		};
+
+		try {
+			while (true) {
+				// Operand position: prefix operators and opening parentheses, then a primary
+				while (currentToken.type == TokenType::MINUS || currentToken.type == TokenType::NOT ||
+					currentToken.type == TokenType::LPAREN) {
+					if (currentToken.type == TokenType::LPAREN) {
+						operators.push_back({ TokenType::LPAREN, 0, false });
+						++openParentheses;
+					}
+					else {
+						operators.push_back({ currentToken.type, UNARY_PRECEDENCE, true });
+					}
+					eat(currentToken.type);
+				}
+				operands.push_back(parsePrimary());
+
+				// Operator position: closing parentheses, then a binary operator or the end
+				while (currentToken.type == TokenType::RPAREN && openParentheses > 0) {
+					reduce(0);
+					operators.pop_back();
+					--openParentheses;
+					eat(TokenType::RPAREN);
+				}
+
+				int precedence = binaryPrecedence(currentToken.type);
+				if (precedence == 0) {
+					break;
+				}
+				reduce(precedence);  // Binary operators are left-associative
+				operators.push_back({ currentToken.type, precedence, false });
+				eat(currentToken.type);
+			}
+
+			if (openParentheses > 0) {
+				eat(TokenType::RPAREN);  // Reports the unclosed parenthesis
+			}
+			reduce(0);
+			return operands.back();
+		}
+		catch (const std::exception&) {
+			for (ASTNode* operand : operands) {
+				delete operand;
+			}
+			throw;
+		}
+	}
+
+	static constexpr int UNARY_PRECEDENCE = 7;
+
+	// Binding power of each binary operator, indexed by TokenType; 0 ends an expression
+	static int binaryPrecedence(TokenType type) {
+		static const std::array<int, static_cast<size_t>(TokenType::END) + 1> table = [] {
+			std::array<int, static_cast<size_t>(TokenType::END) + 1> precedences{};
+			precedences[static_cast<size_t>(TokenType::OR)] = 1;
+			precedences[static_cast<size_t>(TokenType::AND)] = 2;
+			precedences[static_cast<size_t>(TokenType::EQUALS)] = 3;
+			precedences[static_cast<size_t>(TokenType::NOT_EQUALS)] = 3;
+			precedences[static_cast<size_t>(TokenType::LESS)] = 4;
+			precedences[static_cast<size_t>(TokenType::LESS_EQUALS)] = 4;
+			precedences[static_cast<size_t>(TokenType::GREATER)] = 4;
+			precedences[static_cast<size_t>(TokenType::GREATER_EQUALS)] = 4;
+			precedences[static_cast<size_t>(TokenType::PLUS)] = 5;
+			precedences[static_cast<size_t>(TokenType::MINUS)] = 5;
+			precedences[static_cast<size_t>(TokenType::MULTIPLY)] = 6;
+			precedences[static_cast<size_t>(TokenType::DIVIDE)] = 6;
+			return precedences;
+		}();
+		return table[static_cast<size_t>(type)];
 	}
 
+	// Recursive descent, see ParserOptions::recursiveExpressions
 	ASTNode* parseLogicalOr() {
 		ASTNode* left = parseLogicalAnd();
 
@@ -320,6 +542,12 @@ private:
 			ASTNode* operand = parseUnary();
 			return new UnaryOpNode(op, operand);
 		}
+		else if (currentToken.type == TokenType::LPAREN) {
+			eat(TokenType::LPAREN);
+			ASTNode* expr = parseExpression();
+			eat(TokenType::RPAREN);
+			return expr;
+		}
 
 		return parsePrimary();
 	}
@@ -331,7 +559,7 @@ private:
 			return new NumberNode(value);
 		}
 		else if (currentToken.type == TokenType::IDENTIFIER) {
-			std::string name = currentToken.stringValue;
+			std::string name(currentToken.stringValue);
 			eat(TokenType::IDENTIFIER);
 
 			if (currentToken.type == TokenType::LPAREN) {
@@ -340,12 +568,6 @@ private:
 
 			return new VariableNode(name);
 		}
-		else if (currentToken.type == TokenType::LPAREN) {
-			eat(TokenType::LPAREN);
-			ASTNode* expr = parseExpression();
-			eat(TokenType::RPAREN);
-			return expr;
-		}
 
 		throw std::runtime_error("Unexpected token in primary");
 	}
@@ -372,3 +594,38 @@ private:
 	}
 };
 
+inline ASTNode* Parser::parseDeferredBody(const FunctionNode& definition, Environment& env) {
+	// Syntax errors in a lazily parsed body surface on the first call
+	Lexer lexer(std::string_view(definition.deferredBody), definition.getDeferredOffset());
+	Parser parser(lexer, env);
+	ASTNode* parsed = parser.parseNextStatement();
+	if (!parser.atEnd()) {
+		delete parsed;
+		throw std::runtime_error("Unexpected token type");
+	}
+	if (definition.sourceOrigin) {
+		anchorSourceOffsets(parsed, definition.sourceOrigin);
+	}
+	definition.body = parsed;
+	if (definition.memoized) {
+		std::string error = memoizationError(&definition, env);
+		if (!error.empty()) {
+			definition.body = nullptr;
+			delete parsed;
+			throw std::runtime_error("Function " + definition.name + " cannot be memo: " + error);
+		}
+	}
+	return parsed;
+}
+
+inline void Parser::checkMemoFunctions(const std::vector<FunctionNode*>& functions, const Environment& env) {
+	for (const FunctionNode* function : functions) {
+		// Lazy bodies are checked when they are parsed on the first call
+		if (function->memoized && function->body) {
+			std::string error = memoizationError(function, env);
+			if (!error.empty()) {
+				throw std::runtime_error("Function " + function->name + " cannot be memo: " + error);
+			}
+		}
+	}
+}
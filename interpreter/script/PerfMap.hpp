@@ -0,0 +1,282 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+#define VF_PERF_MAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+struct PerfMapOptions {
+	std::string directory = "/tmp";
+	bool jitdump = false;  // Also write jit-<pid>.dump
+};
+
+// Names compiled script functions for Linux profilers. Bytecode has no
+// machine code of its own, so the VM enters each function through a small
+// trampoline in executable memory; /tmp/perf-<pid>.map names the trampolines,
+// and perf shows the script function as the caller of the VM frames sampled
+// under it. With `jitdump`, the trampolines are also written to
+// jit-<pid>.dump for `perf inject --jit`.
+//
+// On other platforms, or when executable memory or the map file cannot be
+// had, the map is disabled and the VM calls functions directly. Trampolines
+// are never freed: the map must outlive the machines using it.
+class PerfMap {
+public:
+	using Target = double (*)(void* context, size_t index);
+	using Trampoline = double (*)(void* context, size_t index, Target target);
+
+	explicit PerfMap(PerfMapOptions options = {}) : options(std::move(options)) {
+		open();
+	}
+
+	PerfMap(const PerfMap&) = delete;
+	PerfMap& operator=(const PerfMap&) = delete;
+
+	~PerfMap() {
+#ifdef VF_PERF_MAP
+		for (void* page : pages) {
+			munmap(page, pageSize);
+		}
+		if (jitdumpMarker) {
+			munmap(jitdumpMarker, pageSize);
+		}
+		if (jitdump >= 0) {
+			::close(jitdump);
+		}
+#endif
+		if (map) {
+			std::fclose(map);
+		}
+	}
+
+	bool isEnabled() const {
+		return enabled;
+	}
+
+	const std::string& getMapPath() const {
+		return mapPath;
+	}
+
+	// Empty unless a jitdump is being written
+	const std::string& getJitdumpPath() const {
+		return jitdumpPath;
+	}
+
+	size_t getEntries() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		return trampolines.size();
+	}
+
+	// The trampoline of a function, written to the map the first time the
+	// name and location are seen; nullptr when the map is disabled
+	Trampoline trampoline(const std::string& name, const std::string& location) {
+		std::lock_guard<std::mutex> lock(mutex);
+		std::string symbol = "script:" + name + (location.empty() ? "" : " (" + location + ")");
+		auto found = trampolines.find(symbol);
+		if (found != trampolines.end()) {
+			return found->second;
+		}
+		Trampoline result = enabled ? emit(symbol) : nullptr;
+		if (result) {
+			trampolines[symbol] = result;
+		}
+		return result;
+	}
+
+	// Offsets where the lines of `source` start, for location()
+	static std::vector<size_t> lineStarts(std::string_view source) {
+		std::vector<size_t> starts;
+		if (!source.empty()) {
+			starts.push_back(0);
+		}
+		for (size_t i = 0; i < source.size(); ++i) {
+			if (source[i] == '\n') {
+				starts.push_back(i + 1);
+			}
+		}
+		return starts;
+	}
+
+	// "file:line" of a source offset, or just the file without line starts
+	static std::string location(const std::string& file, const std::vector<size_t>& lines, size_t offset) {
+		if (lines.empty()) {
+			return file;
+		}
+		size_t line = std::upper_bound(lines.begin(), lines.end(), offset) - lines.begin();
+		return file + ":" + std::to_string(line);
+	}
+
+private:
+	// push frame pointer; call the target; pop; return. The arguments pass
+	// through untouched, and so does the floating-point result.
+#if defined(__x86_64__)
+	static constexpr uint8_t CODE[] = { 0x55, 0x48, 0x89, 0xE5, 0xFF, 0xD2, 0x5D, 0xC3 };
+	static constexpr uint32_t ELF_MACHINE = 62;  // EM_X86_64
+#elif defined(__aarch64__)
+	static constexpr uint8_t CODE[] = {
+		0xFD, 0x7B, 0xBF, 0xA9,  // stp x29, x30, [sp, #-16]!
+		0xFD, 0x03, 0x00, 0x91,  // mov x29, sp
+		0x40, 0x00, 0x3F, 0xD6,  // blr x2
+		0xFD, 0x7B, 0xC1, 0xA8,  // ldp x29, x30, [sp], #16
+		0xC0, 0x03, 0x5F, 0xD6   // ret
+	};
+	static constexpr uint32_t ELF_MACHINE = 183;  // EM_AARCH64
+#else
+	static constexpr uint8_t CODE[] = { 0 };
+	static constexpr uint32_t ELF_MACHINE = 0;
+#endif
+	static constexpr size_t SLOT_SIZE = 32;
+
+	PerfMapOptions options;
+	bool enabled = false;
+	std::FILE* map = nullptr;
+	std::string mapPath;
+	std::string jitdumpPath;
+	int jitdump = -1;
+	void* jitdumpMarker = nullptr;
+	size_t pageSize = 4096;
+	std::vector<void*> pages;
+	size_t used = 0;  // Bytes taken in the last page
+	uint64_t codeIndex = 0;
+	std::map<std::string, Trampoline> trampolines;  // By symbol
+	mutable std::mutex mutex;
+
+	void open() {
+#ifdef VF_PERF_MAP
+		pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+		used = pageSize;
+		std::string pid = std::to_string(getpid());
+		mapPath = options.directory + "/perf-" + pid + ".map";
+		map = std::fopen(mapPath.c_str(), "w");
+		if (!map) {
+			return;
+		}
+		enabled = true;
+		if (options.jitdump) {
+			openJitdump(options.directory + "/jit-" + pid + ".dump");
+		}
+#endif
+	}
+
+#ifdef VF_PERF_MAP
+	static uint64_t timestamp() {
+		timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+	}
+
+	// perf finds the dump through an executable mapping of it
+	void openJitdump(const std::string& path) {
+		jitdump = ::open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0666);
+		if (jitdump < 0) {
+			return;
+		}
+		struct {
+			uint32_t magic = 0x4A695444;
+			uint32_t version = 1;
+			uint32_t totalSize = 40;
+			uint32_t elfMachine = ELF_MACHINE;
+			uint32_t padding = 0;
+			uint32_t pid = static_cast<uint32_t>(getpid());
+			uint64_t timestamp = PerfMap::timestamp();
+			uint64_t flags = 0;
+		} header;
+		void* marker = MAP_FAILED;
+		if (::write(jitdump, &header, sizeof(header)) == static_cast<ssize_t>(sizeof(header))) {
+			marker = mmap(nullptr, pageSize, PROT_READ | PROT_EXEC, MAP_PRIVATE, jitdump, 0);
+		}
+		if (marker == MAP_FAILED) {
+			::close(jitdump);
+			jitdump = -1;
+			return;
+		}
+		jitdumpMarker = marker;
+		jitdumpPath = path;
+	}
+
+	// Trampolines are all the same code at different addresses, so a page is
+	// filled with them once and is never writable while it can run
+	Trampoline emit(const std::string& symbol) {
+		if (used + SLOT_SIZE > pageSize) {
+			void* page = mmap(nullptr, pageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (page == MAP_FAILED) {
+				return nullptr;
+			}
+			char* bytes = static_cast<char*>(page);
+			for (size_t offset = 0; offset + SLOT_SIZE <= pageSize; offset += SLOT_SIZE) {
+				std::memcpy(bytes + offset, CODE, sizeof(CODE));
+			}
+			if (mprotect(page, pageSize, PROT_READ | PROT_EXEC) != 0) {
+				munmap(page, pageSize);
+				enabled = false;  // The kernel refuses executable memory made at run time
+				return nullptr;
+			}
+			__builtin___clear_cache(bytes, bytes + pageSize);
+			pages.push_back(page);
+			used = 0;
+		}
+		uint8_t* slot = static_cast<uint8_t*>(pages.back()) + used;
+		used += SLOT_SIZE;
+
+		uint64_t address = reinterpret_cast<uint64_t>(slot);
+		std::fprintf(map, "%llx %zx %s\n", static_cast<unsigned long long>(address), sizeof(CODE), symbol.c_str());
+		std::fflush(map);
+		if (jitdump >= 0) {
+			writeCodeLoad(address, symbol);
+		}
+		return reinterpret_cast<Trampoline>(slot);
+	}
+
+	void writeCodeLoad(uint64_t address, const std::string& symbol) {
+		struct {
+			uint32_t id = 0;  // JIT_CODE_LOAD
+			uint32_t totalSize;
+			uint64_t timestamp;
+			uint32_t pid;
+			uint32_t tid;
+			uint64_t vma;
+			uint64_t codeAddress;
+			uint64_t codeSize;
+			uint64_t codeIndex;
+		} record;
+		record.totalSize = static_cast<uint32_t>(sizeof(record) + symbol.size() + 1 + sizeof(CODE));
+		record.timestamp = timestamp();
+		record.pid = static_cast<uint32_t>(getpid());
+		record.tid = static_cast<uint32_t>(syscall(SYS_gettid));
+		record.vma = address;
+		record.codeAddress = address;
+		record.codeSize = sizeof(CODE);
+		record.codeIndex = codeIndex++;
+
+		std::string bytes(reinterpret_cast<const char*>(&record), sizeof(record));
+		bytes.append(symbol.c_str(), symbol.size() + 1);
+		bytes.append(reinterpret_cast<const char*>(CODE), sizeof(CODE));
+		if (::write(jitdump, bytes.data(), bytes.size()) != static_cast<ssize_t>(bytes.size())) {
+			munmap(jitdumpMarker, pageSize);
+			jitdumpMarker = nullptr;
+			::close(jitdump);
+			jitdump = -1;
+			jitdumpPath.clear();
+		}
+	}
+#else
+	Trampoline emit(const std::string&) {
+		return nullptr;
+	}
+#endif
+};
@@ -1,4 +1,29 @@
 #include "Parser.hpp"
+#include "IncrementalParser.hpp"
+#include "ParallelParser.hpp"
+#include "MappedFile.hpp"
+#include "FlatAST.hpp"
+#include "ClosureCompiler.hpp"
+#include "DeadCodeEliminator.hpp"
+#include "CppEmitter.hpp"
+#include "Compiler.hpp"
+#include "VirtualMachine.hpp"
+#include "Specializer.hpp"
+#include "Tiering.hpp"
+#include "PerfMap.hpp"
+#include "HardwareCounters.hpp"
+#include "Metrics.hpp"
+#include "TraceRecorder.hpp"
+#include "NativeReplay.hpp"
+#include "Coverage.hpp"
+
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <thread>
 
 int test1() {
 	Environment env;
@@ -325,7 +350,1488 @@ int test7() {
 	return 0;
 }
 
-int main() {
+int test8() {
+	Environment env;
+
+	// Register a built-in print function
+	env.registerFunction("print", [](const std::vector<double>& args) -> double {
+		if (args.size() != 1) {
+			throw std::runtime_error("print expects 1 argument");
+		}
+		std::cout << "Print from script: " << args[0] << std::endl;
+		return 0;
+		});
+
+	// Incremental re-parsing of a large script after a single-character edit
+	std::string input;
+	for (int i = 0; i < 50000; ++i) {
+		input += "int v" + std::to_string(i) + " = " + std::to_string(i) + ";\n";
+	}
+	input += "print(v49999 + 1);\n";
+
+	IncrementalParser document(env);
+
+	try {
+		auto start = std::chrono::steady_clock::now();
+		ProgramNode* root = document.parse(input);
+		auto parsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start);
+		ASTNode* untouched = root->statements[1];
+
+		size_t offset = document.getSource().find("= 0;");
+		start = std::chrono::steady_clock::now();
+		root = document.edit(offset + 2, 1, "7");
+		auto elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start);
+
+		std::cout << "Incremental edit took " << elapsed.count() << " us, reused subtrees: "
+			<< (root->statements[1] == untouched ? "yes" : "no") << std::endl;
+
+		// Edits that change the length move every later statement, which only
+		// moves their start offsets: like the same-length edit they stay far
+		// below a full parse
+		size_t second = document.getSource().find("int v1 ");
+		start = std::chrono::steady_clock::now();
+		root = document.edit(second, 0, "int w = 5;\n");
+		auto inserted = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start);
+		start = std::chrono::steady_clock::now();
+		root = document.edit(second, 11, "");
+		auto deleted = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start);
+
+		size_t printOffset = document.getSource().rfind("print");
+		std::cout << "Insertion took " << inserted.count() << " us, deletion " << deleted.count()
+			<< " us, full parse " << parsed.count() << " us; within a tenth of a parse: "
+			<< (std::max(inserted, deleted) < parsed / 10 ? "yes" : "no") << "; last statement at "
+			<< root->statements.back()->getSourceOffset() << " / " << printOffset << std::endl;
+
+		root->evaluate(env);
+		std::cout << "Edited value: " << env.getVariable("v0") << std::endl;
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+	}
+
+	return 0;
+}
+
+int test9() {
+	Environment env;
+
+	// Register a built-in print function
+	env.registerFunction("print", [](const std::vector<double>& args) -> double {
+		if (args.size() != 1) {
+			throw std::runtime_error("print expects 1 argument");
+		}
+		std::cout << "Print from script: " << args[0] << std::endl;
+		return 0;
+		});
+
+	// Library of functions of which only one is ever called
+	std::string input;
+	for (int i = 0; i < 20000; ++i) {
+		input += "func int scale" + std::to_string(i) + "(int n) {\n"
+			"    if (n > " + std::to_string(i) + ") { n = n * 2 + (n - 1) * 3; } else { n = n - 1; }\n"
+			"}\n";
+	}
+	input += "func int twice(int n) { return n * 2; }\n";
+	input += "print(twice(21));\n";
+
+	try {
+		for (bool lazy : { false, true }) {
+			Environment library;
+			library.registerFunction("print", [](const std::vector<double>&) -> double { return 0; });
+
+			auto start = std::chrono::steady_clock::now();
+			Lexer lexer(input);
+			Parser parser(lexer, library, { lazy });
+			ASTNode* root = parser.parse();
+			auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+			std::cout << (lazy ? "Lazy" : "Eager") << " parse took " << elapsed.count() << " ms" << std::endl;
+			delete root;
+		}
+
+		Lexer lexer(input);
+		Parser parser(lexer, env, { true });
+		ASTNode* root = parser.parse();
+		root->evaluate(env);
+		delete root;
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+	}
+
+	return 0;
+}
+
+int test10() {
+	Environment env;
+
+	// Register a built-in print function
+	env.registerFunction("print", [](const std::vector<double>& args) -> double {
+		if (args.size() != 1) {
+			throw std::runtime_error("print expects 1 argument");
+		}
+		std::cout << "Print from script: " << args[0] << std::endl;
+		return 0;
+		});
+
+	// Bundle of independent functions parsed on several threads
+	std::string input = "int base = 40;\n";
+	for (int i = 0; i < 20000; ++i) {
+		input += "func int offset" + std::to_string(i) + "(int n) { return n + " + std::to_string(i) + "; }\n";
+	}
+	input += "print(offset2(base));\n";
+
+	try {
+		for (bool parallel : { false, true }) {
+			Environment library;
+			library.registerFunction("print", [](const std::vector<double>&) -> double { return 0; });
+
+			auto start = std::chrono::steady_clock::now();
+			ASTNode* root = nullptr;
+			if (parallel) {
+				root = ParallelParser(library, 4).parse(input);
+			}
+			else {
+				Lexer lexer(input);
+				root = Parser(lexer, library).parse();
+			}
+			auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+			std::cout << (parallel ? "Parallel" : "Sequential") << " parse took " << elapsed.count() << " ms" << std::endl;
+			delete root;
+		}
+
+		ParallelParser parser(env, 4);
+		ASTNode* root = parser.parse(input);
+		root->evaluate(env);
+		delete root;
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+	}
+
+	return 0;
+}
+
+int test11() {
+	Environment env;
+
+	// Register a built-in print function
+	env.registerFunction("print", [](const std::vector<double>& args) -> double {
+		if (args.size() != 1) {
+			throw std::runtime_error("print expects 1 argument");
+		}
+		std::cout << "Print from script: " << args[0] << std::endl;
+		return 0;
+		});
+
+	// Generated expression-heavy input, and nesting that recursive descent still handles
+	std::string flat = "float a = 3; float b = 4; float x;\n";
+	for (int i = 0; i < 20000; ++i) {
+		flat += "x = (a + b * 3 - (a / 2)) * (b + 1) - -a * 4 + b / (a - b) + (a < b && b >= 2 || !a) * 7;\n";
+	}
+	std::string nested = "float a = 3; float b = 4; float x = " + std::string(5000, '(') + "a - b" + std::string(5000, ')') + ";\n";
+
+	try {
+		for (const std::string* input : { &flat, &nested }) {
+			for (bool recursive : { true, false }) {
+				Environment library;
+				auto start = std::chrono::steady_clock::now();
+				Lexer lexer(*input);
+				ParserOptions options;
+				options.recursiveExpressions = recursive;
+				ASTNode* root = Parser(lexer, library, options).parse();
+				auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+				std::cout << (input == &flat ? "Flat" : "Nested") << (recursive ? " recursive" : " precedence")
+					<< " parse took " << elapsed.count() << " ms" << std::endl;
+				delete root;
+			}
+		}
+
+		// Nesting deeper than the call stack allows for recursion
+		std::string input = flat + "x = " + std::string(100000, '(') + "a - b" + std::string(100000, ')') + ";\n";
+		input += "print(x);\n";
+		Lexer lexer(input);
+		Parser parser(lexer, env);
+		auto start = std::chrono::steady_clock::now();
+		ASTNode* root = parser.parse();
+		auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+		std::cout << "Deep nesting parse took " << elapsed.count() << " ms" << std::endl;
+
+		root->evaluate(env);
+		delete root;
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+	}
+
+	return 0;
+}
+
+int test12() {
+	Environment env;
+
+	// Register a built-in print function
+	env.registerFunction("print", [](const std::vector<double>& args) -> double {
+		if (args.size() != 1) {
+			throw std::runtime_error("print expects 1 argument");
+		}
+		std::cout << "Print from script: " << args[0] << std::endl;
+		return 0;
+		});
+
+	// Script streamed in tiny chunks so tokens and function bodies span chunk boundaries
+	std::istringstream input(R"(
+		func int scaled(int value) { /* multi-line
+			comment */ return value * 1000; }
+		int total = 0;
+		while (total < 3) { total = total + 1; }
+		print(scaled(total) + 0.25);
+    )");
+
+	StreamChunkReader reader(input);
+	Lexer lexer(reader, 5);
+	Parser parser(lexer, env, { true });
+
+	try {
+		ASTNode* root = parser.parse();
+		root->evaluate(env);
+		delete root;
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+	}
+
+	return 0;
+}
+
+int test13() {
+	Environment env;
+
+	// Register a built-in print function
+	env.registerFunction("print", [](const std::vector<double>& args) -> double {
+		if (args.size() != 1) {
+			throw std::runtime_error("print expects 1 argument");
+		}
+		std::cout << "Print from script: " << args[0] << std::endl;
+		return 0;
+		});
+
+	// Script loaded from a memory-mapped file
+	std::string path = "vfScript_test13.vf";
+	{
+		std::ofstream file(path, std::ios::binary);
+		file << "func int half(int n) { return n / 2; }\nint x = 84;\nprint(half(x));\n";
+	}
+
+	try {
+		ASTNode* root = loadScript(path, env, { true });
+		root->evaluate(env);
+		delete root;
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+	}
+
+	std::remove(path.c_str());
+	return 0;
+}
+
+int test14() {
+	// Same loop-heavy script evaluated by the pointer tree and by its flat copy
+	std::string input = R"(
+		float sum = 0;
+		int i = 0;
+		while (i < 200000) {
+			if (i / 2 > 100 && !(i == 7)) { sum = sum + i * 0.5 - (i - 1) / 4; } else { sum = sum - 1; }
+			i = i + 1;
+		}
+	)";
+
+	try {
+		Environment treeEnv;
+		Lexer lexer(input);
+		Parser parser(lexer, treeEnv);
+		ASTNode* root = parser.parse();
+		FlatAST flat(root);
+
+		auto start = std::chrono::steady_clock::now();
+		root->evaluate(treeEnv);
+		auto treeTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+
+		Environment flatEnv;
+		start = std::chrono::steady_clock::now();
+		flat.evaluate(flatEnv);
+		auto flatTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+
+		std::cout << "Tree: " << treeTime.count() << " ms, " << flat.getTreeMemoryBytes() / flat.getNodeCount()
+			<< " bytes/node; flat: " << flatTime.count() << " ms, " << flat.getMemoryBytes() / flat.getNodeCount()
+			<< " bytes/node; sums " << treeEnv.getVariable("sum") << " / " << flatEnv.getVariable("sum") << std::endl;
+		delete root;
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+	}
+
+	return 0;
+}
+
+int test15() {
+	// Same loop-heavy script evaluated by the tree walker and by its compiled closures
+	std::string input = R"(
+		float sum = 0;
+		int i = 0;
+		while (i < 200000) {
+			if (i / 2 > 100 && !(i == 7)) { sum = sum + i * 0.5 - (i - 1) / 4; } else { sum = sum - 1; }
+			i = i + 1;
+		}
+	)";
+
+	try {
+		Environment treeEnv;
+		Lexer lexer(input);
+		Parser parser(lexer, treeEnv);
+		ASTNode* root = parser.parse();
+		ClosureProgram program(root);
+
+		auto start = std::chrono::steady_clock::now();
+		root->evaluate(treeEnv);
+		auto treeTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+
+		Environment closureEnv;
+		start = std::chrono::steady_clock::now();
+		program.evaluate(closureEnv);
+		auto closureTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+
+		std::cout << "Tree: " << treeTime.count() << " ms; closures: " << closureTime.count() << " ms ("
+			<< program.getClosureCount() << " closures); sums " << treeEnv.getVariable("sum") << " / "
+			<< closureEnv.getVariable("sum") << std::endl;
+		delete root;
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+	}
+
+	return 0;
+}
+
+int test16() {
+	// Ahead-of-time translation of a script to C++ (see --emit-cpp)
+	std::string input = R"(
+		func int square(int n) { return n * n; }
+		int total = 0;
+		int i = 0;
+		while (i < 4) { total = total + square(i); i = i + 1; }
+		if (total > 0) {
+			func int cube(int n) { return n * square(n); }
+		}
+		print(total + cube(2));
+	)";
+
+	try {
+		Environment env;
+		Lexer lexer(input);
+		Parser parser(lexer, env);
+		ASTNode* root = parser.parse();
+		CppEmitter emitter("rules");
+		std::cout << emitter.emit(root);
+		delete root;
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+	}
+
+	return 0;
+}
+
+// vfScript --emit-cpp <script> [output]: translate a script to a C++ header
+int emitCpp(const std::string& scriptPath, const std::string& outputPath) {
+	try {
+		// The namespace is named after the script file
+		std::string stem = scriptPath.substr(scriptPath.find_last_of("/\\") + 1);
+		stem = stem.substr(0, stem.find('.'));
+		std::string namespaceName = "vfscript_";
+		for (char c : stem) {
+			namespaceName += std::isalnum(static_cast<unsigned char>(c)) ? c : '_';
+		}
+
+		Environment env;
+		ASTNode* root = loadScript(scriptPath, env);
+		std::string source = CppEmitter(namespaceName).emit(root);
+		delete root;
+
+		if (outputPath.empty()) {
+			std::cout << source;
+		}
+		else {
+			std::ofstream output(outputPath, std::ios::binary);
+			output << source;
+			if (!output) {
+				throw std::runtime_error("Cannot write " + outputPath);
+			}
+		}
+		return 0;
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+}
+
+int test17() {
+	// SSA optimizer and register VM against the tree walker on the loop benchmark
+	std::string input = R"(
+		func int half(int n) { return n / 2 + 0 * n; }
+		float sum = 0;
+		int i = 0;
+		while (i < 200000) {
+			if (half(i) > 100 && !(i == 7)) { sum = sum + i * 0.5 - (i - 1) / 4; } else { sum = sum - 1; }
+			if (2 > 3) { sum = 0; }
+			i = i + 1;
+		}
+	)";
+
+	try {
+		Environment treeEnv;
+		Lexer lexer(input);
+		Parser parser(lexer, treeEnv);
+		ASTNode* root = parser.parse();
+
+		auto start = std::chrono::steady_clock::now();
+		root->evaluate(treeEnv);
+		auto treeTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+
+		Compiler compiler;
+		CompiledProgram program = compiler.compile(root);
+		Environment vmEnv;
+		VirtualMachine vm(vmEnv);
+		start = std::chrono::steady_clock::now();
+		vm.run(program);
+		auto vmTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+
+		std::string dump = compiler.getIRDump();
+		std::cout << dump.substr(dump.find("function half")) << compiler.getStats().report();
+		std::cout << "Tree: " << treeTime.count() << " ms; VM: " << vmTime.count() << " ms; sums "
+			<< treeEnv.getVariable("sum") << " / " << vmEnv.getVariable("sum") << std::endl;
+		delete root;
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+	}
+
+	return 0;
+}
+
+int test18() {
+	// Dead code elimination on the tree: constant branches, unused locals and
+	// pure native calls go away, the impure log() call stays
+	std::string input = R"(
+		func float step(float x) {
+			{
+				float unused = sqrt(x) * 2;
+				float scaled = x * 3;
+				unused = scaled + 1;
+				if (0) { x = x / 0; }
+				log(x);
+				sqrt(x + 1);
+				total = total + x * 2;
+			}
+		}
+		float total = 0;
+		int i = 0;
+		while (i < 100000) {
+			step(i);
+			if (1 - 1) { total = 0; } else { i = i + 1; }
+		}
+	)";
+
+	try {
+		auto runScript = [&](bool optimize, OptimizerStats& stats, int& logged) {
+			Environment env;
+			env.registerFunction("sqrt", [](const std::vector<double>& args) { return std::sqrt(args[0]); }, true);
+			env.registerFunction("log", [&logged](const std::vector<double>&) { ++logged; return 0.0; });
+			Lexer lexer(input);
+			Parser parser(lexer, env);
+			ASTNode* root = parser.parse();
+			if (optimize) {
+				DeadCodeEliminator(env, stats).run(root);
+			}
+			auto start = std::chrono::steady_clock::now();
+			root->evaluate(env);
+			auto time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+			std::cout << (optimize ? "Optimized: " : "Original: ") << time.count() << " ms, total "
+				<< env.getVariable("total") << ", " << logged << " log calls" << std::endl;
+			delete root;
+		};
+
+		OptimizerStats stats;
+		int logged = 0;
+		runScript(false, stats, logged);
+		logged = 0;
+		runScript(true, stats, logged);
+		std::cout << stats.report();
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+	}
+
+	return 0;
+}
+
+int test19() {
+	// Counted loops: i * 3 becomes an induction variable of its own and the
+	// latch compiles to a single looplt/loople instruction
+	std::string input = R"(
+		float total = 0;
+		func int accumulate(int n) {
+			{
+				float sum = 0;
+				for (int i = 1; i <= n; i = i + 1) {
+					sum = sum + i * 3;
+				}
+				total = total + sum;
+			}
+		}
+		int round = 0;
+		while (round < 20) {
+			accumulate(10000);
+			round = round + 1;
+		}
+	)";
+
+	try {
+		Environment treeEnv;
+		Lexer lexer(input);
+		Parser parser(lexer, treeEnv);
+		ASTNode* root = parser.parse();
+
+		auto start = std::chrono::steady_clock::now();
+		root->evaluate(treeEnv);
+		auto treeTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+
+		double times[2];
+		double totals[2];
+		for (int optimize = 0; optimize < 2; ++optimize) {
+			Compiler compiler(CompilerOptions{ optimize != 0 });
+			CompiledProgram program = compiler.compile(root);
+			Environment vmEnv;
+			VirtualMachine vm(vmEnv);
+			start = std::chrono::steady_clock::now();
+			vm.run(program);
+			times[optimize] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			totals[optimize] = vmEnv.getVariable("total");
+			if (optimize) {
+				std::string code = program.disassemble();
+				std::cout << code.substr(code.find("function accumulate")) << compiler.getStats().report();
+			}
+		}
+		std::cout << "Tree: " << treeTime.count() << " ms; VM: " << times[0] << " ms; optimized VM: " << times[1]
+			<< " ms; totals " << treeEnv.getVariable("total") << " / " << totals[0] << " / " << totals[1] << std::endl;
+		delete root;
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+	}
+
+	return 0;
+}
+
+int test20() {
+	// Loop unrolling: the four-iteration inner loop is replaced by straight-line
+	// code; the loop over n keeps running, four copies of its body per test
+	std::string input = R"(
+		float total = 0;
+		func int weigh(int n) {
+			{
+				float sum = 0;
+				float x = 0;
+				int k = 0;
+				for (int i = 0; i < n; i = i + 1) {
+					x = i;
+					for (k = 0; k < 4; k = k + 1) {
+						x = x * 0.5 + k;
+					}
+					sum = sum + x;
+				}
+				total = total + sum;
+			}
+		}
+		func int count(int n) {
+			{
+				float sum = 0;
+				for (int i = 0; i < n; i = i + 1) {
+					sum = sum + i;
+				}
+				total = total + sum;
+			}
+		}
+		int round = 0;
+		while (round < 20) {
+			weigh(1001);
+			count(10003);
+			round = round + 1;
+		}
+	)";
+
+	try {
+		Environment treeEnv;
+		Lexer lexer(input);
+		Parser parser(lexer, treeEnv);
+		ASTNode* root = parser.parse();
+
+		auto start = std::chrono::steady_clock::now();
+		root->evaluate(treeEnv);
+		auto treeTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+
+		double times[2];
+		double totals[2];
+		for (int optimize = 0; optimize < 2; ++optimize) {
+			Compiler compiler(CompilerOptions{ optimize != 0 });
+			CompiledProgram program = compiler.compile(root);
+			Environment vmEnv;
+			VirtualMachine vm(vmEnv);
+			start = std::chrono::steady_clock::now();
+			vm.run(program);
+			times[optimize] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			totals[optimize] = vmEnv.getVariable("total");
+			if (optimize) {
+				std::cout << compiler.getStats().report();
+			}
+		}
+		std::cout << "Tree: " << treeTime.count() << " ms; VM: " << times[0] << " ms; optimized VM: " << times[1]
+			<< " ms; totals " << treeEnv.getVariable("total") << " / " << totals[0] << " / " << totals[1] << std::endl;
+		delete root;
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+	}
+
+	return 0;
+}
+
+int test21() {
+	// Quickening: the int loop settles on int forms that also cover the int
+	// check of their result, the float loop on float forms, and the site in
+	// mix deoptimizes once its operands stop being ints
+	std::string input = R"(
+		float total = 0;
+		func int ints(int n) {
+			{
+				int sum = 0;
+				for (int i = 0; i < n; i = i + 1) {
+					sum = sum + i - 2;
+				}
+				total = total + sum;
+			}
+		}
+		func int floats(int n) {
+			{
+				float x = 0.5;
+				for (int i = 0; i < n; i = i + 1) {
+					x = x * 0.999 + 0.25;
+				}
+				total = total + x;
+			}
+		}
+		func int mix(float step) {
+			{
+				float sum = 0;
+				for (int i = 0; i < 100; i = i + 1) {
+					sum = sum + step;
+				}
+				total = total + sum;
+			}
+		}
+		mix(2);
+		mix(0.5);
+		int round = 0;
+		while (round < 20) {
+			ints(10000);
+			floats(10000);
+			round = round + 1;
+		}
+	)";
+
+	try {
+		Lexer lexer(input);
+		Environment parseEnv;
+		Parser parser(lexer, parseEnv);
+		ASTNode* root = parser.parse();
+		Compiler compiler;
+		CompiledProgram program = compiler.compile(root);
+
+		double times[2];
+		double totals[2];
+		for (int quicken = 0; quicken < 2; ++quicken) {
+			Environment vmEnv;
+			VirtualMachine vm(vmEnv, quicken != 0);
+			auto start = std::chrono::steady_clock::now();
+			vm.run(program);
+			times[quicken] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			totals[quicken] = vmEnv.getVariable("total");
+			if (quicken) {
+				std::cout << vm.getQuickeningStats().report();
+			}
+		}
+		std::cout << "VM: " << times[0] << " ms; quickened VM: " << times[1] << " ms; totals "
+			<< totals[0] << " / " << totals[1] << std::endl;
+		delete root;
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+	}
+
+	// Values outside int range, infinities and NaN fail the int check in the
+	// tree walker and in both VMs, including after the int forms settled
+	for (const char* overflow : { "int big = 1; for (int i = 0; i < 40; i = i + 1) { big = big + big; }",
+		"float huge = 1000000000; for (int i = 0; i < 6; i = i + 1) { huge = huge * huge; } int n = huge;",
+		"float huge = 1000000000; for (int i = 0; i < 6; i = i + 1) { huge = huge * huge; } int n = huge - huge;" }) {
+		Lexer lexer{ std::string(overflow) };
+		Environment parseEnv;
+		ASTNode* root = Parser(lexer, parseEnv).parse();
+		CompiledProgram program = Compiler().compile(root);
+		for (int mode = 0; mode < 3; ++mode) {
+			try {
+				Environment env;
+				if (mode == 0) {
+					root->evaluate(env);
+				}
+				else {
+					VirtualMachine(env, mode == 2).run(program);
+				}
+				std::cout << "Accepted out-of-range int" << std::endl;
+			}
+			catch (const std::exception& e) {
+				std::cout << (mode == 0 ? "Tree" : mode == 1 ? "VM" : "Quickened VM") << " rejected: " << e.what() << std::endl;
+			}
+		}
+		delete root;
+	}
+
+	return 0;
+}
+
+int test22() {
+	// Inline caches: each call site looks its target up once, and again only
+	// after the registry changes. A native registered under the name of a
+	// script function then shadows it, as in the tree walker.
+	std::string input = R"(
+		float total = 0;
+		func int scale(float x) {
+			total = total + x;
+		}
+		func int repeat(int n) {
+			{
+				int i = 0;
+				while (i < n) {
+					total = total + half(i);
+					scale(1);
+					i = i + 1;
+				}
+			}
+		}
+	)";
+
+	try {
+		Lexer lexer(input);
+		Environment parseEnv;
+		Parser parser(lexer, parseEnv);
+		ASTNode* root = parser.parse();
+		CompiledProgram program = Compiler().compile(root);
+
+		Environment vmEnv;
+		vmEnv.registerFunction("half", [](const std::vector<double>& args) { return args[0] / 2; }, true);
+		VirtualMachine vm(vmEnv);
+		vm.run(program);
+
+		auto start = std::chrono::steady_clock::now();
+		vm.call(program, "repeat", { 100000 });
+		auto time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+		std::cout << "Script scale: " << time.count() << " ms, total " << vmEnv.getVariable("total")
+			<< ", " << vm.getCallCacheMisses() << " lookups" << std::endl;
+
+		vmEnv.registerFunction("scale", [&](const std::vector<double>& args) {
+			vmEnv.setVariable("total", vmEnv.getVariable("total") + 2 * args[0]);
+			return 0.0;
+		});
+		start = std::chrono::steady_clock::now();
+		vm.call(program, "repeat", { 100000 });
+		time = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+		std::cout << "Native scale: " << time.count() << " ms, total " << vmEnv.getVariable("total")
+			<< ", " << vm.getCallCacheMisses() << " lookups" << std::endl;
+		delete root;
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+	}
+
+	return 0;
+}
+
+int test23() {
+	// Memoized functions: results are cached in the Environment by argument,
+	// which turns the exponential fib into a linear one in both the tree
+	// walker and the VM. Memo functions that could see more than their
+	// arguments are rejected.
+	std::string plain = R"(
+		func int fib(int n) {
+			if (n < 2) return n; else return fib(n - 1) + fib(n - 2);
+		}
+		float result = fib(24);
+	)";
+	std::string memo = R"(
+		func memo int fib(int n) {
+			if (n < 2) return n; else return fib(n - 1) + fib(n - 2);
+		}
+		float result = fib(24);
+	)";
+
+	for (int memoized = 0; memoized < 2; ++memoized) {
+		const std::string& input = memoized ? memo : plain;
+		try {
+			Environment env;
+			Lexer lexer(input);
+			Parser parser(lexer, env);
+			ASTNode* root = parser.parse();
+
+			auto start = std::chrono::steady_clock::now();
+			root->evaluate(env);
+			auto treeTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+
+			CompiledProgram program = Compiler().compile(root);
+			Environment vmEnv;
+			VirtualMachine vm(vmEnv);
+			start = std::chrono::steady_clock::now();
+			vm.run(program);
+			auto vmTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+
+			std::cout << (memoized ? "memo fib: " : "fib: ") << env.getVariable("result") << " / "
+				<< vmEnv.getVariable("result") << "; tree " << treeTime.count() << " ms, VM " << vmTime.count()
+				<< " ms; cache hits " << env.getMemoStats().hits << " / " << vmEnv.getMemoStats().hits
+				<< ", misses " << env.getMemoStats().misses << " / " << vmEnv.getMemoStats().misses << std::endl;
+			delete root;
+		}
+		catch (const std::exception& e) {
+			std::cerr << "Error: " << e.what() << std::endl;
+		}
+	}
+
+	// Memo functions may call memo functions defined later in the script, and
+	// the parallel parser accepts them like the sequential one
+	std::string chained = R"(
+		func memo float twice(float n) { return fib(n) * 2; }
+		func memo float fib(float n) {
+			if (n < 2) return n; else return fib(n - 1) + fib(n - 2);
+		}
+		float doubled = twice(20);
+	)";
+	for (int parallel = 0; parallel < 2; ++parallel) {
+		try {
+			Environment env;
+			ASTNode* root = nullptr;
+			if (parallel) {
+				root = ParallelParser(env, 4).parse(chained);
+			}
+			else {
+				Lexer lexer(chained);
+				root = Parser(lexer, env).parse();
+			}
+			root->evaluate(env);
+			std::cout << (parallel ? "Parallel" : "Sequential") << " memo twice: " << env.getVariable("doubled") << std::endl;
+			delete root;
+		}
+		catch (const std::exception& e) {
+			std::cerr << "Error: " << e.what() << std::endl;
+		}
+	}
+
+	for (const char* input : { "func memo int logged(int n) { return print(n); }",
+		"float scale = 2; func pure float scaled(float x) { return x * scale; }" }) {
+		try {
+			Environment env;
+			env.registerFunction("print", [](const std::vector<double>& args) { return args[0]; });
+			Lexer lexer{ std::string(input) };
+			Parser parser(lexer, env);
+			delete parser.parse();
+		}
+		catch (const std::exception& e) {
+			std::cout << "Rejected: " << e.what() << std::endl;
+		}
+	}
+
+	return 0;
+}
+
+int test24() {
+	// Specialization: with debug, mode and scale bound, the configuration
+	// checks fold away and the loop keeps only the mode 2 arithmetic
+	std::string input = R"(
+		float total = 0;
+		func int work(int n) {
+			{
+				int i = 0;
+				while (i < n) {
+					if (debug) {
+						total = total + trace(i);
+					}
+					if (mode == 2) {
+						total = total + i * scale;
+					}
+					else {
+						total = total + i;
+					}
+					i = i + 1;
+				}
+			}
+		}
+		work(100000);
+	)";
+
+	try {
+		Environment parseEnv;
+		Lexer lexer(input);
+		Parser parser(lexer, parseEnv);
+		ASTNode* root = parser.parse();
+		ProgramSpecializer specializer(root);
+		std::map<std::string, double> configuration = { { "debug", 0 }, { "mode", 2 }, { "scale", 3 } };
+
+		double times[2];
+		double totals[2];
+		for (int specialized = 0; specialized < 2; ++specialized) {
+			const CompiledProgram& program = specialized ? specializer.specialize(configuration) : specializer.specialize({});
+			Environment vmEnv;
+			vmEnv.registerFunction("trace", [](const std::vector<double>& args) { return args[0]; });
+			for (const auto& [name, value] : configuration) {
+				vmEnv.declareVariable(name, ValueType::FLOAT);
+				vmEnv.setVariable(name, value);
+			}
+			VirtualMachine vm(vmEnv);
+			auto start = std::chrono::steady_clock::now();
+			vm.run(program);
+			times[specialized] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			totals[specialized] = vmEnv.getVariable("total");
+		}
+		specializer.specialize(configuration);
+		std::cout << "IR instructions: " << specializer.getStats({}).instructionsAfter << " generic, "
+			<< specializer.getStats(configuration).instructionsAfter << " specialized; "
+			<< specializer.getCompilations() << " compilations, " << specializer.getCacheHits() << " cache hit" << std::endl;
+		std::cout << "Generic: " << times[0] << " ms; specialized: " << times[1] << " ms; totals "
+			<< totals[0] << " / " << totals[1] << std::endl;
+
+		try {
+			specializer.specialize({ { "total", 1 } });
+		}
+		catch (const std::exception& e) {
+			std::cout << "Rejected: " << e.what() << std::endl;
+		}
+		delete root;
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+	}
+
+	return 0;
+}
+
+int test25() {
+	// On-stack replacement: the long loops switch from the tree walker to
+	// compiled code part way through a run and finish on the same variables
+	std::string input = R"(
+		float total = 0;
+		int i = 0;
+		func float sum(int n) {
+			{
+				float s = 0;
+				for (int k = 0; k < n; k = k + 1) {
+					s = s + k * 0.5;
+				}
+				return s;
+			}
+		}
+		while (i < 200000) {
+			total = total + mod(i, 7);
+			i = i + 1;
+		}
+		total = total + sum(50000) + sum(50000) + sum(10);
+	)";
+
+	double times[2];
+	double totals[2];
+	for (int tiered = 0; tiered < 2; ++tiered) {
+		try {
+			Environment env;
+			env.registerFunction("mod", [](const std::vector<double>& args) { return std::fmod(args[0], args[1]); }, true);
+			Lexer lexer(input);
+			Parser parser(lexer, env);
+			ASTNode* root = parser.parse();
+			std::unique_ptr<LoopTiering> tiering;
+			if (tiered) {
+				tiering = std::make_unique<LoopTiering>(env);
+			}
+			auto start = std::chrono::steady_clock::now();
+			root->evaluate(env);
+			times[tiered] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			totals[tiered] = env.getVariable("total");
+			if (tiering) {
+				std::cout << tiering->report();
+			}
+			delete root;
+		}
+		catch (const std::exception& e) {
+			std::cerr << "Error: " << e.what() << std::endl;
+		}
+	}
+	std::cout << "Tree walker: " << times[0] << " ms; with OSR: " << times[1] << " ms; totals "
+		<< totals[0] << " / " << totals[1] << std::endl;
+
+	return 0;
+}
+
+int test26() {
+	// Perf map: compiled functions are entered through trampolines named in
+	// /tmp/perf-<pid>.map, so `perf report` shows fib and inverse by name
+	std::string input = R"(
+		func int fib(int n) {
+			if (n < 2) return n; else return fib(n - 1) + fib(n - 2);
+		}
+
+		func float inverse(float x) {
+			return 1 / x;
+		}
+	)";
+
+	try {
+		Environment parseEnv;
+		Lexer lexer(input);
+		Parser parser(lexer, parseEnv);
+		ASTNode* root = parser.parse();
+		CompiledProgram program = Compiler().compile(root);
+
+		PerfMapOptions options;
+		options.jitdump = true;
+		PerfMap perfMap(options);
+		Environment vmEnv;
+		VirtualMachine vm(vmEnv);
+		vm.setPerfMap(&perfMap, "test26.vf", input);
+		std::cout << "fib(20) = " << vm.call(program, "fib", { 20 }) << std::endl;
+		try {
+			vm.call(program, "inverse", { 0 });
+		}
+		catch (const std::exception& e) {
+			std::cout << "inverse(0): " << e.what() << std::endl;  // Thrown through the trampoline
+		}
+
+		if (perfMap.isEnabled()) {
+			std::cout << perfMap.getEntries() << " perf map entries in " << perfMap.getMapPath() << ":" << std::endl;
+			std::ifstream map(perfMap.getMapPath());
+			std::string line;
+			while (std::getline(map, line)) {
+				std::cout << "  " << line.substr(line.find(' ', line.find(' ') + 1) + 1) << std::endl;
+			}
+			if (!perfMap.getJitdumpPath().empty()) {
+				std::cout << "jitdump: " << perfMap.getJitdumpPath() << std::endl;
+			}
+		}
+		else {
+			std::cout << "Perf map unavailable; functions are called directly" << std::endl;
+		}
+		delete root;
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+	}
+
+	return 0;
+}
+
+int test27() {
+	// Hardware counters per execution and per compiled function. Without a
+	// PMU (e.g. in a VM) only task-clock is counted; without perf events at
+	// all the profile says why and the program runs as usual.
+	std::string input = R"(
+		func float mix(float x) {
+			if (x > 0.5) return x * 3; else return x + 1;
+		}
+		func float walk(int n) {
+			{
+				float s = 0;
+				int i = 0;
+				while (i < n) {
+					s = s + mix(i / n);
+					i = i + 1;
+				}
+				total = total + s;
+			}
+		}
+		float total = 0;
+		walk(20000);
+		walk(5000);
+	)";
+
+	try {
+		Environment parseEnv;
+		Lexer lexer(input);
+		Parser parser(lexer, parseEnv);
+		ASTNode* root = parser.parse();
+		CompiledProgram program = Compiler().compile(root);
+
+		HardwareCounters counters;
+		CounterProfile profile(counters);
+		Environment vmEnv;
+		VirtualMachine vm(vmEnv);
+		vm.setCounterProfile(&profile);
+		vm.run(program);
+		std::cout << "total = " << vmEnv.getVariable("total") << std::endl;
+		std::cout << profile.report();
+		delete root;
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+	}
+
+	return 0;
+}
+
+int test28() {
+	// Metrics: four threads run the same program on their own machines and
+	// record into one registry; the snapshot merges their shards
+	std::string input = R"(
+		func float norm(float x, float y) {
+			return sqrt(x * x + y * y);
+		}
+		float total = 0;
+		int i = 0;
+		while (i < 1000) {
+			total = total + norm(i, 1);
+			i = i + 1;
+		}
+	)";
+
+	try {
+		MetricsRegistry registry;
+		EngineMetrics metrics(registry);
+		Environment parseEnv;
+		Lexer lexer(input);
+		Parser parser(lexer, parseEnv);
+		ASTNode* root = parser.parse();
+		CompilerOptions options;
+		options.metrics = &metrics;
+		CompiledProgram program = Compiler(options).compile(root);
+
+		std::vector<std::thread> threads;
+		for (int t = 0; t < 4; ++t) {
+			threads.emplace_back([&]() {
+				Environment env;
+				env.registerFunction("sqrt", [](const std::vector<double>& args) { return std::sqrt(args[0]); }, true);
+				VirtualMachine vm(env);
+				vm.setMetrics(&metrics);
+				for (int run = 0; run < 5; ++run) {
+					vm.call(program, "norm", { 3, 4 });
+				}
+				vm.run(program);
+			});
+		}
+		for (std::thread& thread : threads) {
+			thread.join();
+		}
+
+		std::istringstream text(registry.prometheus());
+		std::string line;
+		while (std::getline(text, line)) {
+			if (line.find("_bucket") == std::string::npos && line.find("_sum") == std::string::npos) {
+				std::cout << line << std::endl;
+			}
+		}
+		delete root;
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+	}
+
+	return 0;
+}
+
+int test29() {
+	// Execution hooks: the tree walker and the VM report the same statements
+	// and calls; the VM only runs its traced build while hooks are set
+	std::string input = R"(
+		func int square(int x) {
+			return x * x;
+		}
+		int total = 0;
+		int i = 0;
+		while (i < 3) {
+			total = total + square(i);
+			i = i + 1;
+		}
+		log(total);
+	)";
+
+	struct Tracer : ExecutionHooks {
+		std::vector<size_t> lines;
+		std::map<size_t, size_t> statements;  // By line
+		std::vector<std::string> calls;
+
+		void onStatement(size_t offset) override {
+			++statements[std::upper_bound(lines.begin(), lines.end(), offset) - lines.begin()];
+		}
+		void onFunctionEnter(const std::string& name, const std::vector<double>& args) override {
+			calls.push_back(name + "(" + std::to_string(static_cast<int>(args[0])) + ")");
+		}
+		void onNativeExit(const std::string& name, double /*result*/, bool threw) override {
+			calls.push_back(name + (threw ? " threw" : " returned"));
+		}
+		void print(const char* tier) const {
+			std::cout << tier << ": statements by line";
+			for (const auto& [line, count] : statements) {
+				std::cout << " " << line << ":" << count;
+			}
+			std::cout << "; calls";
+			for (const std::string& call : calls) {
+				std::cout << " " << call;
+			}
+			std::cout << std::endl;
+		}
+	};
+
+	try {
+		auto log = [](const std::vector<double>& args) { return args[0]; };
+		Tracer walked;
+		walked.lines = PerfMap::lineStarts(input);
+		Environment env;
+		env.registerFunction("log", log);
+		env.setHooks(&walked);
+		Lexer lexer(input);
+		Parser parser(lexer, env);
+		ASTNode* root = parser.parse();
+		root->evaluate(env);
+		walked.print("tree walker");
+
+		Tracer compiled;
+		compiled.lines = walked.lines;
+		Environment vmEnv;
+		vmEnv.registerFunction("log", log);
+		vmEnv.setHooks(&compiled);
+		CompilerOptions options;
+		options.statementMarkers = true;
+		CompiledProgram program = Compiler(options).compile(root);
+		VirtualMachine vm(vmEnv);
+		vm.run(program);
+		compiled.print("vm");
+		delete root;
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+	}
+
+	return 0;
+}
+
+int test30() {
+	// Trace recorder: two threads record calls into their own ring buffers,
+	// the trace is flushed while they run and read back as the vfTrace tool does
+	std::string input = R"(
+		func float scale(float x) {
+			return lookup(x) * 2;
+		}
+		float total = 0;
+		int i = 0;
+		while (i < 500) {
+			total = total + scale(i);
+			i = i + 1;
+		}
+	)";
+
+	try {
+		TraceRecorder recorder(1024);  // Small, so that the oldest calls are overwritten
+		Environment parseEnv;
+		Lexer lexer(input);
+		Parser parser(lexer, parseEnv);
+		ASTNode* root = parser.parse();
+		CompiledProgram program = Compiler().compile(root);
+
+		std::vector<std::thread> threads;
+		for (int t = 0; t < 2; ++t) {
+			threads.emplace_back([&]() {
+				Environment env;
+				env.registerFunction("lookup", [](const std::vector<double>& args) { return args[0] + 1; });
+				env.setHooks(&recorder);
+				VirtualMachine vm(env);
+				vm.run(program);
+			});
+		}
+		// Flushes are safe while the threads record, and keep only whole records:
+		// every call passes an integer below 500 and returns lookup(x) = x + 1,
+		// scale(x) = 2 * (x + 1)
+		auto isWhole = [](const TraceFile& trace, const TraceEvent& event) {
+			const std::string& name = trace.names[event.name];
+			if (event.isNative() != (name == "lookup") || (name != "lookup" && name != "scale")) {
+				return false;
+			}
+			double value = event.isEnter() ? (event.args.size() == 1 ? event.args[0] : -1)
+				: (name == "scale" ? event.result / 2 : event.result) - 1;
+			return !event.threw && value >= 0 && value < 500 && value == std::floor(value);
+		};
+		size_t partialRecords = 0;
+		size_t tornRecords = 0;
+		for (int flush = 0; flush < 20; ++flush) {
+			recorder.flush("vf_trace_partial.bin");
+			TraceFile partial = TraceFile::read("vf_trace_partial.bin");
+			for (const TraceFile::Thread& thread : partial.threads) {
+				for (size_t i = 0; i < thread.events.size(); ++i) {
+					++partialRecords;
+					tornRecords += !isWhole(partial, thread.events[i]) || (i > 0 && thread.events[i].time < thread.events[i - 1].time);
+				}
+			}
+		}
+		for (std::thread& thread : threads) {
+			thread.join();
+		}
+		recorder.flush("vf_trace.bin");
+		std::cout << "Flushed while recording: " << partialRecords << " records read back, " << tornRecords << " torn" << std::endl;
+
+		TraceFile trace = TraceFile::read("vf_trace.bin");
+		std::cout << "Trace: " << recorder.getRecords() << " records, " << trace.dropped() << " overwritten" << std::endl;
+		for (const TraceFile::Thread& thread : trace.threads) {
+			auto last = std::find_if(thread.events.rbegin(), thread.events.rend(), [](const TraceEvent& event) {
+				return event.kind == TraceEvent::Kind::FUNCTION_ENTER;
+			});
+			std::cout << "  thread " << thread.id << ": " << thread.events.size() << " kept, last enter "
+				<< trace.names[last->name] << "(" << last->args[0] << ")" << std::endl;
+		}
+		std::remove("vf_trace_partial.bin");
+		std::remove("vf_trace.bin");
+		delete root;
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+	}
+
+	return 0;
+}
+
+int test31() {
+	// Native record/replay: a run records what the natives returned, and a
+	// replay of the saved recording runs the script without calling the host
+	std::string input = R"(
+		float total = 0;
+		int i = 0;
+		while (i < 100) {
+			total = total + fetch(i) * rate(2);
+			i = i + 1;
+		}
+	)";
+
+	try {
+		Environment parseEnv;
+		Lexer lexer(input);
+		Parser parser(lexer, parseEnv);
+		ASTNode* root = parser.parse();
+		CompiledProgram program = Compiler().compile(root);
+
+		double recordedTotal;
+		{
+			int requests = 0;  // The host service
+			NativeCallLog log;
+			Environment env;
+			log.registerFunction(env, "fetch", [&](const std::vector<double>& args) { return args[0] + (++requests % 7); });
+			log.registerFunction(env, "rate", [](const std::vector<double>& args) { return args[0] / 4; }, true);
+			VirtualMachine vm(env);
+			vm.run(program);
+			recordedTotal = env.getVariable("total");
+			log.save("vf_natives.bin");
+			std::cout << "Recorded " << log.getCalls() << " calls, " << log.getPureResults() << " pure results" << std::endl;
+		}
+
+		NativeCallLog replay = NativeCallLog::load("vf_natives.bin");
+		Environment env;
+		auto unreachable = [](const std::vector<double>&) -> double { throw std::runtime_error("Host called in replay"); };
+		replay.registerFunction(env, "fetch", unreachable);
+		replay.registerFunction(env, "rate", unreachable, true);
+		root->evaluate(env);  // The tree walker replays what the VM recorded
+		std::cout << "Replayed " << replay.getReplayed() << " calls" << (replay.isComplete() ? ", complete" : "")
+			<< "; total " << env.getVariable("total") << (env.getVariable("total") == recordedTotal ? " matches" : " differs")
+			<< std::endl;
+		std::remove("vf_natives.bin");
+		delete root;
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+	}
+
+	return 0;
+}
+
+int test32() {
+	// Coverage: the VM marks a bitmap from code compiled for it, the tree
+	// walker reports to the same layout through the hooks, and both agree
+	std::string input = R"(
+		func float clamp(float x) {
+			if (x > 10) {
+				return 10;
+			} else {
+				return x;
+			}
+		}
+		float total = 0;
+		int i = 0;
+		while (i < 5) {
+			total = total + clamp(i * 3);
+			i = i + 1;
+		}
+		if (total < 0) {
+			total = 0;
+		}
+		for (int j = 0; j < 0; j = j + 1) {
+			total = total + 1;
+		}
+	)";
+
+	try {
+		Environment env;
+		Lexer lexer(input);
+		Parser parser(lexer, env);
+		ASTNode* root = parser.parse();
+		ProgramCoverage coverage(root);
+
+		CompilerOptions options;
+		options.coverage = &coverage;
+		CompiledProgram program = Compiler(options).compile(root);
+		VirtualMachine vm(env);
+		ProgramCoverage compiled = coverage;  // A copy shares the layout
+		vm.setCoverage(&compiled);
+		vm.run(program);
+
+		// Slots go by source offset, so a second parse of the same text maps
+		// onto the same layout
+		Environment walkerEnv;
+		Lexer walkerLexer(input);
+		Parser walkerParser(walkerLexer, walkerEnv);
+		ASTNode* walkerRoot = walkerParser.parse();
+		walkerEnv.setHooks(&coverage);
+		walkerRoot->evaluate(walkerEnv);
+		walkerEnv.setHooks(nullptr);
+		delete walkerRoot;
+
+		std::cout << "Statements " << compiled.getCoveredStatements() << "/" << compiled.getStatements()
+			<< ", branches " << compiled.getCoveredBranches() << "/" << compiled.getBranches()
+			<< (compiled.getHits() == coverage.getHits() ? ", same as the tree walker" : ", differs from the tree walker")
+			<< std::endl;
+		coverage.merge(compiled);
+		std::string lcov = coverage.lcov("script.vf", input);
+		std::cout << lcov.substr(lcov.find("BRDA:"));
+		delete root;
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+	}
+
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	if (argc >= 3 && std::string(argv[1]) == "--emit-cpp") {
+		return emitCpp(argv[2], argc >= 4 ? argv[3] : "");
+	}
+
 	test1();
 	test2();
 	test3();
@@ -333,5 +1839,30 @@ int main() {
 	test5();
 	test6();
 	test7();
+	test8();
+	test9();
+	test10();
+	test11();
+	test12();
+	test13();
+	test14();
+	test15();
+	test16();
+	test17();
+	test18();
+	test19();
+	test20();
+	test21();
+	test22();
+	test23();
+	test24();
+	test25();
+	test26();
+	test27();
+	test28();
+	test29();
+	test30();
+	test31();
+	test32();
 }
 
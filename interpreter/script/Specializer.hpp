@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Compiler.hpp"
+
+// Compiles one script for sets of host constants: globals the host fixes for
+// the lifetime of a deployment (configuration flags, tenant settings) are
+// compiled as constants, so constant propagation folds the checks on them and
+// drops the branches they rule out. Each constant set is compiled once.
+class ProgramSpecializer {
+public:
+	// `root` must outlive the specializer
+	explicit ProgramSpecializer(const ASTNode* root, CompilerOptions options = {}) : root(root), options(std::move(options)) {}
+
+	// The program with `constants` bound. Throws if the script declares or
+	// assigns one of them. The reference stays valid for the specializer's lifetime.
+	const CompiledProgram& specialize(const std::map<std::string, double>& constants) {
+		Key key = keyOf(constants);
+		auto found = programs.find(key);
+		if (found != programs.end()) {
+			++hits;
+			return found->second.program;
+		}
+
+		CompilerOptions specialized = options;
+		for (const auto& [name, value] : constants) {
+			specialized.constants[name] = value;
+		}
+		Compiler compiler(specialized);
+		Specialization& result = programs[key];
+		try {
+			result.program = compiler.compile(root);
+		}
+		catch (...) {
+			programs.erase(key);
+			throw;
+		}
+		result.stats = compiler.getStats();
+		return result.program;
+	}
+
+	// Optimizer statistics of a constant set compiled before
+	const OptimizerStats& getStats(const std::map<std::string, double>& constants) const {
+		auto found = programs.find(keyOf(constants));
+		if (found == programs.end()) {
+			throw std::runtime_error("Constant set not specialized");
+		}
+		return found->second.stats;
+	}
+
+	size_t getCompilations() const {
+		return programs.size();
+	}
+
+	size_t getCacheHits() const {
+		return hits;
+	}
+
+private:
+	// Constants by name and bit pattern, so that 0 and -0 stay apart
+	using Key = std::vector<std::pair<std::string, uint64_t>>;
+
+	static Key keyOf(const std::map<std::string, double>& constants) {
+		Key key;
+		for (const auto& [name, value] : constants) {
+			uint64_t bits;
+			std::memcpy(&bits, &value, sizeof(bits));
+			key.emplace_back(name, bits);
+		}
+		return key;
+	}
+
+	struct Specialization {
+		CompiledProgram program;
+		OptimizerStats stats;
+	};
+
+	const ASTNode* root;
+	CompilerOptions options;
+	std::map<Key, Specialization> programs;
+	size_t hits = 0;
+};
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Compiler.hpp"
+#include "VirtualMachine.hpp"
+
+// Tiers loops that run hot in the tree walker up to the bytecode VM by
+// on-stack replacement. The tree walker keeps its variables in the
+// Environment, which compiled loop code reads and writes by name, so the
+// frame carries over as it is: the VM resumes the loop at its body and hands
+// back the loop value. A loop that only calls pure natives reads its
+// variables once on entry. Loops are compiled once per registry version, and
+// every switch is logged.
+class LoopTiering : public LoopTierUp {
+public:
+	// One switch of a loop run from the tree walker to compiled code
+	struct Transition {
+		size_t loop;        // Numbered in order of first tier-up
+		std::string kind;   // while, for or do-while
+		size_t iterations;  // Interpreted before the switch
+		double compileMs;   // 0 when the loop was compiled before
+		double runMs;       // Spent in compiled code, 0 if it threw
+	};
+
+	// Installs itself in `env` until destroyed
+	explicit LoopTiering(Environment& env, CompilerOptions options = {}, bool quicken = true)
+		: env(env), options(options), vm(env, quicken) {
+		env.setLoopTierUp(this);
+	}
+
+	~LoopTiering() {
+		if (env.getLoopTierUp() == this) {
+			env.setLoopTierUp(nullptr);
+		}
+	}
+
+	bool resume(const ASTNode* loop, Environment& loopEnv, double& value) override {
+		if (&loopEnv != &env) {
+			return false;
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		auto found = loops.find(loop);
+		if (found == loops.end()) {
+			found = loops.emplace(loop, CompiledLoop{ loops.size() + 1 }).first;
+		}
+		CompiledLoop& entry = found->second;
+		bool traced = env.getHooks() != nullptr;
+		bool compiled = entry.version != env.getRegistryVersion() || entry.statementMarkers != traced;
+		if (compiled) {
+			compile(loop, entry);
+		}
+		if (!entry.program) {
+			return false;
+		}
+		for (const std::string& name : entry.cached) {
+			if (!env.hasVariable(name)) {
+				return false;  // Left to the tree walker to report or skip
+			}
+		}
+
+		auto entered = std::chrono::steady_clock::now();
+		size_t index = transitions.size();
+		transitions.push_back({ entry.number, kindOf(loop), threshold,
+			compiled ? std::chrono::duration<double, std::milli>(entered - start).count() : 0, 0 });
+		value = vm.run(*entry.program);  // Loops tiering up inside add their own transitions
+		transitions[index].runMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - entered).count();
+		return true;
+	}
+
+	const std::vector<Transition>& getTransitions() const {
+		return transitions;
+	}
+
+	size_t getCompilations() const {
+		return compilations;
+	}
+
+	std::string report() const {
+		std::ostringstream out;
+		out << "Loop tier-ups: " << transitions.size() << " (" << compilations << " compilations, "
+			<< rejected << " rejected)\n";
+		for (const Transition& transition : transitions) {
+			out << "  loop " << transition.loop << " (" << transition.kind << ") after "
+				<< transition.iterations << " iterations: compile " << transition.compileMs
+				<< " ms, compiled run " << transition.runMs << " ms\n";
+		}
+		return out.str();
+	}
+
+private:
+	struct CompiledLoop {
+		size_t number = 0;
+		std::unique_ptr<CompiledProgram> program = nullptr;
+		uint64_t version = 0;               // Registry version the program was compiled at
+		std::set<std::string> cached = {};  // Variables the program loads once
+		bool statementMarkers = false;      // Compiled for execution hooks
+	};
+
+	// Calls decide which variables may be cached, so a loop is compiled again
+	// when the registry changes. While there are execution hooks, loops are
+	// compiled with statement markers so that the hooks see every statement.
+	void compile(const ASTNode* loop, CompiledLoop& entry) {
+		entry.version = env.getRegistryVersion();
+		entry.statementMarkers = env.getHooks() != nullptr;
+		entry.cached.clear();
+		if (!collectLoopVariables(loop, env, entry.cached)) {
+			entry.cached.clear();
+		}
+		try {
+			CompilerOptions loopOptions = options;
+			loopOptions.statementMarkers = loopOptions.statementMarkers || entry.statementMarkers;
+			entry.program = std::make_unique<CompiledProgram>(Compiler(loopOptions).compileLoopEntry(loop, entry.cached));
+			++compilations;
+		}
+		catch (const std::runtime_error&) {
+			entry.program.reset();  // Stays in the tree walker
+			++rejected;
+		}
+	}
+
+	static std::string kindOf(const ASTNode* loop) {
+		if (dynamic_cast<const ForNode*>(loop)) {
+			return "for";
+		}
+		if (dynamic_cast<const DoWhileNode*>(loop)) {
+			return "do-while";
+		}
+		return "while";
+	}
+
+	Environment& env;
+	CompilerOptions options;
+	VirtualMachine vm;
+	std::unordered_map<const ASTNode*, CompiledLoop> loops;
+	size_t compilations = 0;
+	size_t rejected = 0;
+	std::vector<Transition> transitions;
+};
@@ -0,0 +1,388 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "AST.hpp"
+
+// One recorded call or return, as read back by TraceFile
+struct TraceEvent {
+	enum class Kind : uint8_t { FUNCTION_ENTER, FUNCTION_EXIT, NATIVE_ENTER, NATIVE_EXIT };
+
+	Kind kind;
+	bool threw = false;         // Exits only
+	uint64_t time = 0;          // Nanoseconds since the recorder started
+	uint32_t name = 0;          // Into TraceFile::names
+	std::vector<double> args;   // Enters only, at most TraceRecorder::MAX_ARGUMENTS
+	double result = 0;          // Exits only
+
+	bool isEnter() const {
+		return kind == Kind::FUNCTION_ENTER || kind == Kind::NATIVE_ENTER;
+	}
+
+	bool isNative() const {
+		return kind == Kind::NATIVE_ENTER || kind == Kind::NATIVE_EXIT;
+	}
+};
+
+// Records script function calls, native calls with their arguments, and
+// their times into a binary ring buffer per thread. A thread only writes its
+// own buffer, with plain stores and no lock; when a buffer is full the oldest
+// records are overwritten. flush() copies the buffers while they are being
+// written and keeps only records that were complete and not overwritten.
+//
+// Set it as the ExecutionHooks of the Environments to trace; one recorder can
+// serve Environments on many threads. Statements are not recorded.
+class TraceRecorder : public ExecutionHooks {
+public:
+	static constexpr size_t MAX_ARGUMENTS = 255;  // Kept per call; the rest are dropped
+
+	// Room for at least `words` 8-byte words per thread. A call with n
+	// arguments takes n + 2 words on entry and 3 on return. A flush while a
+	// thread records keeps up to MAX_ARGUMENTS + 2 words less of it.
+	explicit TraceRecorder(size_t words = 1 << 16) {
+		capacity = 1024;
+		while (capacity < words) {
+			capacity *= 2;
+		}
+	}
+
+	TraceRecorder(const TraceRecorder&) = delete;
+	TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+	void onFunctionEnter(const std::string& name, const std::vector<double>& args) override {
+		enter(TraceEvent::Kind::FUNCTION_ENTER, name, args);
+	}
+
+	void onFunctionExit(const std::string& name, double result, bool threw) override {
+		exit(TraceEvent::Kind::FUNCTION_EXIT, name, result, threw);
+	}
+
+	void onNativeEnter(const std::string& name, const std::vector<double>& args) override {
+		enter(TraceEvent::Kind::NATIVE_ENTER, name, args);
+	}
+
+	void onNativeExit(const std::string& name, double result, bool threw) override {
+		exit(TraceEvent::Kind::NATIVE_EXIT, name, result, threw);
+	}
+
+	// Records written so far, over all threads, including overwritten ones
+	uint64_t getRecords() const {
+		std::lock_guard<std::mutex> lock(mutex);
+		uint64_t total = 0;
+		for (const std::unique_ptr<Buffer>& buffer : buffers) {
+			total += buffer->records.load(std::memory_order_relaxed);
+		}
+		return total;
+	}
+
+	// Write what the buffers hold to `path`, in the format TraceFile reads.
+	// May run while other threads record; the buffers are left as they are.
+	void flush(const std::string& path) const {
+		std::vector<std::pair<const Buffer*, std::vector<uint64_t>>> copies;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for (const std::unique_ptr<Buffer>& buffer : buffers) {
+				copies.emplace_back(buffer.get(), std::vector<uint64_t>());
+			}
+		}
+		std::vector<uint64_t> recorded;
+		for (auto& [buffer, words] : copies) {
+			words = copy(*buffer);
+			recorded.push_back(buffer->records.load(std::memory_order_relaxed));  // At least the records copied
+		}
+		std::vector<std::string> nameTable;
+		{
+			std::lock_guard<std::mutex> lock(mutex);  // After the copies: every name they use is in
+			nameTable = names;
+		}
+
+		std::ofstream file(path, std::ios::binary);
+		if (!file) {
+			throw std::runtime_error("Cannot write trace file: " + path);
+		}
+		file.write(MAGIC, sizeof(MAGIC));
+		put(file, startTime);
+		put(file, static_cast<uint32_t>(nameTable.size()));
+		for (const std::string& name : nameTable) {
+			put(file, static_cast<uint32_t>(name.size()));
+			file.write(name.data(), name.size());
+		}
+		put(file, static_cast<uint32_t>(copies.size()));
+		for (size_t i = 0; i < copies.size(); ++i) {
+			const std::vector<uint64_t>& words = copies[i].second;
+			put(file, copies[i].first->thread);
+			put(file, recorded[i]);
+			put(file, static_cast<uint64_t>(words.size()));
+			file.write(reinterpret_cast<const char*>(words.data()), words.size() * sizeof(uint64_t));
+		}
+		if (!file) {
+			throw std::runtime_error("Cannot write trace file: " + path);
+		}
+	}
+
+private:
+	friend struct TraceFile;
+
+	static constexpr char MAGIC[8] = { 'V', 'F', 'T', 'R', 'A', 'C', 'E', '1' };
+	static constexpr uint64_t RECORD_MARK = 0xA5;
+	static constexpr size_t MAX_RECORD_WORDS = MAX_ARGUMENTS + 2;
+
+	// A record is its time, its arguments or result, then a header word:
+	// name in bits 0-31, kind in 32-39, threw in 40, argument count in 48-55
+	// and RECORD_MARK on top. The header comes last so that records can be
+	// found walking back from the newest.
+	static uint64_t header(TraceEvent::Kind kind, uint32_t name, bool threw, size_t args) {
+		return name | static_cast<uint64_t>(kind) << 32 | static_cast<uint64_t>(threw) << 40
+			| static_cast<uint64_t>(args) << 48 | RECORD_MARK << 56;
+	}
+
+	// Words of the record a header ends, or 0 if it is not a header
+	static size_t recordWords(uint64_t header) {
+		if (header >> 56 != RECORD_MARK) {
+			return 0;
+		}
+		bool isEnter = (header >> 32 & 0xff) == static_cast<uint64_t>(TraceEvent::Kind::FUNCTION_ENTER)
+			|| (header >> 32 & 0xff) == static_cast<uint64_t>(TraceEvent::Kind::NATIVE_ENTER);
+		return isEnter ? 2 + (header >> 48 & 0xff) : 3;
+	}
+
+	// Written by one thread, read by flush. Words are atomics stored relaxed,
+	// which costs what plain stores do, and `head` publishes whole records.
+	struct Buffer {
+		uint32_t thread;
+		std::unique_ptr<std::atomic<uint64_t>[]> ring;
+		std::atomic<uint64_t> head{ 0 };     // Words ever written
+		std::atomic<uint64_t> records{ 0 };  // Records ever written
+		std::unordered_map<std::string, uint32_t> nameIds;  // Owner thread only
+	};
+
+	size_t capacity;
+	const uint64_t id = nextId()++;
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	const uint64_t startTime = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count());
+	std::vector<std::unique_ptr<Buffer>> buffers;
+	std::vector<std::string> names;
+	std::unordered_map<std::string, uint32_t> nameIds;
+	mutable std::mutex mutex;
+
+	static std::atomic<uint64_t>& nextId() {
+		static std::atomic<uint64_t> id{ 0 };
+		return id;
+	}
+
+	static uint64_t toBits(double value) {
+		uint64_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		return bits;
+	}
+
+	// This thread's buffer, made on its first record. Recorder ids are never
+	// reused, so a cached buffer of a destroyed recorder is never looked up.
+	Buffer& localBuffer() {
+		thread_local std::vector<Buffer*> cache;  // By recorder id
+		if (id < cache.size() && cache[id]) {
+			return *cache[id];
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		buffers.push_back(std::make_unique<Buffer>());
+		Buffer& buffer = *buffers.back();
+		buffer.thread = static_cast<uint32_t>(buffers.size() - 1);
+		buffer.ring.reset(new std::atomic<uint64_t>[capacity]());
+		if (cache.size() <= id) {
+			cache.resize(id + 1, nullptr);
+		}
+		cache[id] = &buffer;
+		return buffer;
+	}
+
+	// The id of a name, looked up in the thread's own table first
+	uint32_t nameId(Buffer& buffer, const std::string& name) {
+		auto found = buffer.nameIds.find(name);
+		if (found != buffer.nameIds.end()) {
+			return found->second;
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		auto shared = nameIds.find(name);
+		if (shared == nameIds.end()) {
+			shared = nameIds.emplace(name, static_cast<uint32_t>(names.size())).first;
+			names.push_back(name);
+		}
+		buffer.nameIds[name] = shared->second;
+		return shared->second;
+	}
+
+	uint64_t now() const {
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - start).count());
+	}
+
+	void enter(TraceEvent::Kind kind, const std::string& name, const std::vector<double>& args) {
+		Buffer& buffer = localBuffer();
+		uint32_t nameIndex = nameId(buffer, name);
+		size_t count = std::min(args.size(), MAX_ARGUMENTS);
+		uint64_t head = buffer.head.load(std::memory_order_relaxed);
+		size_t mask = capacity - 1;
+		buffer.ring[head++ & mask].store(now(), std::memory_order_relaxed);
+		for (size_t i = 0; i < count; ++i) {
+			buffer.ring[head++ & mask].store(toBits(args[i]), std::memory_order_relaxed);
+		}
+		buffer.ring[head++ & mask].store(header(kind, nameIndex, false, count), std::memory_order_relaxed);
+		publish(buffer, head);
+	}
+
+	void exit(TraceEvent::Kind kind, const std::string& name, double result, bool threw) {
+		Buffer& buffer = localBuffer();
+		uint32_t nameIndex = nameId(buffer, name);
+		uint64_t head = buffer.head.load(std::memory_order_relaxed);
+		size_t mask = capacity - 1;
+		buffer.ring[head++ & mask].store(now(), std::memory_order_relaxed);
+		buffer.ring[head++ & mask].store(toBits(result), std::memory_order_relaxed);
+		buffer.ring[head++ & mask].store(header(kind, nameIndex, threw, 0), std::memory_order_relaxed);
+		publish(buffer, head);
+	}
+
+	static void publish(Buffer& buffer, uint64_t head) {
+		buffer.records.store(buffer.records.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		buffer.head.store(head, std::memory_order_release);
+	}
+
+	// The whole records of a buffer, oldest first. Words the writer overwrote
+	// while they were copied are left out, and so are those the record it may
+	// have started but not published yet can reach.
+	std::vector<uint64_t> copy(const Buffer& buffer) const {
+		uint64_t end = buffer.head.load(std::memory_order_acquire);
+		uint64_t begin = end > capacity ? end - capacity : 0;
+		std::vector<uint64_t> words(end - begin);
+		for (uint64_t i = begin; i < end; ++i) {
+			words[i - begin] = buffer.ring[i & (capacity - 1)].load(std::memory_order_relaxed);
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+		uint64_t later = buffer.head.load(std::memory_order_relaxed);
+		uint64_t reach = later + MAX_RECORD_WORDS;
+		uint64_t valid = std::max(begin, reach > capacity ? reach - capacity : 0);
+
+		uint64_t first = end;
+		while (first > valid) {
+			size_t length = recordWords(words[first - 1 - begin]);
+			if (length == 0 || first - valid < length) {
+				break;
+			}
+			first -= length;
+		}
+		return std::vector<uint64_t>(words.begin() + (first - begin), words.end());
+	}
+
+	template<typename T>
+	static void put(std::ofstream& file, T value) {
+		file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+	}
+};
+
+// A trace written by TraceRecorder::flush, in native byte order
+struct TraceFile {
+	struct Thread {
+		uint32_t id;
+		uint64_t recorded = 0;  // Records written, including overwritten ones
+		std::vector<TraceEvent> events;  // Oldest first
+	};
+
+	uint64_t startTime = 0;  // Of the recorder, in nanoseconds since the Unix epoch
+	std::vector<std::string> names;
+	std::vector<Thread> threads;
+
+	static TraceFile read(const std::string& path) {
+		std::ifstream file(path, std::ios::binary);
+		char magic[sizeof(TraceRecorder::MAGIC)];
+		if (!file.read(magic, sizeof(magic)) || std::memcmp(magic, TraceRecorder::MAGIC, sizeof(magic)) != 0) {
+			throw std::runtime_error("Not a trace file: " + path);
+		}
+
+		TraceFile trace;
+		trace.startTime = get<uint64_t>(file);
+		trace.names.resize(get<uint32_t>(file));
+		for (std::string& name : trace.names) {
+			name.resize(get<uint32_t>(file));
+			file.read(name.data(), name.size());
+		}
+		trace.threads.resize(get<uint32_t>(file));
+		for (Thread& thread : trace.threads) {
+			thread.id = get<uint32_t>(file);
+			thread.recorded = get<uint64_t>(file);
+			std::vector<uint64_t> words(get<uint64_t>(file));
+			file.read(reinterpret_cast<char*>(words.data()), words.size() * sizeof(uint64_t));
+			if (!file) {
+				throw std::runtime_error("Truncated trace file: " + path);
+			}
+			decode(words, trace.names.size(), thread.events);
+		}
+		return trace;
+	}
+
+	// Records lost to full buffers
+	uint64_t dropped() const {
+		uint64_t total = 0;
+		for (const Thread& thread : threads) {
+			total += thread.recorded - thread.events.size();
+		}
+		return total;
+	}
+
+private:
+	template<typename T>
+	static T get(std::ifstream& file) {
+		T value{};
+		file.read(reinterpret_cast<char*>(&value), sizeof(value));
+		if (!file) {
+			throw std::runtime_error("Truncated trace file");
+		}
+		return value;
+	}
+
+	static double fromBits(uint64_t bits) {
+		double value;
+		std::memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+
+	// Walks back from the newest record, as the recorder found them
+	static void decode(const std::vector<uint64_t>& words, size_t nameCount, std::vector<TraceEvent>& events) {
+		size_t first = events.size();
+		size_t end = words.size();
+		while (end > 0) {
+			uint64_t header = words[end - 1];
+			size_t length = TraceRecorder::recordWords(header);
+			if (length == 0 || length > end || (header & 0xffffffff) >= nameCount) {
+				throw std::runtime_error("Corrupt trace record");
+			}
+			size_t position = end - length;
+			TraceEvent event;
+			event.kind = static_cast<TraceEvent::Kind>(header >> 32 & 0xff);
+			event.threw = (header >> 40 & 1) != 0;
+			event.name = static_cast<uint32_t>(header & 0xffffffff);
+			event.time = words[position];
+			if (event.isEnter()) {
+				for (size_t i = position + 1; i < end - 1; ++i) {
+					event.args.push_back(fromBits(words[i]));
+				}
+			}
+			else {
+				event.result = fromBits(words[position + 1]);
+			}
+			events.push_back(std::move(event));
+			end = position;
+		}
+		std::reverse(events.begin() + first, events.end());
+	}
+};
@@ -0,0 +1,600 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Bytecode.hpp"
+#include "Coverage.hpp"
+#include "HardwareCounters.hpp"
+#include "Metrics.hpp"
+#include "PerfMap.hpp"
+
+// Arithmetic sites of a quickening VirtualMachine
+struct QuickeningStats {
+	size_t quickened = 0;        // Rewrites to a specialized form
+	size_t deoptimizations = 0;  // Int forms that produced a non-int
+	// Where the sites are now; the specialized ones have stabilized
+	size_t intSites = 0;
+	size_t floatSites = 0;
+	size_t genericSites = 0;
+
+	std::string report() const {
+		std::ostringstream out;
+		out << "Quickening:\n"
+			<< "  sites: " << intSites << " int, " << floatSites << " float, " << genericSites << " generic\n"
+			<< "  rewrites: " << quickened << "\n"
+			<< "  deoptimizations: " << deoptimizations << "\n";
+		return out.str();
+	}
+};
+
+// Executes a CompiledProgram against an Environment. Each call gets a window
+// of registers on a shared stack. Every call instruction has an inline cache
+// holding its target and the Environment's registry version at lookup, so a
+// call costs a version compare until a function is registered or dropped.
+//
+// With quickening, the machine runs its own copy of the code of the last
+// program and rewrites ADD, SUBTRACT and MULTIPLY in place once their operand
+// types have stayed the same for a while: int forms skip the int check of
+// their result, float forms stop collecting feedback. Every value is still a
+// double, so an int is what passes CHECK_INT.
+//
+// The dispatch loop is built twice: calls made while the Environment has
+// ExecutionHooks run the build that reports statements, calls and native
+// calls, and the other build skips STATEMENT instructions and checks nothing.
+class VirtualMachine {
+public:
+	static constexpr uint8_t QUICKEN_AFTER = 8;  // Executions with the same operand types
+	static constexpr uint8_t MAX_DEOPTS = 2;     // Then a site keeps the float form
+
+	explicit VirtualMachine(Environment& env, bool quicken = false) : env(env), quicken(quicken) {}
+
+	// Run the top-level statements. Returns the loop value for a loop entry
+	// (see Compiler::compileLoopEntry), 0 for a whole program.
+	double run(const CompiledProgram& program) {
+		TimedExecution timed(*this);
+		ProgramState* state = prepare(program);
+		reserve(program.functions[0].registerCount);
+		return invoke(program, 0, state);
+	}
+
+	// Call a compiled script function by name
+	double call(const CompiledProgram& program, const std::string& name, const std::vector<double>& args) {
+		for (size_t index = 1; index < program.functions.size(); ++index) {
+			const BytecodeFunction& function = program.functions[index];
+			if (function.name != name) {
+				continue;
+			}
+			if (args.size() != function.parameters.size()) {
+				throw std::runtime_error("Function " + name + " expects " + std::to_string(function.parameters.size()) + " arguments");
+			}
+			TimedExecution timed(*this);
+			ProgramState* state = prepare(program);
+			reserve(function.registerCount);
+			std::copy(args.begin(), args.end(), registers.begin() + top);
+			return function.memoized ? executeMemoized(program, index, state) : invoke(program, index, state);
+		}
+		throw std::runtime_error("Undefined function: " + name);
+	}
+
+	QuickeningStats getQuickeningStats() const {
+		QuickeningStats result = stats;
+		for (const std::vector<Instruction>& code : state.code) {
+			for (const Instruction& instruction : code) {
+				switch (instruction.op) {
+				case OpCode::ADD: case OpCode::SUBTRACT: case OpCode::MULTIPLY: ++result.genericSites; break;
+				case OpCode::ADD_INT: case OpCode::SUBTRACT_INT: case OpCode::MULTIPLY_INT: ++result.intSites; break;
+				case OpCode::ADD_FLOAT: case OpCode::SUBTRACT_FLOAT: case OpCode::MULTIPLY_FLOAT: ++result.floatSites; break;
+				default: break;
+				}
+			}
+		}
+		return result;
+	}
+
+	// Call site lookups made because a cache was empty or out of date
+	size_t getCallCacheMisses() const {
+		return callCacheMisses;
+	}
+
+	// Record executions, native calls and stack growth in `metrics`, or stop
+	// with nullptr
+	void setMetrics(EngineMetrics* metrics) {
+		this->metrics = metrics;
+		state = ProgramState();  // Call caches hold the native call counters
+	}
+
+	// Attribute hardware counts to executions and compiled functions in
+	// `profile`, or stop with nullptr. Counters are read on every call.
+	void setCounterProfile(CounterProfile* profile) {
+		counterProfile = profile;
+	}
+
+	// Enter compiled functions through trampolines named in `map`, so that
+	// profilers attribute time to them. Locations are lines of `file`, whose
+	// text is `source`. Pass nullptr to call functions directly again.
+	void setPerfMap(PerfMap* map, const std::string& file = "script", std::string_view source = {}) {
+		perfMap = map && map->isEnabled() ? map : nullptr;
+		perfFile = file;
+		perfLines = PerfMap::lineStarts(source);
+		state = ProgramState();  // Trampolines are looked up when a program is prepared
+	}
+
+	// Mark the coverage of programs compiled for it, or a copy of it, in
+	// `coverage`; or stop with nullptr. Other programs mark nothing.
+	void setCoverage(ProgramCoverage* coverage) {
+		this->coverage = coverage;
+	}
+
+private:
+	// Target of a call instruction, valid while the registry version matches.
+	// Neither pointer is set when the name is undefined.
+	struct CallCache {
+		uint64_t version = 0;
+		const ScriptFunction* native = nullptr;
+		const FunctionNode* user = nullptr;
+		MetricsRegistry::Counter nativeCalls;  // Counts nothing without metrics
+	};
+
+	// What the machine keeps for the last program it started
+	struct ProgramState {
+		uint64_t id = 0;
+		std::vector<std::vector<Instruction>> code;      // Quickened copies, by function
+		std::vector<std::vector<CallCache>> callCaches;  // By function and call site
+		std::vector<PerfMap::Trampoline> trampolines;    // By function; empty without a perf map
+	};
+
+	Environment& env;
+	std::vector<double> registers;
+	size_t top = 0;  // First register past the active windows
+	bool quicken;
+	ProgramState state;
+	QuickeningStats stats;
+	size_t callCacheMisses = 0;
+	PerfMap* perfMap = nullptr;
+	CounterProfile* counterProfile = nullptr;
+	EngineMetrics* metrics = nullptr;
+	ProgramCoverage* coverage = nullptr;
+	std::string perfFile;
+	std::vector<size_t> perfLines;
+
+	// The state of a program, kept while the same program is run again. A
+	// different program started from inside a running one runs without state.
+	ProgramState* prepare(const CompiledProgram& program) {
+		if (program.id != 0 && state.id == program.id) {
+			return &state;
+		}
+		if (top != 0) {
+			return nullptr;
+		}
+		state = ProgramState();
+		state.id = program.id;
+		for (const BytecodeFunction& function : program.functions) {
+			if (quicken) {
+				state.code.push_back(function.code);
+			}
+			state.callCaches.emplace_back(function.callSites);
+			if (perfMap) {
+				state.trampolines.push_back(perfMap->trampoline(function.name,
+					PerfMap::location(perfFile, perfLines, function.sourceOffset)));
+			}
+		}
+		stats = QuickeningStats();
+		return &state;
+	}
+
+	CallCache lookup(const std::string& name) {
+		++callCacheMisses;
+		CallCache cache;
+		cache.version = env.getRegistryVersion();
+		cache.native = env.findNativeFunction(name);
+		cache.user = cache.native ? nullptr : env.findUserFunction(name);
+		if (metrics && cache.native) {
+			cache.nativeCalls = metrics->nativeCalls(name);
+		}
+		return cache;
+	}
+
+	static double callNative(const ScriptFunction& native, const double* r, const uint32_t* list) {
+		std::vector<double> args(list[0]);
+		for (uint32_t i = 0; i < list[0]; ++i) {
+			args[i] = r[list[i + 1]];
+		}
+		return native(args);
+	}
+
+	// callNative, reported to the hooks if there still are any
+	double callNativeTraced(const ScriptFunction& native, const std::string& name, const double* r, const uint32_t* list) {
+		ExecutionHooks* hooks = env.getHooks();
+		if (!hooks) {
+			return callNative(native, r, list);
+		}
+		std::vector<double> args(list[0]);
+		for (uint32_t i = 0; i < list[0]; ++i) {
+			args[i] = r[list[i + 1]];
+		}
+		return hooks->traceNative(name, args, [&] { return native(args); });
+	}
+
+	static OpCode specialized(OpCode op, bool ints) {
+		switch (op) {
+		case OpCode::ADD: return ints ? OpCode::ADD_INT : OpCode::ADD_FLOAT;
+		case OpCode::SUBTRACT: return ints ? OpCode::SUBTRACT_INT : OpCode::SUBTRACT_FLOAT;
+		default: return ints ? OpCode::MULTIPLY_INT : OpCode::MULTIPLY_FLOAT;
+		}
+	}
+
+	static OpCode generic(OpCode op) {
+		switch (op) {
+		case OpCode::ADD_INT: return OpCode::ADD;
+		case OpCode::SUBTRACT_INT: return OpCode::SUBTRACT;
+		default: return OpCode::MULTIPLY;
+		}
+	}
+
+	// Count runs of a generic site with the same operand and result types and
+	// specialize it after QUICKEN_AFTER. The feedback byte holds the last types
+	// in its top bit and the run length below; a specialized int site keeps
+	// whether an int check of its result follows.
+	void observe(Instruction& site, double left, double right, double result) {
+		uint8_t ints = isIntValue(left) && isIntValue(right) && isIntValue(result) ? 0x80 : 0;
+		uint8_t count = (site.feedback & 0x80) == ints ? (site.feedback & 0x7f) + 1 : 1;
+		site.feedback = ints | count;
+		if (count < QUICKEN_AFTER) {
+			return;
+		}
+		const Instruction& next = (&site)[1];  // A terminator always follows
+		site.op = specialized(site.op, ints != 0);
+		site.feedback = ints && next.op == OpCode::CHECK_INT && next.a == site.a;
+		++stats.quickened;
+	}
+
+	// An int site produced a non-int: back to generic, or to the float form
+	// once it has flipped MAX_DEOPTS times
+	void deoptimize(Instruction& site) {
+		site.op = generic(site.op);
+		site.feedback = 0;
+		++stats.deoptimizations;
+		if (++site.deopts >= MAX_DEOPTS) {
+			site.op = specialized(site.op, false);
+			++stats.quickened;
+		}
+	}
+
+	void reserve(size_t count) {
+		if (registers.size() < top + count) {
+			size_t size = std::max(top + count, registers.size() * 2);
+			if (metrics) {
+				metrics->stackBytes.add((size - registers.size()) * sizeof(double));
+			}
+			registers.resize(size);
+		}
+	}
+
+	// Records an outermost run or call in the metrics, also when it throws
+	struct TimedExecution {
+		EngineMetrics* metrics;
+		std::chrono::steady_clock::time_point start;
+
+		explicit TimedExecution(VirtualMachine& vm) : metrics(vm.top == 0 ? vm.metrics : nullptr) {
+			if (metrics) {
+				start = std::chrono::steady_clock::now();
+			}
+		}
+
+		~TimedExecution() {
+			if (metrics) {
+				metrics->executions.add();
+				metrics->executionSeconds.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+			}
+		}
+	};
+
+	// Restores the register stack and the call frame, also when unwinding
+	struct CallScope {
+		VirtualMachine& vm;
+		size_t base;
+		bool usesFrame;
+
+		CallScope(VirtualMachine& vm, size_t base, bool usesFrame) : vm(vm), base(base), usesFrame(usesFrame) {
+			if (usesFrame) {
+				vm.env.pushFrame();
+			}
+		}
+
+		~CallScope() {
+			vm.top = base;
+			if (usesFrame) {
+				vm.env.popFrame();
+			}
+		}
+	};
+
+	struct TrampolineCall {
+		VirtualMachine* vm;
+		const CompiledProgram* program;
+		ProgramState* state;
+		std::exception_ptr error;  // Exceptions cannot unwind through a trampoline
+	};
+
+	template<bool Traced>
+	static double enter(void* context, size_t index) {
+		auto call = static_cast<TrampolineCall*>(context);
+		try {
+			return call->vm->execute<Traced>(*call->program, index, call->state);
+		}
+		catch (...) {
+			call->error = std::current_exception();
+			return 0;
+		}
+	}
+
+	// Counts a call in the counter profile, also when unwinding
+	struct CountedCall {
+		CounterProfile* profile;
+		const std::string& function;
+
+		CountedCall(CounterProfile* profile, const std::string& function) : profile(profile), function(function) {
+			if (profile) {
+				profile->enter();
+			}
+		}
+
+		~CountedCall() {
+			if (profile) {
+				profile->exit(function);
+			}
+		}
+	};
+
+	// Run function `index`, in the traced build while there are hooks
+	double invoke(const CompiledProgram& program, size_t index, ProgramState* state) {
+		CountedCall counted(counterProfile, program.functions[index].name);
+		ExecutionHooks* hooks = env.getHooks();
+		if (!hooks) {
+			return dispatch<false>(program, index, state);
+		}
+		if (index == 0) {
+			return dispatch<true>(program, index, state);  // Top-level code is no function call
+		}
+		const BytecodeFunction& function = program.functions[index];
+		std::vector<double> args(registers.begin() + top, registers.begin() + top + function.parameters.size());
+		return hooks->traceFunction(function.name, args, [&] { return dispatch<true>(program, index, state); });
+	}
+
+	// Run function `index` through its trampoline, if it has one
+	template<bool Traced>
+	double dispatch(const CompiledProgram& program, size_t index, ProgramState* state) {
+		if (!state || state->trampolines.empty() || !state->trampolines[index]) {
+			return execute<Traced>(program, index, state);
+		}
+		TrampolineCall call{ this, &program, state, nullptr };
+		double result = state->trampolines[index](&call, index, &VirtualMachine::enter<Traced>);
+		if (call.error) {
+			std::rethrow_exception(call.error);
+		}
+		return result;
+	}
+
+	// Run a memoized function unless the Environment has its result for the
+	// arguments, which are already in the registers at `top`
+	double executeMemoized(const CompiledProgram& program, size_t index, ProgramState* state) {
+		const BytecodeFunction& function = program.functions[index];
+		std::vector<double> args(registers.begin() + top, registers.begin() + top + function.parameters.size());
+		double result;
+		if (!env.findMemoized(function.name, args, result)) {
+			result = invoke(program, index, state);
+			env.memoize(function.name, args, result);
+		}
+		return result;
+	}
+
+	// Run function `index`; its arguments are already in the registers at `top`
+	template<bool Traced>
+	double execute(const CompiledProgram& program, size_t index, ProgramState* state) {
+		const BytecodeFunction& function = program.functions[index];
+		size_t base = top;
+		top += function.registerCount;
+		CallScope scope(*this, base, function.usesFrame);
+
+		double* r = registers.data() + base;
+		Instruction* sites = state && quicken ? state->code[index].data() : nullptr;  // Rewritable code
+		const Instruction* code = sites ? sites : function.code.data();
+		CallCache* caches = state ? state->callCaches[index].data() : nullptr;
+		const uint32_t* lists = function.argumentLists.data();
+		const std::vector<std::string>& names = program.names;
+		uint8_t* hits = coverage && program.coverageId != 0 && coverage->getId() == program.coverageId
+			? coverage->getBitmap() : nullptr;
+		size_t pc = 0;
+
+		// Step the variable of a counted loop and return it
+		auto advance = [&](const Instruction& instruction) {
+			double& variable = r[instruction.a];
+			variable += r[instruction.a + 1];
+			if (instruction.c && !isIntValue(variable)) {
+				throw std::runtime_error("Type error: Expected int value for variable " + names[instruction.c - 1]);
+			}
+			return variable;
+		};
+
+		// Store the result of an int form, which is computed like the generic
+		// instruction. It guards on the result being an int, which also lets it
+		// skip the int check that may follow.
+		auto intOperation = [&](const Instruction& instruction, double result) {
+			if (!isIntValue(result)) {
+				deoptimize(sites[pc - 1]);
+			}
+			else if (instruction.feedback) {
+				++pc;
+			}
+			r[instruction.a] = result;
+		};
+
+		// The target of the call with argument list `list`
+		CallCache uncached;
+		auto target = [&](const uint32_t* list, const std::string& name) -> const CallCache& {
+			CallCache& cache = caches ? caches[list[list[0] + 1]] : uncached;
+			if (!caches || cache.version != env.getRegistryVersion()) {
+				cache = lookup(name);
+			}
+			return cache;
+		};
+
+		for (;;) {
+			const Instruction& instruction = code[pc++];
+			switch (instruction.op) {
+			case OpCode::LOAD_CONSTANT: r[instruction.a] = function.constants[instruction.b]; break;
+			case OpCode::MOVE: r[instruction.a] = r[instruction.b]; break;
+			case OpCode::ADD:
+				if (sites) {
+					observe(sites[pc - 1], r[instruction.b], r[instruction.c], r[instruction.b] + r[instruction.c]);
+				}
+				r[instruction.a] = r[instruction.b] + r[instruction.c];
+				break;
+			case OpCode::SUBTRACT:
+				if (sites) {
+					observe(sites[pc - 1], r[instruction.b], r[instruction.c], r[instruction.b] - r[instruction.c]);
+				}
+				r[instruction.a] = r[instruction.b] - r[instruction.c];
+				break;
+			case OpCode::MULTIPLY:
+				if (sites) {
+					observe(sites[pc - 1], r[instruction.b], r[instruction.c], r[instruction.b] * r[instruction.c]);
+				}
+				r[instruction.a] = r[instruction.b] * r[instruction.c];
+				break;
+			case OpCode::ADD_INT: intOperation(instruction, r[instruction.b] + r[instruction.c]); break;
+			case OpCode::SUBTRACT_INT: intOperation(instruction, r[instruction.b] - r[instruction.c]); break;
+			case OpCode::MULTIPLY_INT: intOperation(instruction, r[instruction.b] * r[instruction.c]); break;
+			case OpCode::ADD_FLOAT: r[instruction.a] = r[instruction.b] + r[instruction.c]; break;
+			case OpCode::SUBTRACT_FLOAT: r[instruction.a] = r[instruction.b] - r[instruction.c]; break;
+			case OpCode::MULTIPLY_FLOAT: r[instruction.a] = r[instruction.b] * r[instruction.c]; break;
+			case OpCode::DIVIDE:
+				if (r[instruction.c] == 0) {
+					throw std::runtime_error("Division by zero");
+				}
+				r[instruction.a] = r[instruction.b] / r[instruction.c];
+				break;
+			case OpCode::EQUALS: r[instruction.a] = (r[instruction.b] == r[instruction.c]) ? 1 : 0; break;
+			case OpCode::NOT_EQUALS: r[instruction.a] = (r[instruction.b] != r[instruction.c]) ? 1 : 0; break;
+			case OpCode::LESS: r[instruction.a] = (r[instruction.b] < r[instruction.c]) ? 1 : 0; break;
+			case OpCode::LESS_EQUALS: r[instruction.a] = (r[instruction.b] <= r[instruction.c]) ? 1 : 0; break;
+			case OpCode::GREATER: r[instruction.a] = (r[instruction.b] > r[instruction.c]) ? 1 : 0; break;
+			case OpCode::GREATER_EQUALS: r[instruction.a] = (r[instruction.b] >= r[instruction.c]) ? 1 : 0; break;
+			case OpCode::AND: r[instruction.a] = (r[instruction.b] != 0 && r[instruction.c] != 0) ? 1 : 0; break;
+			case OpCode::OR: r[instruction.a] = (r[instruction.b] != 0 || r[instruction.c] != 0) ? 1 : 0; break;
+			case OpCode::NEGATE: r[instruction.a] = -r[instruction.b]; break;
+			case OpCode::NOT: r[instruction.a] = (r[instruction.b] == 0) ? 1 : 0; break;
+			case OpCode::CHECK_INT:
+				if (!isIntValue(r[instruction.a])) {
+					throw std::runtime_error("Type error: Expected int value for variable " + names[instruction.b]);
+				}
+				break;
+			case OpCode::DECLARE_VAR:
+				env.declareVariable(names[instruction.a], static_cast<ValueType>(instruction.b));
+				break;
+			case OpCode::LOAD_VAR: r[instruction.a] = env.getVariable(names[instruction.b]); break;
+			case OpCode::STORE_VAR: env.setVariable(names[instruction.a], r[instruction.b]); break;
+			case OpCode::LOAD_GLOBAL: r[instruction.a] = env.getGlobalVariable(names[instruction.b]); break;
+			case OpCode::STORE_GLOBAL: env.setGlobalVariable(names[instruction.a], r[instruction.b]); break;
+			case OpCode::CALL: {
+				const BytecodeFunction& callee = program.functions[instruction.b];
+				const uint32_t* list = lists + instruction.c;
+				const CallCache& shadow = target(list, callee.name);
+				if (shadow.native) {
+					shadow.nativeCalls.add();
+					// Registered after compilation, shadows the script
+					double result = Traced ? callNativeTraced(*shadow.native, callee.name, r, list) : callNative(*shadow.native, r, list);
+					r = registers.data() + base;
+					r[instruction.a] = result;
+					break;
+				}
+				reserve(callee.registerCount);
+				r = registers.data() + base;
+				for (uint32_t i = 0; i < list[0]; ++i) {
+					registers[top + i] = r[list[i + 1]];
+				}
+				double result = callee.memoized ? executeMemoized(program, instruction.b, state) : invoke(program, instruction.b, state);
+				r = registers.data() + base;  // The stack may have grown
+				r[instruction.a] = result;
+				break;
+			}
+			case OpCode::CALL_NATIVE: {
+				const uint32_t* list = lists + instruction.c;
+				const CallCache& callee = target(list, names[instruction.b]);
+				double result;
+				if (callee.native) {
+					callee.nativeCalls.add();
+					result = Traced ? callNativeTraced(*callee.native, names[instruction.b], r, list) : callNative(*callee.native, r, list);
+				}
+				else {
+					std::vector<double> args(list[0]);
+					for (uint32_t i = 0; i < list[0]; ++i) {
+						args[i] = r[list[i + 1]];
+					}
+					result = callee.user ? callee.user->call(env, args) : env.evaluateFunction(names[instruction.b], args);
+				}
+				r = registers.data() + base;  // Natives may re-enter the machine
+				r[instruction.a] = result;
+				break;
+			}
+			case OpCode::JUMP: pc = instruction.a; break;
+			case OpCode::JUMP_IF_FALSE:
+				if (r[instruction.a] == 0) {
+					pc = instruction.b;
+				}
+				break;
+			case OpCode::JUMP_IF_TRUE:
+				if (r[instruction.a] != 0) {
+					pc = instruction.b;
+				}
+				break;
+			case OpCode::LOOP_LESS:
+				if (advance(instruction) < r[instruction.a + 2]) {
+					pc = instruction.b;
+				}
+				break;
+			case OpCode::LOOP_LESS_EQUALS:
+				if (advance(instruction) <= r[instruction.a + 2]) {
+					pc = instruction.b;
+				}
+				break;
+			case OpCode::LOOP_GREATER:
+				if (advance(instruction) > r[instruction.a + 2]) {
+					pc = instruction.b;
+				}
+				break;
+			case OpCode::LOOP_GREATER_EQUALS:
+				if (advance(instruction) >= r[instruction.a + 2]) {
+					pc = instruction.b;
+				}
+				break;
+			case OpCode::STATEMENT:
+				if (Traced) {
+					if (ExecutionHooks* hooks = env.getHooks()) {
+						if (instruction.b == 0) {
+							hooks->onStatement(instruction.a);
+						}
+						else {
+							hooks->onBranch(instruction.a, instruction.b - 1);
+						}
+						r = registers.data() + base;  // Hooks may re-enter the machine
+					}
+				}
+				break;
+			case OpCode::COVER:
+				if (hits) {
+					hits[instruction.a] = 1;
+				}
+				break;
+			case OpCode::RETURN:
+				return r[instruction.a];
+			}
+		}
+	}
+};
@@ -0,0 +1,188 @@
+#include "TraceRecorder.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Reads a trace written by TraceRecorder::flush and prints per-function
+// latency distributions, and with --timeline the calls of all threads in
+// time order, nested by call depth.
+
+struct Call {
+	uint32_t thread;
+	size_t depth;
+	const TraceEvent* enter;
+	const TraceEvent* exit;  // nullptr while still running at the flush
+};
+
+// Pairs the enters and exits of each thread. Exits whose enter was
+// overwritten in the ring buffer are skipped.
+std::vector<Call> matchCalls(const TraceFile& trace) {
+	std::vector<Call> calls;
+	for (const TraceFile::Thread& thread : trace.threads) {
+		std::vector<size_t> stack;  // Into calls
+		for (const TraceEvent& event : thread.events) {
+			if (event.isEnter()) {
+				stack.push_back(calls.size());
+				calls.push_back({ thread.id, stack.size() - 1, &event, nullptr });
+			}
+			else if (!stack.empty() && calls[stack.back()].enter->name == event.name) {
+				calls[stack.back()].exit = &event;
+				stack.pop_back();
+			}
+		}
+	}
+	return calls;
+}
+
+std::string formatMicroseconds(double nanoseconds) {
+	char text[32];
+	std::snprintf(text, sizeof(text), "%.3f", nanoseconds / 1000);
+	return text;
+}
+
+double percentile(const std::vector<double>& sorted, double fraction) {
+	size_t index = static_cast<size_t>(std::ceil(fraction * sorted.size()));
+	return sorted[std::min(sorted.size() - 1, index == 0 ? 0 : index - 1)];
+}
+
+void printLatencies(const TraceFile& trace, const std::vector<Call>& calls, bool histograms) {
+	std::map<std::string, std::vector<double>> durations;  // By kind and name
+	std::map<std::string, size_t> threw;
+	for (const Call& call : calls) {
+		if (!call.exit) {
+			continue;
+		}
+		std::string key = (call.enter->isNative() ? "native " : "script ") + trace.names[call.enter->name];
+		durations[key].push_back(static_cast<double>(call.exit->time - call.enter->time));
+		threw[key] += call.exit->threw;
+	}
+
+	std::cout << "Latency (us)        calls      min      p50      p90      p99      max  threw\n";
+	for (auto& [name, values] : durations) {
+		std::sort(values.begin(), values.end());
+		char line[256];
+		std::snprintf(line, sizeof(line), "%-18s %6zu %8s %8s %8s %8s %8s %6zu\n", name.c_str(), values.size(),
+			formatMicroseconds(values.front()).c_str(), formatMicroseconds(percentile(values, 0.5)).c_str(),
+			formatMicroseconds(percentile(values, 0.9)).c_str(), formatMicroseconds(percentile(values, 0.99)).c_str(),
+			formatMicroseconds(values.back()).c_str(), threw[name]);
+		std::cout << line;
+		if (!histograms) {
+			continue;
+		}
+		// Buckets by powers of two nanoseconds
+		std::map<int, size_t> buckets;
+		for (double value : values) {
+			++buckets[value < 1 ? 0 : static_cast<int>(std::log2(value)) + 1];
+		}
+		size_t largest = 0;
+		for (const auto& [bucket, count] : buckets) {
+			largest = std::max(largest, count);
+		}
+		for (const auto& [bucket, count] : buckets) {
+			std::snprintf(line, sizeof(line), "  < %12s us %6zu ", formatMicroseconds(std::ldexp(1.0, bucket)).c_str(), count);
+			std::cout << line << std::string((count * 40 + largest - 1) / largest, '#') << "\n";
+		}
+	}
+}
+
+void printTimeline(const TraceFile& trace, const std::vector<Call>& calls, size_t limit) {
+	struct Line {
+		uint64_t time;
+		uint32_t thread;
+		std::string text;
+	};
+	std::vector<Line> lines;
+	for (const Call& call : calls) {
+		std::string indent(call.depth * 2, ' ');
+		const std::string& name = trace.names[call.enter->name];
+		std::ostringstream enter;
+		enter << indent << "-> " << name << "(";
+		for (size_t i = 0; i < call.enter->args.size(); ++i) {
+			enter << (i ? ", " : "") << call.enter->args[i];
+		}
+		enter << ")";
+		lines.push_back({ call.enter->time, call.thread, enter.str() });
+		if (call.exit) {
+			std::ostringstream exit;
+			exit << indent << "<- " << name;
+			if (call.exit->threw) {
+				exit << " threw";
+			}
+			else {
+				exit << " = " << call.exit->result;
+			}
+			exit << " after " << formatMicroseconds(static_cast<double>(call.exit->time - call.enter->time)) << " us";
+			lines.push_back({ call.exit->time, call.thread, exit.str() });
+		}
+	}
+	std::stable_sort(lines.begin(), lines.end(), [](const Line& a, const Line& b) { return a.time < b.time; });
+
+	std::cout << "Timeline (us since the recorder started)\n";
+	for (size_t i = 0; i < lines.size() && i < limit; ++i) {
+		char prefix[64];
+		std::snprintf(prefix, sizeof(prefix), "%14s  thread %u  ", formatMicroseconds(static_cast<double>(lines[i].time)).c_str(), lines[i].thread);
+		std::cout << prefix << lines[i].text << "\n";
+	}
+	if (lines.size() > limit) {
+		std::cout << "... " << lines.size() - limit << " more\n";
+	}
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 2) {
+		std::cerr << "Usage: vfTrace <trace file> [--timeline [limit]] [--histograms]" << std::endl;
+		return 2;
+	}
+	bool timeline = false;
+	bool histograms = false;
+	size_t limit = SIZE_MAX;
+	for (int i = 2; i < argc; ++i) {
+		std::string option = argv[i];
+		if (option == "--timeline") {
+			timeline = true;
+			if (i + 1 < argc && std::isdigit(static_cast<unsigned char>(argv[i + 1][0]))) {
+				limit = std::stoul(argv[++i]);
+			}
+		}
+		else if (option == "--histograms") {
+			histograms = true;
+		}
+		else {
+			std::cerr << "Unknown option: " << option << std::endl;
+			return 2;
+		}
+	}
+
+	try {
+		TraceFile trace = TraceFile::read(argv[1]);
+		size_t events = 0;
+		uint64_t last = 0;
+		for (const TraceFile::Thread& thread : trace.threads) {
+			events += thread.events.size();
+			if (!thread.events.empty()) {
+				last = std::max(last, thread.events.back().time);
+			}
+		}
+		std::cout << "Trace: " << trace.threads.size() << " threads, " << events << " events ("
+			<< trace.dropped() << " dropped), " << formatMicroseconds(static_cast<double>(last)) << " us\n";
+
+		std::vector<Call> calls = matchCalls(trace);
+		printLatencies(trace, calls, histograms);
+		if (timeline) {
+			printTimeline(trace, calls, limit);
+		}
+	}
+	catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -24,3 +24,25 @@ project "vfScript"
    filter "configurations:Release"
       defines { "NDEBUG" }
       optimize "On"
+
+
+-- Project 2: Trace tool, reads the files TraceRecorder writes
+project "vfTrace"
+   kind "ConsoleApp"
+   language "C++"
+   cppdialect "C++20"
+   location "Interpreter/trace"
+   targetdir "bin/%{prj.name}/%{cfg.buildcfg}/%{cfg.platform}"
+
+   files { "Interpreter/trace/**.cpp" }
+   includedirs { "Interpreter/script" }
+
+   defines { "_CRT_SECURE_NO_WARNINGS" }
+
+   filter "configurations:Debug"
+      defines { "DEBUG" }
+      symbols "On"
+
+   filter "configurations:Release"
+      defines { "NDEBUG" }
+      optimize "On"